@@ -0,0 +1,97 @@
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "gc.h"
+
+char *arena_top = NULL;
+char *arena_limit = NULL;
+ArenaChunk *arena_chunks = NULL;
+void (*arena_stats_hook)(ArenaStats *stats) = NULL;
+
+static long n_refills = 0;
+
+/**
+ * Slow path of arena_alloc: the current chunk can't fit n_bytes, so collects
+ * garbage or starts a new chunk. Also called directly by generated code.
+ * Params:
+ *   n_bytes: Multiple of 8
+ * Returns:
+ *   Pointer to n_bytes of memory
+ */
+void *arena_refill(long n_bytes) {
+  if (n_refills == 0 && getenv("LFL_ARENA_STATS") != NULL) {
+    atexit(arena_print_stats);
+  }
+  ++n_refills;
+  long object_size = ARENA_HEADER_SIZE + n_bytes;
+  long chunk_size =
+      object_size > ARENA_CHUNK_SIZE ? object_size : ARENA_CHUNK_SIZE;
+  gc_maybe_collect(chunk_size);
+  if (object_size > arena_limit - arena_top) {
+    gc_reserve(chunk_size);
+    arena_push_chunk(arena_make_chunk(chunk_size));
+  }
+  if (arena_stats_hook != NULL) {
+    ArenaStats stats;
+    arena_get_stats(&stats);
+    arena_stats_hook(&stats);
+  }
+  return arena_alloc(n_bytes);
+}
+
+/**
+ * Returns:
+ *   Chunk of n_bytes, not yet in use by the arena
+ */
+ArenaChunk *arena_make_chunk(long n_bytes) {
+  ArenaChunk *chunk = malloc(sizeof(*chunk) + n_bytes);
+  if (chunk == NULL) {
+    fprintf(stderr, "ERROR! Out of memory.\n");
+    exit(1);
+  }
+  chunk->next = NULL;
+  chunk->start = (char *)(chunk + 1);
+  chunk->top = chunk->start;
+  chunk->end = chunk->start + n_bytes;
+  return chunk;
+}
+
+/**
+ * Makes chunk the one that allocations come from.
+ */
+void arena_push_chunk(ArenaChunk *chunk) {
+  // Record how much of the old chunk was used before abandoning it
+  if (arena_chunks != NULL) {
+    arena_chunks->top = arena_top;
+  }
+  chunk->next = arena_chunks;
+  arena_chunks = chunk;
+  arena_top = chunk->start;
+  arena_limit = chunk->end;
+}
+
+void arena_get_stats(ArenaStats *stats) {
+  stats->n_chunks = 0;
+  stats->n_refills = n_refills;
+  stats->bytes_allocated = 0;
+  stats->bytes_reserved = 0;
+  for (ArenaChunk *chunk = arena_chunks; chunk != NULL; chunk = chunk->next) {
+    char *top = (chunk == arena_chunks) ? arena_top : chunk->top;
+    ++stats->n_chunks;
+    stats->bytes_allocated += top - chunk->start;
+    stats->bytes_reserved += chunk->end - chunk->start;
+  }
+}
+
+/**
+ * Registered with atexit when the LFL_ARENA_STATS environment variable is set.
+ */
+void arena_print_stats(void) {
+  ArenaStats stats;
+  arena_get_stats(&stats);
+  fprintf(stderr,
+          "arena: %ld bytes allocated, %ld bytes reserved in %ld chunks, %ld "
+          "refills\n",
+          stats.bytes_allocated, stats.bytes_reserved, stats.n_chunks,
+          stats.n_refills);
+}
@@ -0,0 +1,68 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+// Size of each chunk the arena requests from malloc. Allocations larger than
+// this get a chunk of their own.
+#ifndef ARENA_CHUNK_SIZE
+#define ARENA_CHUNK_SIZE (1 << 20)
+#endif
+
+// Every allocation is preceded by a header word holding its size in bytes,
+// so that the garbage collector can walk and copy objects. The high bits
+// hold the number of its allocation site, if heap profiling.
+#define ARENA_HEADER_SIZE 8
+#define ARENA_SITE_SHIFT 32
+#define ARENA_SIZE(header) ((header) & ((1L << ARENA_SITE_SHIFT) - 1))
+#define ARENA_SITE(header) ((header) >> ARENA_SITE_SHIFT)
+
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;  // Previously filled chunk
+  char *start;
+  char *top;  // End of the used part, once the chunk has been filled
+  char *end;
+} ArenaChunk;
+
+typedef struct ArenaStats {
+  long n_chunks;         // Chunks currently held
+  long n_refills;        // Allocations that missed the fast path
+  long bytes_allocated;  // Bytes in use, including headers and padding
+  long bytes_reserved;   // Bytes obtained from malloc for chunks
+} ArenaStats;
+
+// Bump pointer and end of the current chunk. Generated code reads and writes
+// these directly, so allocation only leaves the generated code on refill.
+extern char *arena_top;
+extern char *arena_limit;
+
+// Current chunk first.
+extern ArenaChunk *arena_chunks;
+
+// Called with the current statistics after every refill, if set.
+extern void (*arena_stats_hook)(ArenaStats *stats);
+
+void *arena_refill(long n_bytes);
+
+ArenaChunk *arena_make_chunk(long n_bytes);
+
+void arena_push_chunk(ArenaChunk *chunk);
+
+void arena_get_stats(ArenaStats *stats);
+
+void arena_print_stats(void);
+
+/**
+ * Allocates n_bytes from the current chunk, rounded up to 8 bytes.
+ * Memory is reclaimed by the garbage collector.
+ */
+static inline void *arena_alloc(long n_bytes) {
+  n_bytes = (n_bytes + 7) & ~7L;
+  if (n_bytes + ARENA_HEADER_SIZE > arena_limit - arena_top) {
+    return arena_refill(n_bytes);
+  }
+  long *header = (long *)arena_top;
+  *header = n_bytes;
+  arena_top += ARENA_HEADER_SIZE + n_bytes;
+  return header + 1;
+}
+
+#endif
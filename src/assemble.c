@@ -0,0 +1,876 @@
+#include "assemble.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Assembler for the NASM that the compiler writes out, and for standard.asm,
+ * into an Object of machine code.
+ *
+ * Only what the compiler emits is understood: instructions whose operands are
+ * registers, immediates, which may be symbols, and memory at a base register
+ * plus a scaled index register plus a displacement, or at a symbol; and the
+ * bits, default rel, section, global, extern, align, db, dd and dq directives.
+ * Memory at a symbol is addressed relative to rip, and jumps and calls always
+ * take a 32-bit displacement, so the size of every instruction is known as
+ * it's assembled.
+ * Anything else is an error, even if NASM would accept it.
+ */
+
+// Operands of a directive, at most
+#define MAX_ARGS 64
+
+// Length of a local label's name, including the label it's under, at most
+#define MAX_LABEL_LENGTH 256
+
+typedef struct Operand {
+  enum { operand_reg, operand_mem, operand_imm } kind;
+  int size;  // In bytes, or 0 if not known
+  int reg;   // Register of operand_reg
+  int base;  // Registers of operand_mem, or -1
+  int index;
+  int scale;
+  long value;  // Immediate, or displacement, added to symbol
+  int symbol;  // Symbol whose address is part of the value, or -1
+} Operand;
+
+typedef struct Assembler {
+  Object *object;
+  SectionId section;  // Being assembled into
+  char *scope;        // Last label not starting with '.', or NULL
+  int line;           // From 1, for errors
+} Assembler;
+
+enum { RSP = 4, RBP = 5 };
+
+// Registers in the order they're encoded, by size: 64, 32 and 8 bits
+static char *registers[3][16] = {
+    {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10",
+     "r11", "r12", "r13", "r14", "r15"},
+    {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d",
+     "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"},
+    {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b",
+     "r11b", "r12b", "r13b", "r14b", "r15b"}};
+
+static int register_sizes[3] = {8, 4, 1};
+
+// Condition codes of jcc and setcc, in the order they're encoded
+static char *conditions[16] = {"o", "no", "b", "ae", "e", "ne", "be", "a",
+                               "s", "ns", "p", "np", "l", "ge", "le", "g"};
+
+static struct {
+  char *name;
+  int code;
+} condition_aliases[] = {{"c", 2},   {"nae", 2}, {"nb", 3},   {"nc", 3},
+                         {"z", 4},   {"nz", 5},  {"na", 6},   {"nbe", 7},
+                         {"pe", 10}, {"po", 11}, {"nge", 12}, {"nl", 13},
+                         {"ng", 14}, {"nle", 15}};
+
+typedef struct OpEncoding {
+  char *name;
+  int opcode;     // One or two bytes, the first in the high byte if two
+  int extension;  // Of the opcode, in ModRM's reg field
+} OpEncoding;
+
+static OpEncoding no_operand_ops[] = {
+    {.name = "ret", .opcode = 0xc3},     {.name = "leave", .opcode = 0xc9},
+    {.name = "cqo", .opcode = 0x4899},   {.name = "cdq", .opcode = 0x99},
+    {.name = "rdtsc", .opcode = 0x0f31}, {.name = "nop", .opcode = 0x90},
+    {.name = "stosq", .opcode = 0x48ab}, {.name = "movsq", .opcode = 0x48a5}};
+
+static OpEncoding one_operand_ops[] = {
+    {"inc", 0xff, 0}, {"dec", 0xff, 1}, {"not", 0xf7, 2},  {"neg", 0xf7, 3},
+    {"mul", 0xf7, 4}, {"imul", 0xf7, 5}, {"div", 0xf7, 6}, {"idiv", 0xf7, 7}};
+
+// The opcodes of these depend on the form of their operands
+static OpEncoding arithmetic_ops[] = {{"add", 0, 0}, {"or", 0, 1},
+                                      {"and", 0, 4}, {"sub", 0, 5},
+                                      {"xor", 0, 6}, {"cmp", 0, 7}};
+
+static OpEncoding shift_ops[] = {{"shl", 0, 4}, {"shr", 0, 5}, {"sar", 0, 7}};
+
+#define N_ELEMENTS(array) (sizeof(array) / sizeof(*(array)))
+
+static int error(Assembler *as, char *message, char *text) {
+  printf("ERROR! Line %d of the assembly code: %s %s\n", as->line, message,
+         text);
+  return -1;
+}
+
+static char *trim(char *s) {
+  while (isspace(*s)) {
+    ++s;
+  }
+  char *end = s + strlen(s);
+  while (end > s && isspace(end[-1])) {
+    *--end = '\0';
+  }
+  return s;
+}
+
+static int fits_in_8_bits(long n) { return n >= -128 && n < 128; }
+
+static int fits_in_32_bits(long n) { return n == (int)n; }
+
+/**
+ * Returns:
+ *   The encoding of the register name, or -1; sets *size to its size
+ */
+static int get_register(char *name, int *size) {
+  for (int i_size = 0; i_size < 3; ++i_size) {
+    for (int reg = 0; reg < 16; ++reg) {
+      if (strcmp(name, registers[i_size][reg]) == 0) {
+        *size = register_sizes[i_size];
+        return reg;
+      }
+    }
+  }
+  return -1;
+}
+
+static int get_condition(char *name) {
+  for (int code = 0; code < 16; ++code) {
+    if (strcmp(name, conditions[code]) == 0) {
+      return code;
+    }
+  }
+  for (size_t i_alias = 0; i_alias < N_ELEMENTS(condition_aliases); ++i_alias) {
+    if (strcmp(name, condition_aliases[i_alias].name) == 0) {
+      return condition_aliases[i_alias].code;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Returns:
+ *   The symbol of the label name, as NASM names it: under the last label not
+ *   starting with '.', if it starts with '.'
+ */
+static int get_label(Assembler *as, char *name) {
+  if (name[0] != '.' || as->scope == NULL) {
+    return get_symbol(as->object, name);
+  }
+  char full_name[MAX_LABEL_LENGTH];
+  int scope_length = strlen(as->scope);
+  if (scope_length + strlen(name) >= MAX_LABEL_LENGTH) {
+    return get_symbol(as->object, name);
+  }
+  memcpy(full_name, as->scope, scope_length);
+  strcpy(full_name + scope_length, name);
+  return get_symbol(as->object, full_name);
+}
+
+static int is_symbol(char *text) {
+  if (!isalpha(text[0]) && text[0] != '_' && text[0] != '.') {
+    return 0;
+  }
+  for (char *c = text; *c != '\0'; ++c) {
+    if (!isalnum(*c) && *c != '_' && *c != '.' && *c != '$') {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Adds a term of an address or immediate to op.
+ */
+static int parse_term(Assembler *as, char *term, int sign, Operand *op) {
+  int size;
+  int reg = get_register(term, &size);
+  char *star = strchr(term, '*');
+  if (isdigit(term[0])) {
+    // Decimal unless prefixed with 0x, as in NASM, which doesn't read a
+    // leading 0 as octal
+    int is_hex = term[0] == '0' && (term[1] == 'x' || term[1] == 'X');
+    char *digits = is_hex ? term + 2 : term;
+    char *end;
+    op->value += sign * strtol(digits, &end, is_hex ? 16 : 10);
+    return end != digits && *end == '\0' ? 0 : error(as, "bad number", term);
+  }
+  if (sign < 0) {
+    return error(as, "can't subtract", term);
+  }
+  if (op->kind == operand_mem && star != NULL) {
+    *star = '\0';
+    reg = get_register(trim(term), &size);
+    op->scale = atoi(star + 1);
+    if (reg < 0 || size != 8 || op->index >= 0 ||
+        (op->scale != 1 && op->scale != 2 && op->scale != 4 &&
+         op->scale != 8)) {
+      return error(as, "bad index", term);
+    }
+    op->index = reg;
+    return 0;
+  }
+  if (op->kind == operand_mem && reg >= 0) {
+    if (size != 8 || op->index >= 0) {
+      return error(as, "bad address register", term);
+    }
+    if (op->base < 0) {
+      op->base = reg;
+    } else {
+      op->index = reg;
+    }
+    return 0;
+  }
+  if (is_symbol(term) && op->symbol < 0) {
+    op->symbol = get_label(as, term);
+    return 0;
+  }
+  return error(as, "bad operand", term);
+}
+
+/**
+ * Parses text, a sum of terms, into op. Modifies text.
+ */
+static int parse_terms(Assembler *as, char *text, Operand *op) {
+  int sign = 1;
+  while (1) {
+    char *end = text + strcspn(text, "+-");
+    char separator = *end;
+    *end = '\0';
+    char *term = trim(text);
+    // A leading '-' negates the first term
+    if (*term != '\0' && parse_term(as, term, sign, op) != 0) {
+      return -1;
+    }
+    if (separator == '\0') {
+      return 0;
+    }
+    sign = separator == '+' ? 1 : -1;
+    text = end + 1;
+  }
+}
+
+/**
+ * Parses text, an instruction's operand, into op. Modifies text.
+ */
+static int parse_operand(Assembler *as, char *text, Operand *op) {
+  static struct {
+    char *name;
+    int size;
+  } sizes[] = {{"QWORD ", 8}, {"DWORD ", 4}, {"BYTE ", 1}};
+  memset(op, 0, sizeof(*op));
+  op->base = -1;
+  op->index = -1;
+  op->symbol = -1;
+  for (size_t i_size = 0; i_size < N_ELEMENTS(sizes); ++i_size) {
+    int length = strlen(sizes[i_size].name);
+    if (strncmp(text, sizes[i_size].name, length) == 0) {
+      op->size = sizes[i_size].size;
+      text = trim(text + length);
+    }
+  }
+  if (text[0] == '[') {
+    char *end = strchr(text, ']');
+    if (end == NULL || end[1] != '\0') {
+      return error(as, "bad address", text);
+    }
+    *end = '\0';
+    op->kind = operand_mem;
+    return parse_terms(as, text + 1, op);
+  }
+  int size;
+  op->reg = get_register(text, &size);
+  if (op->reg >= 0) {
+    op->kind = operand_reg;
+    op->size = size;
+    return 0;
+  }
+  op->kind = operand_imm;
+  return parse_terms(as, text, op);
+}
+
+static Buffer *get_bytes(Assembler *as) {
+  return as->object->sections[as->section].bytes;
+}
+
+static void emit_byte(Assembler *as, int byte) { bputc(get_bytes(as), byte); }
+
+static void emit_value(Assembler *as, long value, int n_bytes) {
+  for (int i_byte = 0; i_byte < n_bytes; ++i_byte) {
+    emit_byte(as, value >> (8 * i_byte));
+  }
+}
+
+static void emit_opcode(Assembler *as, int opcode) {
+  if (opcode > 0xff) {
+    emit_byte(as, opcode >> 8);
+  }
+  emit_byte(as, opcode & 0xff);
+}
+
+/**
+ * Emits n_bytes to be filled in with the address of symbol plus addend.
+ */
+static void emit_reference(Assembler *as, int symbol, long addend,
+                           RelocationType type, int n_bytes) {
+  add_relocation(as->object, as->section, get_bytes(as)->len, symbol, type,
+                 addend);
+  emit_value(as, 0, n_bytes);
+}
+
+/**
+ * Emits the 32-bit immediate or displacement of op, which may be a symbol.
+ */
+static int emit_value32(Assembler *as, Operand *op) {
+  if (!fits_in_32_bits(op->value)) {
+    return error(as, "value out of range", "");
+  }
+  if (op->symbol >= 0) {
+    emit_reference(as, op->symbol, op->value, reloc_abs32, 4);
+  } else {
+    emit_value(as, op->value, 4);
+  }
+  return 0;
+}
+
+/**
+ * Returns:
+ *   A REX prefix with no bits set, if op is one of the byte registers that
+ *   need one, else 0
+ */
+static int get_byte_rex(Operand *op) {
+  return op->kind == operand_reg && op->size == 1 && op->reg >= 4 &&
+                 op->reg < 8
+             ? 0x40
+             : 0;
+}
+
+/**
+ * Emits an instruction whose operands are given by a ModRM byte: any REX
+ * prefix, the opcode, and ModRM, then SIB and displacement if rm is memory.
+ * Params:
+ *   rex: 0x40 if a REX prefix is needed even with no bits set, else 0
+ *   size: Of the operands; 8 sets REX.W
+ *   reg: Register, or opcode extension, of ModRM's reg field
+ *   n_imm_bytes: Of the immediate that follows, which addresses relative to
+ *     rip are relative to the end of
+ */
+static int emit_modrm(Assembler *as, int rex, int size, int opcode, int reg,
+                      Operand *rm, int n_imm_bytes) {
+  rex |= (size == 8 ? 0x48 : 0) | (reg & 8 ? 0x44 : 0);
+  if (rm->kind == operand_reg) {
+    rex |= rm->reg & 8 ? 0x41 : 0;
+  } else {
+    rex |= (rm->base >= 0 && rm->base & 8 ? 0x41 : 0) |
+           (rm->index >= 0 && rm->index & 8 ? 0x42 : 0);
+  }
+  if (rex != 0) {
+    emit_byte(as, rex);
+  }
+  emit_opcode(as, opcode);
+  reg &= 7;
+  if (rm->kind == operand_reg) {
+    emit_byte(as, 0xc0 | reg << 3 | (rm->reg & 7));
+    return 0;
+  }
+  if (!fits_in_32_bits(rm->value) || rm->index == RSP) {
+    return error(as, "can't encode address", "");
+  }
+  int scale_bits = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2;
+  int index_bits = rm->index < 0 ? 4 : rm->index & 7;
+  if (rm->base < 0 && rm->index < 0 && rm->symbol >= 0) {
+    emit_byte(as, reg << 3 | 5);
+    emit_reference(as, rm->symbol, rm->value - 4 - n_imm_bytes, reloc_pc32,
+                   4);
+    return 0;
+  }
+  if (rm->base < 0) {
+    // No base register, so a 32-bit displacement
+    emit_byte(as, reg << 3 | 4);
+    emit_byte(as, scale_bits << 6 | index_bits << 3 | 5);
+    return emit_value32(as, rm);
+  }
+  int mod = rm->symbol < 0 && rm->value == 0 && (rm->base & 7) != RBP ? 0
+            : rm->symbol < 0 && fits_in_8_bits(rm->value)            ? 1
+                                                                     : 2;
+  if (rm->index >= 0 || (rm->base & 7) == RSP) {
+    emit_byte(as, mod << 6 | reg << 3 | 4);
+    emit_byte(as, scale_bits << 6 | index_bits << 3 | (rm->base & 7));
+  } else {
+    emit_byte(as, mod << 6 | reg << 3 | (rm->base & 7));
+  }
+  if (mod == 1) {
+    emit_byte(as, rm->value);
+  } else if (mod == 2) {
+    return emit_value32(as, rm);
+  }
+  return 0;
+}
+
+/**
+ * Emits a jump or call to the symbol of target, relative to the next
+ * instruction.
+ */
+static int emit_branch(Assembler *as, int opcode, Operand *target) {
+  if (target->kind != operand_imm || target->symbol < 0) {
+    return error(as, "bad jump target", "");
+  }
+  emit_opcode(as, opcode);
+  emit_reference(as, target->symbol, target->value - 4, reloc_call32, 4);
+  return 0;
+}
+
+/**
+ * Emits mov, which has forms of its own for immediates.
+ */
+static int emit_mov(Assembler *as, Operand *dst, Operand *src, int size) {
+  if (size != 8 && size != 4) {
+    return error(as, "bad operand size for", "mov");
+  }
+  if (src->kind == operand_reg) {
+    return emit_modrm(as, 0, size, 0x89, src->reg, dst, 0);
+  }
+  if (dst->kind == operand_reg && src->kind == operand_mem) {
+    return emit_modrm(as, 0, size, 0x8b, dst->reg, src, 0);
+  }
+  if (src->kind != operand_imm) {
+    return error(as, "bad operands for", "mov");
+  }
+  if (dst->kind == operand_mem) {
+    if (emit_modrm(as, 0, size, 0xc7, 0, dst, 4) != 0) {
+      return -1;
+    }
+    return emit_value32(as, src);
+  }
+  int rex = dst->reg & 8 ? 0x41 : 0;
+  if (src->symbol >= 0 || (size == 8 && !fits_in_32_bits(src->value) &&
+                           (src->value < 0 || src->value >> 32 != 0))) {
+    // 64-bit immediate
+    emit_byte(as, rex | (size == 8 ? 0x48 : 0x40));
+    emit_byte(as, 0xb8 + (dst->reg & 7));
+    if (src->symbol >= 0) {
+      emit_reference(as, src->symbol, src->value, reloc_abs64, 8);
+    } else {
+      emit_value(as, src->value, 8);
+    }
+    return 0;
+  }
+  if (src->value >= 0 && src->value >> 32 == 0) {
+    // 32-bit immediate, zero-extended to 64 bits
+    if (rex != 0) {
+      emit_byte(as, rex);
+    }
+    emit_byte(as, 0xb8 + (dst->reg & 7));
+    emit_value(as, src->value, 4);
+    return 0;
+  }
+  // 32-bit immediate, sign-extended to 64 bits
+  if (emit_modrm(as, 0, size, 0xc7, 0, dst, 4) != 0) {
+    return -1;
+  }
+  emit_value(as, src->value, 4);
+  return 0;
+}
+
+static OpEncoding *find_op(OpEncoding *ops, int n_ops, char *name) {
+  for (int i_op = 0; i_op < n_ops; ++i_op) {
+    if (strcmp(name, ops[i_op].name) == 0) {
+      return &ops[i_op];
+    }
+  }
+  return NULL;
+}
+
+static int emit_push_or_pop(Assembler *as, char *op, Operand *a) {
+  int is_push = strcmp(op, "push") == 0;
+  if (a->kind == operand_reg) {
+    if (a->reg & 8) {
+      emit_byte(as, 0x41);
+    }
+    emit_byte(as, (is_push ? 0x50 : 0x58) + (a->reg & 7));
+    return 0;
+  }
+  if (a->kind == operand_mem) {
+    return emit_modrm(as, 0, 0, is_push ? 0xff : 0x8f, is_push ? 6 : 0, a, 0);
+  }
+  if (!is_push) {
+    return error(as, "bad operand for", op);
+  }
+  if (a->symbol < 0 && fits_in_8_bits(a->value)) {
+    emit_byte(as, 0x6a);
+    emit_byte(as, a->value);
+    return 0;
+  }
+  emit_byte(as, 0x68);
+  return emit_value32(as, a);
+}
+
+/**
+ * Emits an instruction with one operand.
+ */
+static int emit_unary(Assembler *as, char *op, Operand *a) {
+  int condition = op[0] == 'j'                  ? get_condition(op + 1)
+                  : strncmp(op, "set", 3) == 0 ? get_condition(op + 3)
+                                                : -1;
+  int is_call = strcmp(op, "call") == 0;
+  if (is_call || strcmp(op, "jmp") == 0) {
+    if (a->kind == operand_imm) {
+      return emit_branch(as, is_call ? 0xe8 : 0xe9, a);
+    }
+    return emit_modrm(as, 0, 0, 0xff, is_call ? 2 : 4, a, 0);
+  }
+  if (op[0] == 'j' && condition >= 0) {
+    return emit_branch(as, 0x0f80 + condition, a);
+  }
+  if (op[0] == 's' && condition >= 0) {
+    if (a->kind == operand_imm || (a->size != 1 && a->size != 0)) {
+      return error(as, "bad operand for", op);
+    }
+    return emit_modrm(as, get_byte_rex(a), 1, 0x0f90 + condition, 0, a, 0);
+  }
+  if (strcmp(op, "push") == 0 || strcmp(op, "pop") == 0) {
+    return emit_push_or_pop(as, op, a);
+  }
+  OpEncoding *encoding =
+      find_op(one_operand_ops, N_ELEMENTS(one_operand_ops), op);
+  if (encoding == NULL) {
+    return error(as, "unknown instruction", op);
+  }
+  if (a->kind == operand_imm || (a->size != 8 && a->size != 4)) {
+    return error(as, "bad operand for", op);
+  }
+  return emit_modrm(as, 0, a->size, encoding->opcode, encoding->extension, a,
+                    0);
+}
+
+/**
+ * Emits an instruction with two operands.
+ */
+static int emit_binary(Assembler *as, char *op, Operand *a, Operand *b) {
+  if (strcmp(op, "movzx") == 0) {
+    if (a->kind != operand_reg || a->size == 1 || b->kind == operand_imm ||
+        (b->size != 1 && b->size != 0)) {
+      return error(as, "bad operands for", op);
+    }
+    return emit_modrm(as, get_byte_rex(b), a->size, 0x0fb6, a->reg, b, 0);
+  }
+  if (a->kind == operand_reg && b->kind == operand_reg && a->size != b->size) {
+    return error(as, "operand sizes differ for", op);
+  }
+  int size = a->size != 0 ? a->size : b->size;
+  if (size != 8 && size != 4) {
+    return error(as, "bad operand size for", op);
+  }
+  if (strcmp(op, "mov") == 0) {
+    return emit_mov(as, a, b, size);
+  }
+  if (strcmp(op, "lea") == 0 || strcmp(op, "imul") == 0) {
+    if (a->kind != operand_reg || b->kind == operand_imm ||
+        (op[0] == 'l' && b->kind != operand_mem)) {
+      return error(as, "bad operands for", op);
+    }
+    return emit_modrm(as, 0, size, op[0] == 'l' ? 0x8d : 0x0faf, a->reg, b,
+                      0);
+  }
+  if (strcmp(op, "test") == 0) {
+    if (b->kind == operand_imm) {
+      if (emit_modrm(as, 0, size, 0xf7, 0, a, 4) != 0) {
+        return -1;
+      }
+      return emit_value32(as, b);
+    }
+    Operand *reg = a->kind == operand_reg ? a : b;
+    return emit_modrm(as, 0, size, 0x85, reg->reg, reg == a ? b : a, 0);
+  }
+  OpEncoding *shift = find_op(shift_ops, N_ELEMENTS(shift_ops), op);
+  if (shift != NULL) {
+    if (b->kind == operand_reg && b->reg == 1 && b->size == 1) {
+      return emit_modrm(as, 0, size, 0xd3, shift->extension, a, 0);  // By cl
+    }
+    if (b->kind != operand_imm || b->symbol >= 0) {
+      return error(as, "bad shift for", op);
+    }
+    if (b->value == 1) {
+      return emit_modrm(as, 0, size, 0xd1, shift->extension, a, 0);
+    }
+    if (emit_modrm(as, 0, size, 0xc1, shift->extension, a, 1) != 0) {
+      return -1;
+    }
+    emit_byte(as, b->value);
+    return 0;
+  }
+  OpEncoding *arithmetic =
+      find_op(arithmetic_ops, N_ELEMENTS(arithmetic_ops), op);
+  if (arithmetic == NULL) {
+    return error(as, "unknown instruction", op);
+  }
+  int extension = arithmetic->extension;
+  if (b->kind == operand_reg) {
+    return emit_modrm(as, 0, size, 0x01 + 8 * extension, b->reg, a, 0);
+  }
+  if (a->kind == operand_reg && b->kind == operand_mem) {
+    return emit_modrm(as, 0, size, 0x03 + 8 * extension, a->reg, b, 0);
+  }
+  if (b->kind != operand_imm) {
+    return error(as, "bad operands for", op);
+  }
+  if (b->symbol < 0 && fits_in_8_bits(b->value)) {
+    if (emit_modrm(as, 0, size, 0x83, extension, a, 1) != 0) {
+      return -1;
+    }
+    emit_byte(as, b->value);
+    return 0;
+  }
+  if (emit_modrm(as, 0, size, 0x81, extension, a, 4) != 0) {
+    return -1;
+  }
+  return emit_value32(as, b);
+}
+
+static int emit_instruction(Assembler *as, char *op, int n_args,
+                            char **args) {
+  Operand operands[2];
+  if (n_args > 2) {
+    return error(as, "too many operands for", op);
+  }
+  for (int i_arg = 0; i_arg < n_args; ++i_arg) {
+    if (parse_operand(as, args[i_arg], &operands[i_arg]) != 0) {
+      return -1;
+    }
+  }
+  if (n_args == 0) {
+    OpEncoding *encoding =
+        find_op(no_operand_ops, N_ELEMENTS(no_operand_ops), op);
+    if (encoding == NULL) {
+      return error(as, "unknown instruction", op);
+    }
+    emit_opcode(as, encoding->opcode);
+    return 0;
+  }
+  if (n_args == 1) {
+    return emit_unary(as, op, &operands[0]);
+  }
+  return emit_binary(as, op, &operands[0], &operands[1]);
+}
+
+static int define_label(Assembler *as, char *name) {
+  int symbol = get_label(as, name);
+  if (as->object->symbols[symbol].section >= 0) {
+    return error(as, "label defined again:", name);
+  }
+  if (name[0] != '.') {
+    as->scope = as->object->symbols[symbol].name;
+  }
+  as->object->symbols[symbol].section = as->section;
+  as->object->symbols[symbol].offset = get_bytes(as)->len;
+  return 0;
+}
+
+static int emit_directive(Assembler *as, char *op, int n_args, char **args) {
+  if (strcmp(op, "bits") == 0) {
+    return n_args == 1 && strcmp(args[0], "64") == 0
+               ? 0
+               : error(as, "only 64 bits, not", n_args > 0 ? args[0] : "");
+  }
+  if (strcmp(op, "default") == 0) {
+    // Memory at a symbol is relative to rip anyway
+    return n_args == 1 && strcmp(args[0], "rel") == 0
+               ? 0
+               : error(as, "only default rel, not",
+                       n_args > 0 ? args[0] : "");
+  }
+  if (strcmp(op, "section") == 0) {
+    for (int i_section = 0; i_section < N_SECTIONS; ++i_section) {
+      if (n_args == 1 && strcmp(args[0], section_names[i_section]) == 0) {
+        as->section = i_section;
+        return 0;
+      }
+    }
+    return error(as, "unknown section", n_args > 0 ? args[0] : "");
+  }
+  if (strcmp(op, "global") == 0 || strcmp(op, "extern") == 0) {
+    for (int i_arg = 0; i_arg < n_args; ++i_arg) {
+      int symbol = get_symbol(as->object, args[i_arg]);
+      as->object->symbols[symbol].is_global = 1;
+    }
+    return 0;
+  }
+  if (strcmp(op, "align") == 0) {
+    int alignment = n_args == 1 ? atoi(args[0]) : 0;
+    if (alignment <= 0 || (alignment & (alignment - 1)) != 0) {
+      return error(as, "bad alignment", n_args > 0 ? args[0] : "");
+    }
+    ObjectSection *section = &as->object->sections[as->section];
+    while (section->bytes->len % alignment != 0) {
+      emit_byte(as, as->section == section_text ? 0x90 : 0);  // nop
+    }
+    if (alignment > section->alignment) {
+      section->alignment = alignment;
+    }
+    return 0;
+  }
+  int n_bytes = strcmp(op, "db") == 0   ? 1
+                : strcmp(op, "dd") == 0 ? 4
+                : strcmp(op, "dq") == 0 ? 8
+                                        : 0;
+  if (n_bytes == 0) {
+    return 1;
+  }
+  for (int i_arg = 0; i_arg < n_args; ++i_arg) {
+    char *arg = args[i_arg];
+    int length = strlen(arg);
+    if (n_bytes == 1 && length >= 2 && arg[0] == '"' &&
+        arg[length - 1] == '"') {
+      bwrite(get_bytes(as), arg + 1, length - 2);
+      continue;
+    }
+    Operand value;
+    if (parse_operand(as, arg, &value) != 0) {
+      return -1;
+    }
+    if (value.kind != operand_imm || (value.symbol >= 0 && n_bytes != 8)) {
+      return error(as, "bad data", arg);
+    }
+    if (value.symbol >= 0) {
+      emit_reference(as, value.symbol, value.value, reloc_abs64, 8);
+    } else {
+      emit_value(as, value.value, n_bytes);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Splits text at the commas not in strings into at most MAX_ARGS args.
+ * Modifies text.
+ * Returns:
+ *   The number of args, or -1 if there are too many
+ */
+static int split_args(char *text, char **args) {
+  int n_args = 0;
+  if (*text == '\0') {
+    return 0;
+  }
+  int is_in_string = 0;
+  for (char *c = text;; ++c) {
+    if (*c == '"') {
+      is_in_string = !is_in_string;
+    } else if ((*c == ',' && !is_in_string) || *c == '\0') {
+      if (n_args == MAX_ARGS) {
+        return -1;
+      }
+      int is_end = *c == '\0';
+      *c = '\0';
+      args[n_args++] = trim(text);
+      text = c + 1;
+      if (is_end) {
+        return n_args;
+      }
+    }
+  }
+}
+
+/**
+ * Splits the first word, delimited by whitespace, from the rest of text.
+ * Returns:
+ *   The rest, trimmed
+ */
+static char *split_word(char *text) {
+  char *end = text + strcspn(text, " \t");
+  if (*end == '\0') {
+    return end;
+  }
+  *end = '\0';
+  return trim(end + 1);
+}
+
+static int assemble_line(Assembler *as, char *line) {
+  int is_in_string = 0;
+  for (char *c = line; *c != '\0'; ++c) {
+    if (*c == '"') {
+      is_in_string = !is_in_string;
+    } else if (*c == ';' && !is_in_string) {
+      *c = '\0';
+      break;
+    }
+  }
+  line = trim(line);
+  char *rest = split_word(line);
+  int length = strlen(line);
+  if (length > 0 && line[length - 1] == ':') {
+    line[length - 1] = '\0';
+    if (define_label(as, line) != 0) {
+      return -1;
+    }
+    line = rest;
+    rest = split_word(line);
+  }
+  if (*line == '\0') {
+    return 0;
+  }
+  if (strcmp(line, "rep") == 0) {
+    emit_byte(as, 0xf3);
+    line = rest;
+    rest = split_word(line);
+  }
+  char *args[MAX_ARGS];
+  int n_args = split_args(rest, args);
+  if (n_args < 0) {
+    return error(as, "too many operands for", line);
+  }
+  int result = emit_directive(as, line, n_args, args);
+  return result == 1 ? emit_instruction(as, line, n_args, args) : result;
+}
+
+/**
+ * Fills in the addresses relative to rip of symbols defined in the same
+ * section, and removes their relocations.
+ */
+static void resolve_relocations(Object *object) {
+  for (int i_section = 0; i_section < N_SECTIONS; ++i_section) {
+    ObjectSection *section = &object->sections[i_section];
+    int n_kept = 0;
+    for (int i_reloc = 0; i_reloc < section->n_relocations; ++i_reloc) {
+      Relocation *reloc = &section->relocations[i_reloc];
+      ObjectSymbol *symbol = &object->symbols[reloc->symbol];
+      if ((reloc->type == reloc_pc32 || reloc->type == reloc_call32) &&
+          symbol->section == i_section) {
+        int value = symbol->offset + reloc->addend - reloc->offset;
+        memcpy(section->bytes->text + reloc->offset, &value, sizeof(value));
+      } else {
+        section->relocations[n_kept++] = *reloc;
+      }
+    }
+    section->n_relocations = n_kept;
+  }
+}
+
+/**
+ * Assembles code, NASM as written out by the compiler. Modifies code.
+ * Returns:
+ *   The object, or NULL if code couldn't be assembled
+ */
+Object *assemble(char *code) {
+  Assembler as = {make_object(), section_text, NULL, 0};
+  int result = 0;
+  for (char *line = code; *line != '\0' && result == 0;) {
+    char *end = strchr(line, '\n');
+    char *next = end == NULL ? line + strlen(line) : end + 1;
+    if (end != NULL) {
+      *end = '\0';
+    }
+    ++as.line;
+    result = assemble_line(&as, line);
+    line = next;
+  }
+  for (int i_symbol = 0; i_symbol < as.object->n_symbols && result == 0;
+       ++i_symbol) {
+    ObjectSymbol *symbol = &as.object->symbols[i_symbol];
+    if (symbol->section < 0 && !symbol->is_global) {
+      printf("ERROR! Undefined symbol %s in the assembly code\n",
+             symbol->name);
+      result = -1;
+    }
+  }
+  if (result != 0) {
+    free_object(as.object);
+    return NULL;
+  }
+  resolve_relocations(as.object);
+  return as.object;
+}
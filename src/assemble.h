@@ -0,0 +1,7 @@
+#include "object.h"
+#ifndef ASSEMBLE_H
+#define ASSEMBLE_H
+
+Object *assemble(char *code);
+
+#endif
@@ -7,6 +7,8 @@ AST *make_listStart() {
   AST *e = (AST *)malloc(sizeof(AST));
   e->tag = list_start_token;
   e->symbol_table = make_map(str_eq);
+  set_position(e, -1, -1);
+  e->reg = -1;
   return e;
 }
 
@@ -15,6 +17,8 @@ AST *make_integerExp(int val) {
   e->tag = integer_exp;
   e->content.integerExp = val;
   e->symbol_table = make_map(str_eq);
+  set_position(e, -1, -1);
+  e->reg = -1;
   return e;
 }
 
@@ -30,6 +34,8 @@ AST *make_varExp(char *name) {
   strcpy(e->content.varExp->name, name);
   e->content.varExp->is_recursive = 0;
   e->symbol_table = make_map(str_eq);
+  set_position(e, -1, -1);
+  e->reg = -1;
   return e;
 }
 
@@ -43,7 +49,10 @@ AST *make_makeClosureExp(char *name, int n_bound_vars, int n_free_vars) {
   e->content.makeClosureExp->n_bound_vars = n_bound_vars;
   e->content.makeClosureExp->n_free_vars = n_free_vars;
   e->content.makeClosureExp->free_vars = make_list();
+  e->content.makeClosureExp->is_on_stack = 0;
   e->symbol_table = make_map(str_eq);
+  set_position(e, -1, -1);
+  e->reg = -1;
   return e;
 }
 
@@ -52,7 +61,11 @@ AST *make_listExp() {
   e->tag = list_exp;
   e->content.listExp = (SListExp *)malloc(sizeof(SListExp));
   e->content.listExp->rest = make_list();
+  e->content.listExp->is_tail = 0;
+  e->content.listExp->known_fn = NULL;
   e->symbol_table = make_map(str_eq);
+  set_position(e, -1, -1);
+  e->reg = -1;
   return e;
 }
 
@@ -63,10 +76,18 @@ AST *make_globalExp() {
   e->content.globalExp->main = NULL;
   e->content.globalExp->rest = make_list();
   e->content.globalExp->standard = make_map(str_eq);
-  map_insert_key(e->content.globalExp->standard, "plus");
-  map_insert_key(e->content.globalExp->standard, "minus");
-  map_insert_key(e->content.globalExp->standard, "equals");
+  // Standard library functions, with the labels of their code
+  map_insert_value(e->content.globalExp->standard, "plus", "_plus");
+  map_insert_value(e->content.globalExp->standard, "minus", "_minus");
+  map_insert_value(e->content.globalExp->standard, "equals", "_equals");
+  map_insert_value(e->content.globalExp->standard, "times", "_times");
+  map_insert_value(e->content.globalExp->standard, "div", "_div");
+  map_insert_value(e->content.globalExp->standard, "mod", "_mod");
+  map_insert_value(e->content.globalExp->standard, "less", "_less");
+  map_insert_value(e->content.globalExp->standard, "greater", "_greater");
   e->symbol_table = make_map(str_eq);
+  set_position(e, -1, -1);
+  e->reg = -1;
   e->parent = NULL;
   return e;
 }
@@ -76,8 +97,14 @@ AST *make_lambdaExp(Map *args, AST *body) {
   e->tag = lambda_exp;
   e->content.lambdaExp = (SLambdaExp *)malloc(sizeof(SLambdaExp));
   e->content.lambdaExp->args = args;
+  e->content.lambdaExp->n_bound_vars = args->list->len;
   e->content.lambdaExp->body = body;
+  e->content.lambdaExp->is_memo = 0;
+  e->content.lambdaExp->arg_regs = NULL;
+  e->content.lambdaExp->used_regs = 0;
   e->symbol_table = make_map(str_eq);
+  set_position(e, -1, -1);
+  e->reg = -1;
   return e;
 }
 
@@ -89,7 +116,12 @@ AST *make_letExp(char *arg, AST *defn, AST *body, short is_recursive) {
   e->content.letExp->defn = defn;
   e->content.letExp->body = body;
   e->content.letExp->is_recursive = is_recursive;
+  e->content.letExp->n_uses = 0;
+  e->content.letExp->reg = -1;
+  e->content.letExp->is_lifted = 0;
   e->symbol_table = make_map(str_eq);
+  set_position(e, -1, -1);
+  e->reg = -1;
   return e;
 }
 
@@ -101,9 +133,16 @@ AST *make_ifExp(AST *pred, AST *case_true, AST *case_false) {
   e->content.ifExp->case_true = case_true;
   e->content.ifExp->case_false = case_false;
   e->symbol_table = make_map(str_eq);
+  set_position(e, -1, -1);
+  e->reg = -1;
   return e;
 }
 
+void set_position(AST *ast, int line, int column) {
+  ast->line = line;
+  ast->column = column;
+}
+
 void free_ast_node(AST *node) {
   if (node->tag == var_exp) {
     free(node->content.varExp->name);
@@ -379,6 +418,84 @@ void indent(int n) {
   }
 }
 
+/**
+ * Returns:
+ *  Deep copy of an AST from before closure conversion, with its own names and
+ *  source positions, and empty symbol tables for make_scopes to fill in.
+ *  Parents within the copy are joined.
+ */
+AST *copy_ast(AST *ast) {
+  AST *copy;
+  switch (ast->tag) {
+    case integer_exp:
+      copy = make_integerExp(ast->content.integerExp);
+      break;
+    case var_exp:
+      copy = make_varExp(ast->content.varExp->name);
+      copy->content.varExp->is_recursive = ast->content.varExp->is_recursive;
+      break;
+    case if_exp:
+      copy = make_ifExp(copy_ast(ast->content.ifExp->pred),
+                        copy_ast(ast->content.ifExp->case_true),
+                        copy_ast(ast->content.ifExp->case_false));
+      break;
+    case let_exp: {
+      char *arg = malloc(strlen(ast->content.letExp->arg) + 1);
+      strcpy(arg, ast->content.letExp->arg);
+      copy = make_letExp(arg, copy_ast(ast->content.letExp->defn),
+                         copy_ast(ast->content.letExp->body),
+                         ast->content.letExp->is_recursive);
+      break;
+    }
+    case lambda_exp: {
+      Map *args = make_map(str_eq);
+      for (int i_arg = 0; i_arg < ast->content.lambdaExp->args->list->len;
+           ++i_arg) {
+        char *name = get_key_i(ast->content.lambdaExp->args, i_arg);
+        char *arg = malloc(strlen(name) + 1);
+        strcpy(arg, name);
+        map_insert_key(args, arg);
+      }
+      copy = make_lambdaExp(args, copy_ast(ast->content.lambdaExp->body));
+      copy->content.lambdaExp->is_memo = ast->content.lambdaExp->is_memo;
+      break;
+    }
+    case list_exp:
+      copy = make_listExp();
+      copy->content.listExp->first = copy_ast(ast->content.listExp->first);
+      for (int i_exp = 0; i_exp < ast->content.listExp->rest->len; ++i_exp) {
+        push_tail(copy->content.listExp->rest,
+                  copy_ast(get_i(ast->content.listExp->rest, i_exp)));
+      }
+      break;
+    default:
+      printf("ERROR! Unexpected tag in copy_ast.\n");
+      printf("Tag: %d\n", ast->tag);
+      return NULL;
+  }
+  set_position(copy, ast->line, ast->column);
+  copy->parent = NULL;
+  for (int i_exp = 0; i_exp < get_n_children(copy); ++i_exp) {
+    get_child(copy, i_exp)->parent = copy;
+  }
+  return copy;
+}
+
+/**
+ * Turns ast into its child replacement in place, so that ast's parent needn't
+ * change, and frees replacement's node. ast keeps its own symbol table, so
+ * replacement's must have no variables still in use.
+ */
+void replace_node(AST *ast, AST *replacement) {
+  ast->tag = replacement->tag;
+  ast->content = replacement->content;
+  set_position(ast, replacement->line, replacement->column);
+  for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+    get_child(ast, i_exp)->parent = ast;
+  }
+  free(replacement);
+}
+
 int is_ancestor(AST *candidate_ancestor, AST *candidate_descendent) {
   if (candidate_ancestor->parent == candidate_descendent) {
     return 1;
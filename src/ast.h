@@ -19,8 +19,12 @@ typedef struct SIfExp {
 typedef struct SLambdaExp {
   // (lambda args body)
   char *name;  // Only set for globals
-  Map *args;
+  Map *args;   // Bound variables, then free variables once closure converted
+  int n_bound_vars;
   struct Exp *body;
+  short is_memo;  // Results cached by the runtime, from memo or defmemo
+  int *arg_regs;  // Registers of args then own closure, or -1, once allocated
+  int used_regs;  // Bit mask of the registers allocated
 } SLambdaExp;
 
 typedef struct SLetExp {
@@ -30,6 +34,9 @@ typedef struct SLetExp {
   struct Exp *defn;
   struct Exp *body;
   short is_recursive;
+  int n_uses;  // References to arg from body, counted by shake.c
+  int reg;     // Register allocated to arg, or -1
+  short is_lifted;  // defn is a lambda taking its free variables, by lift.c
 } SLetExp;
 
 typedef struct SDefExp {
@@ -42,6 +49,9 @@ typedef struct SDefExp {
 typedef struct SListExp {
   struct Exp *first;
   LL *rest;
+  short is_tail;  // Call whose result the function returns, set by tail.c
+  struct Exp *known_fn;  // Definition of the operator if a lambda, set by
+                         // known.c
 } SListExp;
 
 typedef struct SGlobalExp {
@@ -55,6 +65,7 @@ typedef struct SMakeClosureExp {
   int n_bound_vars;
   int n_free_vars;
   LL *free_vars;
+  short is_on_stack;  // Doesn't escape its function, set by escape.c
 } SMakeClosureExp;
 
 typedef struct Exp {
@@ -82,6 +93,13 @@ typedef struct Exp {
     struct SMakeClosureExp *makeClosureExp;
   } content;
   Map *symbol_table;
+  // Source position of the node's first token, 0-indexed; -1 if made by the
+  // compiler rather than parsed
+  int line;
+  int column;
+  // Register allocated to the value of this node, if an operand or operator,
+  // or -1
+  int reg;
 } AST;
 
 AST *make_listStart();
@@ -104,6 +122,8 @@ AST *make_ifExp(AST *pred, AST *case_true, AST *case_false);
 
 AST *make_globalExp();
 
+void set_position(AST *ast, int line, int column);
+
 void free_ast_node(AST *node);
 
 void free_ast(AST *ast);
@@ -124,6 +144,10 @@ int str_eq(void *x, void *y);
 
 void indent(int n);
 
+AST *copy_ast(AST *ast);
+
+void replace_node(AST *ast, AST *replacement);
+
 int is_ancestor(AST *candidate_ancestor, AST *candidate_descendent);
 
 #endif
\ No newline at end of file
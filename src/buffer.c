@@ -0,0 +1,152 @@
+#include "buffer.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Growable text buffer, which the compiler emits its code into and writes out
+ * once, rather than formatting each instruction through stdio.
+ */
+
+Buffer *make_buffer(void) {
+  Buffer *buffer = malloc(sizeof(*buffer));
+  buffer->capacity = BUFFER_INITIAL_CAPACITY;
+  buffer->text = malloc(buffer->capacity);
+  buffer->text[0] = '\0';
+  buffer->len = 0;
+  return buffer;
+}
+
+void free_buffer(Buffer *buffer) {
+  free(buffer->text);
+  free(buffer);
+}
+
+/**
+ * Makes room for n_chars more chars, and the terminating '\0'.
+ */
+static void reserve(Buffer *buffer, size_t n_chars) {
+  if (buffer->len + n_chars < buffer->capacity) {
+    return;
+  }
+  while (buffer->len + n_chars >= buffer->capacity) {
+    buffer->capacity *= 2;
+  }
+  buffer->text = realloc(buffer->text, buffer->capacity);
+  if (buffer->text == NULL) {
+    fprintf(stderr, "ERROR! Out of memory.\n");
+    exit(1);
+  }
+}
+
+void bputc(Buffer *buffer, char c) {
+  reserve(buffer, 1);
+  buffer->text[buffer->len++] = c;
+  buffer->text[buffer->len] = '\0';
+}
+
+void bputs(Buffer *buffer, char *s) {
+  size_t n_chars = strlen(s);
+  reserve(buffer, n_chars);
+  memcpy(buffer->text + buffer->len, s, n_chars + 1);
+  buffer->len += n_chars;
+}
+
+void bwrite(Buffer *buffer, void *bytes, size_t n_bytes) {
+  reserve(buffer, n_bytes);
+  memcpy(buffer->text + buffer->len, bytes, n_bytes);
+  buffer->len += n_bytes;
+  buffer->text[buffer->len] = '\0';
+}
+
+/**
+ * Writes n in decimal to s, without a terminating '\0'.
+ * Params:
+ *   s: Room for at least 20 chars
+ * Returns:
+ *   The number of chars written
+ */
+int format_long(char *s, long n) {
+  char digits[20];
+  int n_digits = 0;
+  // Negated as unsigned, so that LONG_MIN doesn't overflow
+  unsigned long magnitude = n < 0 ? -(unsigned long)n : (unsigned long)n;
+  do {
+    digits[n_digits++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude > 0);
+  int len = 0;
+  if (n < 0) {
+    s[len++] = '-';
+  }
+  while (n_digits > 0) {
+    s[len++] = digits[--n_digits];
+  }
+  return len;
+}
+
+/**
+ * Appends format, with its conversions replaced by the following arguments.
+ * Only the conversions the emitter uses are understood: %s, %d, %ld and %%,
+ * with no flags or widths. Exits on any other.
+ */
+void bprintf(Buffer *buffer, char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  for (char *c = format; *c != '\0'; ++c) {
+    char *end = strchr(c, '%');
+    size_t n_chars = end == NULL ? strlen(c) : (size_t)(end - c);
+    reserve(buffer, n_chars);
+    memcpy(buffer->text + buffer->len, c, n_chars);
+    buffer->len += n_chars;
+    if (end == NULL) {
+      break;
+    }
+    c = end + 1;
+    if (*c == 's') {
+      bputs(buffer, va_arg(args, char *));
+      continue;
+    }
+    if (*c == '%') {
+      bputc(buffer, '%');
+      continue;
+    }
+    int is_long = *c == 'l';
+    c += is_long;
+    if (*c != 'd') {
+      fprintf(stderr, "ERROR! Unsupported conversion in bprintf format: %s\n",
+              format);
+      exit(1);
+    }
+    long n = is_long ? va_arg(args, long) : va_arg(args, int);
+    reserve(buffer, 20);
+    buffer->len += format_long(buffer->text + buffer->len, n);
+  }
+  buffer->text[buffer->len] = '\0';
+  va_end(args);
+}
+
+/**
+ * Writes the buffer's text to the file descriptor fd, in one write unless
+ * it's interrupted or only partly done.
+ * Returns:
+ *   0, or -1 if writing failed
+ */
+int write_buffer(Buffer *buffer, int fd) {
+  size_t n_written = 0;
+  while (n_written < buffer->len) {
+    ssize_t result =
+        write(fd, buffer->text + n_written, buffer->len - n_written);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result < 0) {
+      return -1;
+    }
+    n_written += result;
+  }
+  return 0;
+}
@@ -0,0 +1,32 @@
+#include <stddef.h>
+#ifndef BUFFER_H
+#define BUFFER_H
+
+// Size a buffer starts at, doubling whenever it fills
+#define BUFFER_INITIAL_CAPACITY (1 << 16)
+
+// Text built up in memory, such as the code emitted by eval, or other bytes
+typedef struct Buffer {
+  char *text;  // Always '\0'-terminated, after len bytes
+  size_t len;
+  size_t capacity;
+} Buffer;
+
+Buffer *make_buffer(void);
+
+void free_buffer(Buffer *buffer);
+
+void bputc(Buffer *buffer, char c);
+
+void bputs(Buffer *buffer, char *s);
+
+void bwrite(Buffer *buffer, void *bytes, size_t n_bytes);
+
+void bprintf(Buffer *buffer, char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+int format_long(char *s, long n);
+
+int write_buffer(Buffer *buffer, int fd);
+
+#endif
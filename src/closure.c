@@ -1,61 +1,74 @@
 #include "closure.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include "arena.h"
+#include "heap_profile.h"
 
-FirstClass *make_data(long val) {
-  FirstClass *fc = malloc(sizeof(*fc));
-  fc->tag = data_tag;
-  fc->val.data = val;
-  return fc;
-}
+/**
+ * Returns:
+ *  Integer as a value. Integers are never allocated.
+ */
+long make_data(long val) { return TAG_INT(val); }
 
-FirstClass *make_closure(long (*codeptr)(long *), long n_bound_vars,
-                         long n_free_vars, long freevar1, long freevar2,
-                         long freevar3) {
-  FirstClass *cl = malloc(sizeof(*cl));
+/**
+ * Returns:
+ *  Closure with its free variables cleared, for the caller to fill in.
+ *  Generated code builds closures inline instead.
+ */
+FirstClass *make_closure(Code codeptr, long n_bound_vars, long n_free_vars) {
+  FirstClass *cl = heap_profile_alloc(
+      sizeof(*cl) + n_free_vars * sizeof(*cl->val.closure.freevar),
+      HEAP_SITE_RUNTIME);
   cl->tag = closure_tag;
   cl->val.closure.codeptr = codeptr;
   cl->val.closure.n_bound_vars = n_bound_vars;
   cl->val.closure.n_free_vars = n_free_vars;
-  cl->val.closure.freevar =
-      malloc(n_free_vars * sizeof(*cl->val.closure.freevar));
-  if (cl->val.closure.n_free_vars >= 1) {
-    cl->val.closure.freevar[0] = freevar1;
-  }
-  if (cl->val.closure.n_free_vars >= 2) {
-    cl->val.closure.freevar[1] = freevar2;
-  }
-  if (cl->val.closure.n_free_vars >= 3) {
-    cl->val.closure.freevar[2] = freevar3;
+  for (int i_free = 0; i_free < n_free_vars; ++i_free) {
+    cl->val.closure.freevar[i_free] = 0;
   }
   return cl;
 }
 
+/**
+ * Calls a closure from C, with up to four bound variables. Exits if cl isn't
+ * a closure, or takes more bound variables than can be passed to it here.
+ */
 FirstClass *call_closure(FirstClass *cl, long boundvar1, long boundvar2,
                          long boundvar3, long boundvar4) {
-  // TODO Verify that cl is indeed a closure
-  int n_vars = cl->val.closure.n_bound_vars + cl->val.closure.n_free_vars;
-  long *var = malloc(n_vars * sizeof(*var));
-  // Fill bound vars from those provided when closure was CALLED
-  if (cl->val.closure.n_bound_vars >= 1) {
-    var[0] = boundvar1;
-  }
-  if (cl->val.closure.n_bound_vars >= 2) {
-    var[1] = boundvar2;
-  }
-  if (cl->val.closure.n_bound_vars >= 3) {
-    var[2] = boundvar3;
+  if (IS_INT((long)cl)) {
+    not_a_closure((long)cl);
   }
-  if (cl->val.closure.n_bound_vars >= 4) {
-    var[3] = boundvar4;
+  if (cl->tag != closure_tag) {
+    fprintf(stderr, "ERROR! Called a value with tag %d, not a function.\n",
+            cl->tag);
+    exit(1);
   }
-  // Fill free vars from those provided when closure was CREATED
-  for (int i_free = 0; i_free < cl->val.closure.n_free_vars; ++i_free) {
-    // When compiled with gcc -S closure.c
-    // the next line is between .L11 and .L10
-    var[i_free + cl->val.closure.n_bound_vars] =
-        cl->val.closure.freevar[i_free];
+  if (cl->val.closure.n_bound_vars > CALL_CLOSURE_MAX_BOUND_VARS) {
+    fprintf(stderr,
+            "ERROR! Can't call a function of %ld arguments from C, only of "
+            "up to %d.\n",
+            cl->val.closure.n_bound_vars, CALL_CLOSURE_MAX_BOUND_VARS);
+    exit(1);
   }
-  FirstClass *result;
-  result = (FirstClass *)cl->val.closure.codeptr(var);
-  return result;
+  return (FirstClass *)__builtin_call_with_static_chain(
+      cl->val.closure.codeptr(boundvar1, boundvar2, boundvar3, boundvar4), cl);
+}
+
+/**
+ * Reports an attempt to divide by zero, and exits. Generated code and the
+ * standard library's div and mod jump here when the divisor is 0.
+ */
+void division_by_zero(void) {
+  fprintf(stderr, "ERROR! Division by zero.\n");
+  exit(1);
+}
+
+/**
+ * Reports an attempt to call val, and exits. Generated code jumps here when
+ * the operator of a call turns out to be an integer.
+ */
+void not_a_closure(long val) {
+  fprintf(stderr, "ERROR! Called %ld, which is not a function.\n",
+          UNTAG_INT(val));
+  exit(1);
 }
@@ -1,28 +1,43 @@
 #ifndef CLOSURE_H
 #define CLOSURE_H
 
+// Generated functions take their bound variables as in the System V ABI, and
+// their closure in r10 (the static chain register), for their free variables.
+typedef long (*Code)(long, long, long, long);
+
 typedef struct Closure {
-  long (*codeptr)(long *);  // Pointer to function
+  Code codeptr;  // Pointer to function
   long n_bound_vars;
   long n_free_vars;
-  long *freevar;
+  long freevar[];  // Captured values, stored inline
 } Closure;
 
+// Values are either integers, stored shifted left with the low bit set, or
+// pointers to FirstClass, which are 8-byte aligned so have the low bit clear.
+#define INT_TAG 1
+#define IS_INT(val) ((val)&INT_TAG)
+#define TAG_INT(n) ((long)((unsigned long)(n) << 1) | INT_TAG)
+#define UNTAG_INT(val) ((val) >> 1)
+
 typedef struct FirstClass {
-  enum { data_tag, closure_tag } tag;
+  enum { closure_tag = 1 } tag;
   union {
-    long data;
     Closure closure;
   } val;
 } FirstClass;
 
-FirstClass *make_data(long val);
+long make_data(long val);
+
+FirstClass *make_closure(Code codeptr, long n_bound_vars, long n_free_vars);
 
-FirstClass *make_closure(long (*codeptr)(long *), long n_bound_vars,
-                         long n_free_vars, long freevar1, long freevar2,
-                         long freevar3);
+// Bound variables call_closure can pass, at most
+#define CALL_CLOSURE_MAX_BOUND_VARS 4
 
 FirstClass *call_closure(FirstClass *cl, long boundvar1, long boundvar2,
                          long boundvar3, long boundvar4);
 
+void not_a_closure(long val);
+
+void division_by_zero(void);
+
 #endif
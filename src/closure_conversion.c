@@ -2,6 +2,7 @@
 #include <string.h>
 #include "ast.h"
 #include "global.h"
+#include "lift.h"
 #include "scope.h"
 
 /**
@@ -10,6 +11,8 @@
  *  to bound variables, and assigns them a name.
  * -Replaces them in the AST with make_closure calls to the now-global
  * functions.
+ * Free variables are passed to the global functions in their closure, which
+ * recursive calls pass on, so recursive calls don't need them as arguments.
  *
  * Params:
  *  global: The top-level AST node
@@ -42,34 +45,14 @@ int closure_convert(AST *global) {
                        get_key_i(free_vars, i_var));
         // TODO Free arg memory
       }
-      // Look for recursive calls in lambda body, and add in free variables
-      LL *body_stack = make_list();
-      push_head(body_stack, current->content.lambdaExp->body);
-      while (body_stack->len > 0) {
-        AST *body_current = (AST *)pop_head(body_stack);
-        if (body_current->tag == list_exp) {
-          if (body_current->content.listExp->first->tag == var_exp) {
-            // TODO Verify that varExp is recursive with current
-            if (body_current->content.listExp->first->content.varExp
-                    ->is_recursive) {
-              for (int i_free = 0; i_free < n_free_vars; ++i_free) {
-                AST *free_node = make_varExp(get_key_i(free_vars, i_free));
-                push_tail(body_current->content.listExp->rest, free_node);
-                free_node->parent = body_current;
-              }
-            }
-          }
-        }
-        for (int i_child = 0; i_child < get_n_children(body_current);
-             ++i_child) {
-          push_head(body_stack, get_child(body_current, i_child));
-        }
-      }
-      free_list(body_stack);
       // Move lambda node to top
       AST *new_node = make_lambdaExp(current->content.lambdaExp->args,
                                      current->content.lambdaExp->body);
       new_node->content.lambdaExp->name = temp_name;
+      new_node->content.lambdaExp->n_bound_vars = n_bound_vars;
+      new_node->content.lambdaExp->is_memo =
+          current->content.lambdaExp->is_memo;
+      set_position(new_node, current->line, current->column);
       new_node->content.lambdaExp->body->parent = new_node;
       push_tail(global->content.globalExp->rest, new_node);
       new_node->parent = global;
@@ -81,6 +64,7 @@ int closure_convert(AST *global) {
       current->content.makeClosureExp->n_bound_vars = n_bound_vars;
       current->content.makeClosureExp->n_free_vars = n_free_vars;
       current->content.makeClosureExp->free_vars = make_list();
+      current->content.makeClosureExp->is_on_stack = 0;
       // Add free variables
       for (int i_free = 0; i_free < n_free_vars; ++i_free) {
         AST *new_var_node = make_varExp(get_key_i(free_vars, i_free));
@@ -115,13 +99,19 @@ Map *find_free_and_recursive_vars(AST *lambda, AST *global) {
         } else {
           char *scope_value = (char *)get_in_scope(current, var);
           if (scope_value != NULL && strcmp(scope_value, "RECURSIVE") == 0) {
-            current->content.varExp->name = lambda->content.lambdaExp->name;
+            // Copied, as each node's name is freed with the node
+            free(current->content.varExp->name);
+            current->content.varExp->name =
+                malloc(strlen(lambda->content.lambdaExp->name) + 1);
+            strcpy(current->content.varExp->name,
+                   lambda->content.lambdaExp->name);
             current->content.varExp->is_recursive = 1;
           } else {
-            if (is_ancestor(scope_source, lambda)) {
+            if (is_ancestor(scope_source, lambda) && !is_lifted_var(current)) {
               map_insert_key(free_vars, current->content.varExp->name);
             } else {
-              // Var was defined inside lambda, so it's not free
+              // Var was defined inside lambda, or is a lifted lambda, which is
+              // only called, so it's not free
             }
           }
         }
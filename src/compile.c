@@ -1,27 +1,120 @@
+#include "assemble.h"
 #include "ast.h"
+#include "buffer.h"
 #include "closure_conversion.h"
 #include "eval.h"
+#include "fold.h"
 #include "global.h"
+#include "inline.h"
+#include "jit.h"
+#include "known.h"
+#include "lift.h"
 #include "ll.h"
+#include "options.h"
 #include "parse.h"
+#include "peephole.h"
 #include "scope.h"
+#include "shake.h"
 #include "tokenise.h"
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+Options options = {0};
+
+/**
+ * Sets options from the arguments starting with "--", and removes them from
+ * argv, leaving only the positional arguments.
+ * Returns:
+ *   The number of remaining arguments
+ */
+int read_options(int argc, char **argv) {
+  int n_positional = 0;
+  for (int i_arg = 0; i_arg < argc; ++i_arg) {
+    if (i_arg == 0 || strncmp(argv[i_arg], "--", 2) != 0) {
+      argv[n_positional++] = argv[i_arg];
+    } else if (strcmp(argv[i_arg], "--profile") == 0) {
+      options.profile = 1;
+    } else if (strcmp(argv[i_arg], "--heap-profile") == 0) {
+      options.heap_profile = 1;
+    } else if (strcmp(argv[i_arg], "--ir") == 0) {
+      options.ir = 1;
+    } else if (strcmp(argv[i_arg], "--stdout") == 0) {
+      options.to_stdout = 1;
+    } else if (strcmp(argv[i_arg], "--elf") == 0) {
+      options.elf = 1;
+    } else if (strcmp(argv[i_arg], "--run") == 0) {
+      options.run = 1;
+    } else {
+      printf("Unknown option: %s\n", argv[i_arg]);
+      return -1;
+    }
+  }
+  return n_positional;
+}
+
+double milliseconds_between(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1e3 +
+         (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+/**
+ * Loads object into this process and runs its main, printing to stdout_fd,
+ * and then how long compiling, since started, and running took.
+ * Returns:
+ *   The exit code of main, or LOAD_ERROR if object couldn't be loaded
+ */
+int run_object(Object *object, int stdout_fd, struct timespec *started) {
+  printf("Loading...\n");
+  JitMain main_function = load_object(object);
+  if (main_function == NULL) {
+    printf("Compiling failed.\n");
+    return LOAD_ERROR;
+  }
+  printf("Running...\n");
+  struct timespec compiled, ran;
+  clock_gettime(CLOCK_MONOTONIC, &compiled);
+  fflush(stdout);
+  dup2(stdout_fd, STDOUT_FILENO);
+  int exit_code = main_function();
+  fflush(stdout);
+  clock_gettime(CLOCK_MONOTONIC, &ran);
+  fprintf(stderr, "\nCompiled in %.3f ms, ran in %.3f ms.\n",
+          milliseconds_between(started, &compiled),
+          milliseconds_between(&compiled, &ran));
+  return exit_code;
+}
 
 int main(int argc, char **argv) {
   int err;
+  struct timespec started;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  argc = read_options(argc, argv);
+  if (argc < 0) {
+    return ARG_ERROR;
+  }
+  // The code is written to output_fd. With --stdout, that's the original
+  // stdout, and everything else printed goes to stderr instead. So it does
+  // with --run, leaving stdout for the program.
+  int output_fd = -1;
+  if (options.to_stdout || options.run) {
+    fflush(stdout);
+    output_fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+  }
   printf("Starting...\n");
   if (argc < 2) {
     printf("First argument must be code file\n");
     return ARG_ERROR;
   }
-  if (argc < 3) {
-    printf("Second argument must be assembly output file\n");
+  if (argc < 3 && !options.to_stdout && !options.run) {
+    printf("Second argument must be assembly or object output file\n");
     return ARG_ERROR;
   }
-  char *outfile = argv[2];
+  char *outfile = options.to_stdout || options.run ? "stdout" : argv[2];
   LL *h = make_list();
   printf("Loading file: %s\n", argv[1]);
   FILE *fp = fopen(argv[1], "r");
@@ -53,27 +146,78 @@ int main(int argc, char **argv) {
   }
   printf("Scoping...\n");
   make_scopes(global);
+  printf("Inlining...\n");
+  inline_calls(global);
+  printf("Folding constants...\n");
+  fold_constants(global);
+  printf("Removing unused definitions...\n");
+  shake_tree(global);
+  printf("Finding known calls...\n");
+  find_known_calls(global);
+  printf("Lifting lambdas...\n");
+  lift_lambdas(global);
   printf("Closure converting...\n");
   int closure_convert_result = closure_convert(global);
   if (closure_convert_result != 0) {
     printf("Compiling failed.\n");
     return closure_convert_result;
   }
-  printf("Opening output file...\n");
-  FILE *output = fopen(outfile, "w+");
-  if (output == NULL) {
-    printf("ERROR! Could not open output file %s\n", outfile);
+  if (!options.to_stdout && !options.run) {
+    printf("Opening output file...\n");
+    output_fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+      printf("ERROR! Could not open output file %s\n", outfile);
+      perror("Failed: ");
+      return IO_ERROR;
+    }
+  }
+  printf("Emitting assembly code...\n");
+  // Emitted to memory first, for the peephole optimiser, and then written out
+  // all at once
+  Buffer *code = make_buffer();
+  eval(code, global);
+  printf("Peephole optimising...\n");
+  Buffer *output = make_buffer();
+  bputs(output, "; Assembly code generated by compiler\n");
+  PeepholeStats peephole_stats;
+  peephole(code->text, output, &peephole_stats);
+  printf("%ld instructions emitted, %ld after peephole optimisation\n",
+         peephole_stats.n_before, peephole_stats.n_after);
+  free_buffer(code);
+  if (options.elf || options.run) {
+    printf("Assembling...\n");
+    Object *object = assemble(output->text);
+    free_buffer(output);
+    if (object == NULL) {
+      printf("Compiling failed.\n");
+      return ASSEMBLE_ERROR;
+    }
+    if (options.run) {
+      return run_object(object, output_fd, &started);
+    }
+    output = make_buffer();
+    write_elf(object, output);
+    free_object(object);
+  }
+  int write_result = write_buffer(output, output_fd);
+  free_buffer(output);
+  if (write_result != 0 || close(output_fd) != 0) {
+    printf("ERROR! Could not write output file %s\n", outfile);
     perror("Failed: ");
     return IO_ERROR;
   }
-  fprintf(output, "; Assembly code generated by compiler\n");
-  printf("Emitting assembly code...\n");
-  eval(output, global, 0, 0);
-  fclose(output);
-  printf("\nDone emitting. Now further compile and link with:\n");
-  printf("nasm -f elf64 %s -o obj.o\n", outfile);
-  printf(
-      "gcc -no-pie -o executable obj.o lib/libclosure.a lib/libstandard.a\n");
+  if (options.to_stdout) {
+    printf("\nDone emitting.\n");
+  } else if (options.elf) {
+    printf("\nDone emitting. Now link with:\n");
+    printf("gcc -no-pie -o executable %s lib/libclosure.a lib/libstandard.a\n",
+           outfile);
+  } else {
+    printf("\nDone emitting. Now further compile and link with:\n");
+    printf("nasm -f elf64 %s -o obj.o\n", outfile);
+    printf(
+        "gcc -no-pie -o executable obj.o lib/libclosure.a lib/libstandard.a\n");
+  }
   free_ast(global);
   return 0;
 }
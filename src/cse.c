@@ -0,0 +1,476 @@
+#include "cse.h"
+#include <stdlib.h>
+#include <string.h>
+#include "gc.h"
+#include "ir.h"
+#include "regalloc.h"
+
+/**
+ * Value numbering over the IR of a lifted function, after lower_fn.
+ *
+ * Each location is given the number of the value it holds at each point.
+ * Integers, static symbols, and primitives applied to the same numbered
+ * values get the same number, and values the pass can't see into, such as
+ * args and the results of calls, get new ones. An instruction computing a
+ * value that is already held somewhere then becomes a move from there, or is
+ * removed if its destination holds it already, and operands are read from
+ * the register, or else the slot, that has held their value longest. Moves
+ * and computations whose result is then overwritten before being read are
+ * removed.
+ *
+ * Blocks only jump forward, apart from self tail calls to the entry, so
+ * numbers flow forward through them in order, and a block joined from several
+ * keeps only the numbers they agree on. Calls, even known ones, are never
+ * numbered, and their results are always new values: nothing is assumed about
+ * what a closure returns. Calls leave the caller's slots and registers as they
+ * were, so the values there survive them.
+ */
+
+typedef struct Value {
+  IROp op;     // ir_int, ir_primitive, ir_move of a symbol, or ir_call if
+               // unknown
+  char *name;  // Primitive or symbol
+  long value;  // Integer
+  int a;       // Values of a primitive's operands
+  int b;
+} Value;
+
+// What a location holds
+typedef struct Holding {
+  int value;  // Numbered from 1, with 0 for not yet numbered
+  int since;  // Time it was stored, to prefer the earliest copy
+} Holding;
+
+typedef struct Numbering {
+  IRFn *ir;
+  Value *values;
+  int n_values;
+  int max_values;
+  int n_locations;
+  Holding *held;  // By location, at the current instruction
+  int time;
+} Numbering;
+
+static int get_index(int loc) {
+  return loc <= 0 ? loc + N_ALLOC_REGISTERS : N_ALLOC_REGISTERS + loc / 8;
+}
+
+static int get_location(int index) {
+  return index <= N_ALLOC_REGISTERS ? index - N_ALLOC_REGISTERS
+                                    : 8 * (index - N_ALLOC_REGISTERS);
+}
+
+static int is_same_value(Value *x, Value *y) {
+  if (x->op != y->op || x->op == ir_call) {
+    return 0;
+  }
+  switch (x->op) {
+    case ir_int:
+      return x->value == y->value;
+    case ir_primitive:
+      return strcmp(x->name, y->name) == 0 && x->a == y->a && x->b == y->b;
+    default:
+      return strcmp(x->name, y->name) == 0;
+  }
+}
+
+static int add_value(Numbering *nb, Value value) {
+  if (nb->n_values == nb->max_values) {
+    nb->max_values = nb->max_values ? 2 * nb->max_values : 64;
+    nb->values = realloc(nb->values, nb->max_values * sizeof(*nb->values));
+  }
+  nb->values[nb->n_values++] = value;
+  return nb->n_values;
+}
+
+/**
+ * Returns:
+ *   Number of value, numbering it if it's new
+ */
+static int number(Numbering *nb, Value value) {
+  for (int i_value = 0; i_value < nb->n_values; ++i_value) {
+    if (is_same_value(&nb->values[i_value], &value)) {
+      return i_value + 1;
+    }
+  }
+  return add_value(nb, value);
+}
+
+static int number_unknown(Numbering *nb) {
+  Value value = {.op = ir_call};
+  return add_value(nb, value);
+}
+
+static void hold(Numbering *nb, int loc, int value) {
+  Holding *held = &nb->held[get_index(loc)];
+  held->value = value;
+  held->since = nb->time++;
+}
+
+/**
+ * Returns:
+ *   Number of the value at loc, numbering it if the pass doesn't know it
+ */
+static int get_held(Numbering *nb, int loc) {
+  if (nb->held[get_index(loc)].value == 0) {
+    hold(nb, loc, number_unknown(nb));
+  }
+  return nb->held[get_index(loc)].value;
+}
+
+/**
+ * Finds the register that has held value longest, or else the slot, from
+ * min_slot on.
+ * Returns:
+ *   1 if found, with the location in *loc
+ */
+static int find_holder(Numbering *nb, int value, int min_slot, int *loc) {
+  int found = -1;
+  for (int index = 0; index < nb->n_locations; ++index) {
+    int holder = get_location(index);
+    if (nb->held[index].value != value || holder == IR_ACC ||
+        (!IS_REG_LOCATION(holder) && holder < min_slot)) {
+      continue;
+    }
+    if (found < 0 ||
+        (IS_REG_LOCATION(holder) && !IS_REG_LOCATION(get_location(found))) ||
+        (IS_REG_LOCATION(holder) == IS_REG_LOCATION(get_location(found)) &&
+         nb->held[index].since < nb->held[found].since)) {
+      found = index;
+    }
+  }
+  if (found < 0) {
+    return 0;
+  }
+  *loc = get_location(found);
+  return 1;
+}
+
+/**
+ * Reads src from the register, or else the slot, that has held its value
+ * longest, so that the later copies may not be needed.
+ */
+static void substitute(Numbering *nb, IROperand *src, int min_slot) {
+  if (src->kind == ir_location && src->loc != IR_ACC) {
+    find_holder(nb, get_held(nb, src->loc), min_slot, &src->loc);
+  }
+}
+
+/**
+ * Returns:
+ *   Number of the value that instr computes from its operands
+ */
+static int number_primitive(Numbering *nb, IRInstr *instr) {
+  Value value = {.op = ir_primitive,
+                 .name = instr->name,
+                 .a = get_held(nb, instr->srcs[0].loc),
+                 .b = get_held(nb, instr->srcs[1].loc)};
+  if (strcmp(value.name, "greater") == 0) {
+    value.name = "less";
+    int a = value.a;
+    value.a = value.b;
+    value.b = a;
+  } else if ((strcmp(value.name, "plus") == 0 ||
+              strcmp(value.name, "times") == 0 ||
+              strcmp(value.name, "equals") == 0) &&
+             value.a > value.b) {
+    int a = value.a;
+    value.a = value.b;
+    value.b = a;
+  }
+  return number(nb, value);
+}
+
+/**
+ * Numbers the values that instr defines, and rewrites it to reuse values
+ * already held.
+ * Returns:
+ *   0 if instr is no longer needed, else 1
+ */
+static int number_instr(Numbering *nb, IRInstr *instr) {
+  int min_slot = 0;
+  if (instr->op == ir_self_tail_call) {
+    // Its operands mustn't be in the arg slots that it replaces
+    min_slot = GC_FRAME_HEADER_SIZE +
+               8 * (nb->ir->fn->content.lambdaExp->args->list->len + 2);
+  }
+  for (int i_src = 0; i_src < instr->n_srcs; ++i_src) {
+    substitute(nb, &instr->srcs[i_src], min_slot);
+  }
+  int value;
+  switch (instr->op) {
+    case ir_int: {
+      Value integer = {.op = ir_int, .value = instr->value};
+      value = number(nb, integer);
+      break;
+    }
+    case ir_move:
+      if (instr->srcs[0].kind == ir_symbol) {
+        Value symbol = {.op = ir_move, .name = instr->srcs[0].symbol};
+        value = number(nb, symbol);
+      } else {
+        value = get_held(nb, instr->srcs[0].loc);
+      }
+      break;
+    case ir_primitive: {
+      value = number_primitive(nb, instr);
+      int loc;
+      if (nb->held[get_index(instr->dst)].value != value &&
+          find_holder(nb, value, 0, &loc)) {
+        free(instr->srcs);
+        instr->op = ir_move;
+        instr->n_srcs = 1;
+        instr->srcs = calloc(1, sizeof(*instr->srcs));
+        instr->srcs[0].kind = ir_location;
+        instr->srcs[0].loc = loc;
+        instr->comment = strdup("common subexpression");
+      }
+      break;
+    }
+    case ir_make_closure:
+      if (instr->stack_offset > 0) {
+        // It's made over slots, which no longer hold what they did
+        int start = instr->stack_offset - get_closure_size(instr->n_srcs);
+        for (int loc = instr->stack_offset; loc > start; loc -= 8) {
+          nb->held[get_index(loc)].value = 0;
+        }
+      }
+      // Intentional fall-through
+    case ir_call:
+    case ir_memo_lookup:
+    case ir_memo_store:
+      value = number_unknown(nb);
+      break;
+    case ir_profile_start:
+      // rdtsc clobbers rax
+      hold(nb, instr->value, number_unknown(nb));
+      value = number_unknown(nb);
+      break;
+    default:
+      // Ends the block, or doesn't change any location
+      return 1;
+  }
+  if (nb->held[get_index(instr->dst)].value == value) {
+    return 0;
+  }
+  hold(nb, instr->dst, value);
+  return 1;
+}
+
+/**
+ * Returns:
+ *   1 if the block after block is only reached from it by jumping
+ */
+static int is_unconditional(IRBlock *block) {
+  if (block->n_instrs == 0) {
+    return 0;
+  }
+  IROp op = block->instrs[block->n_instrs - 1].op;
+  return op == ir_jump || op == ir_tail_call || op == ir_self_tail_call ||
+         op == ir_return;
+}
+
+static int is_jump(IRInstr *instr) {
+  return instr->op == ir_branch || instr->op == ir_jump ||
+         instr->op == ir_self_tail_call || instr->op == ir_memo_lookup;
+}
+
+/**
+ * Sets held to the values that all the ways into the nth block agree on,
+ * from the values held at the end of earlier blocks, in held_out.
+ */
+static void join(Numbering *nb, int nth_block, Holding **held_out) {
+  IRFn *ir = nb->ir;
+  int label = ir->blocks[nth_block]->label;
+  int n_ways_in = 0;
+  memset(nb->held, 0, nb->n_locations * sizeof(*nb->held));
+  for (int i_block = 0; i_block < ir->n_blocks; ++i_block) {
+    IRBlock *block = ir->blocks[i_block];
+    int is_way_in = i_block == nth_block - 1 && !is_unconditional(block);
+    for (int i_instr = 0; i_instr < block->n_instrs; ++i_instr) {
+      IRInstr *instr = &block->instrs[i_instr];
+      is_way_in = is_way_in || (is_jump(instr) && instr->target == label);
+    }
+    if (!is_way_in) {
+      continue;
+    }
+    if (i_block >= nth_block) {
+      // Jumps back, from values not yet known
+      memset(nb->held, 0, nb->n_locations * sizeof(*nb->held));
+      return;
+    }
+    for (int index = 0; index < nb->n_locations; ++index) {
+      Holding *held = &nb->held[index];
+      Holding *held_in = &held_out[i_block][index];
+      if (n_ways_in == 0) {
+        *held = *held_in;
+      } else if (held->value != held_in->value) {
+        held->value = 0;
+      } else if (held_in->since > held->since) {
+        held->since = held_in->since;
+      }
+    }
+    ++n_ways_in;
+  }
+}
+
+/**
+ * Updates live, the locations read before being written after instr, to
+ * those before it.
+ */
+static void transfer_live(IRInstr *instr, char *live) {
+  switch (instr->op) {
+    case ir_profile_start:
+      live[get_index(instr->value)] = 0;
+      // Intentional fall-through
+    case ir_int:
+    case ir_move:
+    case ir_primitive:
+    case ir_call:
+    case ir_make_closure:
+    case ir_memo_lookup:
+      live[get_index(instr->dst)] = 0;
+      break;
+    default:
+      break;
+  }
+  for (int i_src = 0; i_src < instr->n_srcs; ++i_src) {
+    if (instr->srcs[i_src].kind == ir_location) {
+      live[get_index(instr->srcs[i_src].loc)] = 1;
+    }
+  }
+}
+
+/**
+ * Sets live to the locations live at the end of the nth block: those live at
+ * the start of the blocks it continues or jumps to, in live_in.
+ */
+static void get_live_out(Numbering *nb, int nth_block, int *label_blocks,
+                         char **live_in, char *live) {
+  IRFn *ir = nb->ir;
+  IRBlock *block = ir->blocks[nth_block];
+  memset(live, 0, nb->n_locations);
+  for (int i_instr = 0; i_instr < block->n_instrs; ++i_instr) {
+    IRInstr *instr = &block->instrs[i_instr];
+    if (is_jump(instr)) {
+      char *target_live = live_in[label_blocks[instr->target]];
+      for (int index = 0; index < nb->n_locations; ++index) {
+        live[index] |= target_live[index];
+      }
+    }
+  }
+  if (!is_unconditional(block) && nth_block + 1 < ir->n_blocks) {
+    for (int index = 0; index < nb->n_locations; ++index) {
+      live[index] |= live_in[nth_block + 1][index];
+    }
+  }
+}
+
+/**
+ * Returns:
+ *   1 if instr only computes its destination, which isn't live after it
+ */
+static int is_dead(IRInstr *instr, char *live) {
+  switch (instr->op) {
+    case ir_primitive:
+      // Division by zero is an error, so must still happen
+      if (strcmp(instr->name, "div") == 0 || strcmp(instr->name, "mod") == 0) {
+        return 0;
+      }
+      // Intentional fall-through
+    case ir_int:
+    case ir_move:
+      return !live[get_index(instr->dst)];
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Removes moves and computations of values that are overwritten, or not used
+ * at all, before being read.
+ */
+static void remove_dead_code(Numbering *nb) {
+  IRFn *ir = nb->ir;
+  int *label_blocks = malloc(ir->n_labels * sizeof(*label_blocks));
+  char **live_in = malloc(ir->n_blocks * sizeof(*live_in));
+  for (int i_block = 0; i_block < ir->n_blocks; ++i_block) {
+    label_blocks[ir->blocks[i_block]->label] = i_block;
+    live_in[i_block] = calloc(nb->n_locations, sizeof(**live_in));
+  }
+  // Blocks only jump back to the entry, so this soon stops changing
+  char *live = malloc(nb->n_locations);
+  int is_changed = 1;
+  while (is_changed) {
+    is_changed = 0;
+    for (int i_block = ir->n_blocks - 1; i_block >= 0; --i_block) {
+      IRBlock *block = ir->blocks[i_block];
+      get_live_out(nb, i_block, label_blocks, live_in, live);
+      for (int i_instr = block->n_instrs - 1; i_instr >= 0; --i_instr) {
+        transfer_live(&block->instrs[i_instr], live);
+      }
+      if (memcmp(live, live_in[i_block], nb->n_locations) != 0) {
+        memcpy(live_in[i_block], live, nb->n_locations);
+        is_changed = 1;
+      }
+    }
+  }
+  for (int i_block = 0; i_block < ir->n_blocks; ++i_block) {
+    IRBlock *block = ir->blocks[i_block];
+    get_live_out(nb, i_block, label_blocks, live_in, live);
+    // Removed from the end, keeping the kept ones at the end
+    int n_kept = 0;
+    for (int i_instr = block->n_instrs - 1; i_instr >= 0; --i_instr) {
+      IRInstr *instr = &block->instrs[i_instr];
+      if (is_dead(instr, live)) {
+        free_ir_instr(instr);
+        continue;
+      }
+      transfer_live(instr, live);
+      block->instrs[block->n_instrs - 1 - n_kept++] = *instr;
+    }
+    memmove(block->instrs, block->instrs + block->n_instrs - n_kept,
+            n_kept * sizeof(*block->instrs));
+    block->n_instrs = n_kept;
+  }
+  for (int i_block = 0; i_block < ir->n_blocks; ++i_block) {
+    free(live_in[i_block]);
+  }
+  free(live_in);
+  free(live);
+  free(label_blocks);
+}
+
+/**
+ * Reuses values already computed in ir, instead of computing or loading them
+ * again.
+ */
+void eliminate_common_subexpressions(IRFn *ir) {
+  Numbering nb = {.ir = ir};
+  nb.n_locations = get_index(GC_FRAME_HEADER_SIZE + ir->memory_reqd) + 1;
+  nb.held = calloc(nb.n_locations, sizeof(*nb.held));
+  Holding **held_out = malloc(ir->n_blocks * sizeof(*held_out));
+  for (int i_block = 0; i_block < ir->n_blocks; ++i_block) {
+    join(&nb, i_block, held_out);
+    IRBlock *block = ir->blocks[i_block];
+    int n_kept = 0;
+    for (int i_instr = 0; i_instr < block->n_instrs; ++i_instr) {
+      IRInstr *instr = &block->instrs[i_instr];
+      if (number_instr(&nb, instr)) {
+        block->instrs[n_kept++] = *instr;
+      } else {
+        free_ir_instr(instr);
+      }
+    }
+    block->n_instrs = n_kept;
+    held_out[i_block] = malloc(nb.n_locations * sizeof(*nb.held));
+    memcpy(held_out[i_block], nb.held, nb.n_locations * sizeof(*nb.held));
+  }
+  remove_dead_code(&nb);
+  for (int i_block = 0; i_block < ir->n_blocks; ++i_block) {
+    free(held_out[i_block]);
+  }
+  free(held_out);
+  free(nb.held);
+  free(nb.values);
+}
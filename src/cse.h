@@ -0,0 +1,7 @@
+#include "ir.h"
+#ifndef CSE_H
+#define CSE_H
+
+void eliminate_common_subexpressions(IRFn *ir);
+
+#endif
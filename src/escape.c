@@ -0,0 +1,92 @@
+#include "escape.h"
+#include <string.h>
+#include "ast.h"
+#include "scope.h"
+
+/**
+ * Escape analysis, run by eval on each generated function after its tail
+ * calls are marked.
+ *
+ * A closure escapes its function unless the only thing done with it is to
+ * call it, other than from tail position, where the function's frame is gone
+ * by the time the callee reads its free variables. Recursive functions can
+ * capture their own closure, so always escape. Those that don't escape
+ * are made in the function's frame instead of the heap. Closure conversion has
+ * lifted nested lambdas out, so a function's closures are all in its body.
+ */
+
+/**
+ * Returns:
+ *   The closure that is the value of ast, if made there, else NULL
+ */
+static AST *get_value_closure(AST *ast) {
+  switch (ast->tag) {
+    case make_closure_exp:
+      return ast;
+    case let_exp:
+      return get_value_closure(ast->content.letExp->body);
+    default:
+      return NULL;
+  }
+}
+
+static int is_called_locally(AST *ast) {
+  AST *parent = ast->parent;
+  return parent->tag == list_exp && parent->content.listExp->first == ast &&
+         !parent->content.listExp->is_tail;
+}
+
+/**
+ * Returns:
+ *   1 if every use of let's variable in ast calls it locally
+ */
+static int are_uses_local(AST *ast, AST *let) {
+  if (ast->tag == var_exp) {
+    char *name = ast->content.varExp->name;
+    if (strcmp(name, let->content.letExp->arg) == 0 &&
+        find_definer(ast, name) == let->content.letExp->body &&
+        !is_called_locally(ast)) {
+      return 0;
+    }
+  } else if (ast->tag == make_closure_exp) {
+    // Captured variables are its children, but not through get_child
+    LL *free_vars = ast->content.makeClosureExp->free_vars;
+    for (int i_free = 0; i_free < free_vars->len; ++i_free) {
+      if (!are_uses_local(get_i(free_vars, i_free), let)) {
+        return 0;
+      }
+    }
+  }
+  for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+    if (!are_uses_local(get_child(ast, i_exp), let)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void mark(AST *ast) {
+  AST *closure = get_value_closure(ast);
+  if (closure != NULL &&
+      closure->content.makeClosureExp->n_free_vars > 0) {
+    AST *parent = ast->parent;
+    if (is_called_locally(ast) ||
+        (parent->tag == let_exp && parent->content.letExp->defn == ast &&
+         !parent->content.letExp->is_recursive &&
+         are_uses_local(parent->content.letExp->body, parent))) {
+      closure->content.makeClosureExp->is_on_stack = 1;
+    }
+  }
+  for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+    mark(get_child(ast, i_exp));
+  }
+}
+
+/**
+ * Sets is_on_stack of the closures made by fn, a lifted lambda or the global
+ * node for main, that don't escape it.
+ */
+void find_stack_closures(AST *fn) {
+  mark(fn->tag == lambda_exp ? fn->content.lambdaExp->body
+                             : fn->content.globalExp->main);
+}
@@ -0,0 +1,7 @@
+#include "ast.h"
+#ifndef ESCAPE_H
+#define ESCAPE_H
+
+void find_stack_closures(AST *fn);
+
+#endif
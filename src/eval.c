@@ -1,342 +1,859 @@
 #include "eval.h"
-#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
 #include "ast.h"
-#include "scope.h"
+#include "closure.h"
+#include "cse.h"
+#include "gc.h"
+#include "ir.h"
+#include "options.h"
+#include "profile.h"
+#include "regalloc.h"
+
+static int n_allocs_emitted = 0;  // For unique allocation labels
+static LL *profiled_nodes = NULL;  // Lambdas and calls with profile records
+static LL *heap_site_nodes = NULL;  // Allocating expressions, if heap profiling
+
+static char *arg_registers[N_ARG_REGISTERS] = {"rdi", "rsi", "rdx",
+                                               "rcx", "r8",  "r9"};
+
+static char *alloc_registers[N_ALLOC_REGISTERS] = {"rbx", "r12", "r13", "r14",
+                                                   "r15"};
 
 /**
- * Generates linear code from AST.
  * Returns:
- *   Offset
- */
-int eval(FILE *fp, AST *ast, int nth_if, int offset) {
-  switch (ast->tag) {
-    case lambda_exp: {
-      int memory_reqd = get_memory_reqd_by_fn(ast);
-      emit_fn_head(fp, ast->content.lambdaExp->name,
-                   ast->content.lambdaExp->args, memory_reqd);
-      int arg_offset = 0;
-      for (int i_arg = 0; i_arg < ast->content.lambdaExp->args->list->len;
-           ++i_arg) {
-        arg_offset += 8;  // Assumes all args are 8 bytes
-        int *i_arg_ptr = malloc(sizeof(*i_arg_ptr));
-        *i_arg_ptr = arg_offset;
-        map_insert_value(ast->content.lambdaExp->body->symbol_table,
-                         get_key_i(ast->content.lambdaExp->args, i_arg),
-                         i_arg_ptr);
-      }
-      offset = eval(fp, ast->content.lambdaExp->body, nth_if, arg_offset);
-      emit_fn_tail(fp);
-      break;
+ *   Operand for a location. Slots are formatted into one of a few buffers,
+ *   so it's only valid until the next few calls.
+ */
+static char *location(int loc) {
+  static char buffers[4][32];
+  static int nth_buffer = 0;
+  if (loc == IR_ACC) {
+    return "rax";
+  }
+  if (IS_REG_LOCATION(loc)) {
+    return alloc_registers[REG_INDEX(loc)];
+  }
+  char *buffer = buffers[nth_buffer++ % 4];
+  strcpy(buffer, "QWORD [rbp-");
+  int len = strlen(buffer);
+  len += format_long(buffer + len, loc);
+  strcpy(buffer + len, "]");
+  return buffer;
+}
+
+/**
+ * Returns:
+ *   Operand for an IR operand, valid as for location
+ */
+static char *operand(IROperand src) {
+  return src.kind == ir_symbol ? src.symbol : location(src.loc);
+}
+
+static int is_slot(IROperand src) {
+  return src.kind == ir_location && src.loc != IR_ACC &&
+         !IS_REG_LOCATION(src.loc);
+}
+
+static void emit_move(Buffer *out, int dst, IROperand src, char *comment) {
+  if (is_slot(src) || src.kind == ir_symbol) {
+    if (dst != IR_ACC && !IS_REG_LOCATION(dst)) {
+      // Memory to memory, or an address to memory, isn't encodable
+      bprintf(out, "\tmov r11, %s\n", operand(src));
+      src.kind = ir_symbol;
+      src.symbol = "r11";
     }
-    case if_exp:
-      offset = eval(fp, ast->content.ifExp->pred, nth_if + 1, offset);
-      emit_if_pred(fp, nth_if);
-      offset = eval(fp, ast->content.ifExp->case_true, nth_if + 1, offset);
-      emit_if_true(fp, nth_if);
-      offset = eval(fp, ast->content.ifExp->case_false, nth_if + 1, offset);
-      emit_if_false(fp, nth_if);
+  }
+  bprintf(out, "\tmov %s, %s", location(dst), operand(src));
+  if (comment != NULL) {
+    bprintf(out, "    ; %s", comment);
+  }
+  bprintf(out, "\n");
+}
+
+/**
+ * Moves the result of an instruction from rax to its destination.
+ */
+static void emit_result(Buffer *out, int dst) {
+  if (dst != IR_ACC) {
+    bprintf(out, "\tmov %s, rax\n", location(dst));
+  }
+}
+
+static void emit_to_acc(Buffer *out, IROperand src) {
+  if (src.kind != ir_location || src.loc != IR_ACC) {
+    emit_move(out, IR_ACC, src, NULL);
+  }
+}
+
+static void emit_instr(Buffer *out, IRFn *ir, IRInstr *instr) {
+  int n_args = instr->n_srcs - 1;  // Of calls, after the closure
+  switch (instr->op) {
+    case ir_int:
+      bprintf(out, "\tmov %s, %ld                ; integer constant %ld\n",
+              location(instr->dst), TAG_INT(instr->value), instr->value);
       break;
-    case let_exp:
-      offset = eval(fp, ast->content.letExp->defn, nth_if, offset);
-      offset += 8;  // Assumes let arg is always 8 bytes
-      int *arg_ptr = malloc(sizeof(*arg_ptr));
-      *arg_ptr = offset;
-      map_insert_value(ast->content.letExp->body->symbol_table,
-                       ast->content.letExp->arg, arg_ptr);
-      emit_let(fp, offset, ast->content.letExp->arg);
-      offset = eval(fp, ast->content.letExp->body, nth_if, offset);
+    case ir_move:
+      emit_move(out, instr->dst, instr->srcs[0], instr->comment);
       break;
-    case list_exp: {  // Function call
-      // For example: (f 1 (add 2 3))
-      // For example: ((g 4) 1 (add 2 3))
-      // For example: (f x y)
-      int n_operands = ast->content.listExp->rest->len;
-      int *offsets = malloc((n_operands + 1) *
-                            sizeof(*offsets));  // +1 for the call pointer
-      // Eval operands, contained in ast->content.listExp->rest
-      for (int i_operand = n_operands - 1; i_operand >= 0; --i_operand) {
-        AST *child = (AST *)get_i(ast->content.listExp->rest, i_operand);
-        offset = eval(fp, child, nth_if, offset);
-        offset += 8;  // Assuming that all operands are 8 bytes
-        offsets[i_operand + 1] = offset;
-        emit_operand(fp, offset, i_operand, n_operands);
-      }
-      if (ast->content.listExp->first->tag == var_exp &&
-          ast->content.listExp->first->content.varExp->is_recursive) {
-        offset += 8;  // Location for heap-allocated 8-byte arg pointer
-        emit_recursive_call(fp, n_operands, offsets,
-                            ast->content.listExp->first->content.varExp->name,
-                            offset);
-      } else {
-        // First is function, so eval then call
-        eval(fp, ast->content.listExp->first, nth_if, offset);
-        offset += 8;  // Call location is 8-byte pointer
-        offsets[0] = offset;
-        emit_call(fp, n_operands, offsets, offset);
-      }
-      free(offsets);
+    case ir_primitive:
+      emit_primitive(out, instr->name, instr->srcs);
+      emit_result(out, instr->dst);
       break;
-    }
-    case var_exp: {
-      // For example: x
-      AST *scope_node = find_scope(ast, ast->content.varExp->name);
-      if (scope_node == NULL) {
-        printf("ERROR! Undefined symbol: %s.\n", ast->content.varExp->name);
-      }
-      void *val = get_in_scope(ast, ast->content.varExp->name);
-      if (val == NULL) {
-        emit_fn_name(fp, ast->content.varExp->name);
-      } else {
-        emit_var(fp, *(int *)val, ast->content.varExp->name);
-      }
+    case ir_call:
+      emit_call(out, n_args, instr->srcs, instr->code);
+      emit_result(out, instr->dst);
       break;
-    }
-    case integer_exp:
-      // For example: 1
-      emit_integer(fp, ast->content.integerExp);
+    case ir_tail_call:
+      emit_tail_call(out, n_args, instr->srcs, instr->code, ir->used_regs,
+                     ir->memory_reqd);
       break;
-    case global_exp: {
-      emit_global_head(fp);
-      for (int i_exp = 0; i_exp < ast->content.globalExp->rest->len; ++i_exp) {
-        eval(fp, get_i(ast->content.globalExp->rest, i_exp), nth_if, 0);
-      }
-      int memory_reqd = get_memory_reqd_by_fn(ast);
-      emit_main_head(fp, memory_reqd);
-      offset = eval(fp, ast->content.globalExp->main, nth_if, offset);
-      emit_main_tail(fp);
+    case ir_self_tail_call:
+      emit_self_tail_call(out, n_args, instr->srcs, instr->target);
       break;
-    }
-    case make_closure_exp: {
-      int *offsets = malloc(ast->content.makeClosureExp->n_free_vars *
-                            sizeof(*offsets));  // +1 for the call pointer
-      for (int i_free = ast->content.makeClosureExp->n_free_vars - 1;
-           i_free >= 0; --i_free) {
-        AST *child =
-            (AST *)get_i(ast->content.makeClosureExp->free_vars, i_free);
-        offset = eval(fp, child, nth_if, offset);
-        offset += 8;  // Assuming that all operands are 8 bytes
-        offsets[i_free] = offset;
-        emit_operand(fp, offset, i_free,
-                     ast->content.makeClosureExp->n_free_vars);
+    case ir_make_closure:
+      if (instr->stack_offset > 0) {
+        emit_make_stack_closure(out, instr->name, instr->n_bound_vars,
+                                instr->n_srcs, instr->stack_offset);
+      } else {
+        emit_make_closure(out, instr->name, instr->n_bound_vars, instr->n_srcs,
+                          instr->nth);
       }
-      emit_make_closure(fp, ast->content.makeClosureExp->name,
-                        ast->content.makeClosureExp->n_bound_vars,
-                        ast->content.makeClosureExp->n_free_vars, offsets);
+      for (int i_free = 0; i_free < instr->n_srcs; ++i_free) {
+        emit_capture(out, i_free, instr->n_srcs, instr->srcs[i_free]);
+      }
+      emit_closure_made(out);
+      emit_result(out, instr->dst);
       break;
-    }
-    default:
-      fprintf(fp, "ERROR! Unexpected exp type in eval.\n");
-      JSONify_AST(ast);
+    case ir_branch:
+      emit_branch(out, instr->srcs[0], instr->target);
       break;
-  }
-  return offset;
-}
-
-int get_memory_reqd_by_fn(AST *ast) {
-  switch (ast->tag) {
-    case integer_exp:
-      return 0;
+    case ir_jump:
+      bprintf(out, "\tjmp .L%d\n", instr->target);
       break;
-    case var_exp:
-      return 0;
+    case ir_memo_lookup:
+      emit_memo_lookup(out, instr->name, instr->value, instr->target);
+      emit_result(out, instr->dst);
       break;
-    case if_exp:
-      return get_memory_reqd_by_fn(ast->content.ifExp->pred) +
-             get_memory_reqd_by_fn(ast->content.ifExp->case_true) +
-             get_memory_reqd_by_fn(ast->content.ifExp->case_false);
+    case ir_memo_store:
+      emit_to_acc(out, instr->srcs[0]);
+      emit_memo_store(out, instr->name, instr->value);
       break;
-    case lambda_exp:
-      return 8 * ast->content.lambdaExp->args->list->len +
-             get_memory_reqd_by_fn(ast->content.lambdaExp->body);
+    case ir_profile_start:
+      emit_profile_start(out, instr->value);
       break;
-    case let_exp:
-      return 8  // For arg
-             + get_memory_reqd_by_fn(ast->content.letExp->defn) +
-             get_memory_reqd_by_fn(ast->content.letExp->body);
+    case ir_profile_end:
+      emit_profile_end(out, instr->nth, instr->value);
       break;
-    case list_exp: {
-      int result = 8;  // For result of list evaluation
-      for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
-        result += 8;  // For result of operand
-        result += get_memory_reqd_by_fn(get_child(ast, i_exp));
+    case ir_return:
+      emit_to_acc(out, instr->srcs[0]);
+      if (ir->fn->tag == lambda_exp) {
+        emit_restore_registers(out, ir->used_regs, ir->memory_reqd);
+        emit_fn_tail(out);
+      } else {
+        emit_main_return(out);
       }
-      return result;
       break;
+  }
+}
+
+/**
+ * Emits the blocks of ir in order. Only the labels of blocks jumped to are
+ * emitted, as the peephole optimiser doesn't work across labels.
+ */
+static void emit_blocks(Buffer *out, IRFn *ir) {
+  char *is_target = calloc(ir->n_labels, sizeof(*is_target));
+  for (int i_block = 0; i_block < ir->n_blocks; ++i_block) {
+    IRBlock *block = ir->blocks[i_block];
+    for (int i_instr = 0; i_instr < block->n_instrs; ++i_instr) {
+      IRInstr *instr = &block->instrs[i_instr];
+      if (instr->op == ir_branch || instr->op == ir_jump ||
+          instr->op == ir_self_tail_call || instr->op == ir_memo_lookup) {
+        is_target[instr->target] = 1;
+      }
     }
-    case global_exp:
-      return get_memory_reqd_by_fn(ast->content.globalExp->main);
-      break;
-    case make_closure_exp:
-      return 8 * ast->content.makeClosureExp->free_vars->len;
-      break;
-    default:
-      printf("ERROR! Unexpected tag in get_memory_reqd_by_fn.\n");
-      printf("Tag: %d\n", ast->tag);
-      break;
   }
+  for (int i_block = 0; i_block < ir->n_blocks; ++i_block) {
+    IRBlock *block = ir->blocks[i_block];
+    if (is_target[block->label]) {
+      bprintf(out, ".L%d:\n", block->label);
+    }
+    for (int i_instr = 0; i_instr < block->n_instrs; ++i_instr) {
+      emit_instr(out, ir, &block->instrs[i_instr]);
+    }
+  }
+  free(is_target);
 }
 
-void emit_make_closure(FILE *fp, char *name, int n_bound_vars, int n_free_vars,
-                       int *offsets) {
-  if (n_free_vars >= 3) {
-    fprintf(fp, "\tmov r9, QWORD [rbp-%d]    ; free variable 3/%d\n",
-            offsets[2], n_free_vars);
-  }
-  if (n_free_vars >= 2) {
-    fprintf(fp, "\tmov r8, QWORD [rbp-%d]    ; free variable 2/%d\n",
-            offsets[1], n_free_vars);
-  }
-  if (n_free_vars >= 1) {
-    fprintf(fp, "\tmov rcx, QWORD [rbp-%d]    ; free variable 1/%d\n",
-            offsets[0], n_free_vars);
-  }
-  fprintf(fp, "\tmov rdx, %d            ; number of free variables\n",
-          n_free_vars);
-  fprintf(fp, "\tmov rsi, %d            ; number of bound variables\n",
-          n_bound_vars);
-  fprintf(fp, "\tmov rdi, %s            ; name of function\n", name);
-  fprintf(fp, "\tcall make_closure\n");
-}
-
-void emit_global_head(FILE *fp) {
-  fprintf(fp, "\tglobal main\n");
-  fprintf(fp, "\textern printf, malloc                ; C functions\n");
-  fprintf(fp, "\textern make_closure, call_closure    ; built-in functions\n");
-  fprintf(fp,
-          "\textern plus, minus, equals           ; standard "
-          "library functions\n");
-  fprintf(fp, "\n");
-  fprintf(fp, "\tsection .text\n");
-}
-
-void emit_main_head(FILE *fp, int memory_reqd) {
-  fprintf(fp, "main:\n");
-  fprintf(fp, "\tpush rbp\n");
-  fprintf(fp, "\tmov rbp, rsp\n");
-  fprintf(fp, "\tsub rsp, %d        ; memory for local variables\n",
-          memory_reqd);
-}
-
-void emit_main_tail(FILE *fp) {
-  fprintf(fp, "\tmov rsi, rax        ; will print rax\n");
-  fprintf(fp, "\tmov rdi, message\n");
-  fprintf(fp, "\tmov rax, 0\n");
-  fprintf(fp, "\tcall printf\n");
-  fprintf(fp, "\tmov rax, 0            ; exit code 0\n");
-  fprintf(fp, "\tleave\n");
-  fprintf(fp, "\tret\n");
-  fprintf(fp, "\n");
-  fprintf(fp, "\tsection .data\n");
-  fprintf(fp,
+/**
+ * Lowers a lifted lambda, or main if fn is the global node, optimises it and
+ * emits its code.
+ */
+static void emit_fn(Buffer *out, AST *fn) {
+  IRFn *ir = lower_fn(fn);
+  eliminate_common_subexpressions(ir);
+  // Slots only written by removed code need no room
+  ir->memory_reqd = get_memory_reqd_by_fn(ir);
+  if (options.ir) {
+    print_ir_fn(ir);
+  }
+  if (fn->tag == lambda_exp) {
+    SLambdaExp *lambda = fn->content.lambdaExp;
+    emit_fn_head(out, lambda->name, lambda->args, lambda->n_bound_vars,
+                 ir->memory_reqd);
+    emit_save_registers(out, ir->used_regs, ir->memory_reqd);
+  } else {
+    emit_main_head(out, ir->memory_reqd);
+  }
+  emit_blocks(out, ir);
+  if (fn->tag == lambda_exp) {
+    SLambdaExp *lambda = fn->content.lambdaExp;
+    if (lambda->is_memo) {
+      emit_memo_cache(out, lambda->name);
+    }
+    if (lambda->n_bound_vars == lambda->args->list->len) {
+      emit_static_closure(out, lambda->name, lambda->n_bound_vars);
+    }
+  }
+  free_ir_fn(ir);
+}
+
+/**
+ * Generates linear code from AST: the lifted lambdas of global, then main.
+ */
+void eval(Buffer *out, AST *global) {
+  emit_global_head(out);
+  for (int i_exp = 0; i_exp < global->content.globalExp->rest->len; ++i_exp) {
+    emit_fn(out, get_i(global->content.globalExp->rest, i_exp));
+  }
+  emit_fn(out, global);
+  emit_main_tail(out);
+}
+
+static void emit_closure_fields(Buffer *out, char *name, int n_bound_vars,
+                                int n_free_vars) {
+  bprintf(out, "\tmov QWORD [rdx], %d    ; closure tag\n", closure_tag);
+  bprintf(out, "\tmov rcx, %s\n", name);
+  bprintf(out, "\tmov QWORD [rdx+%ld], rcx    ; function\n",
+          offsetof(FirstClass, val.closure.codeptr));
+  bprintf(out, "\tmov QWORD [rdx+%ld], %d    ; number of bound variables\n",
+          offsetof(FirstClass, val.closure.n_bound_vars), n_bound_vars);
+  bprintf(out, "\tmov QWORD [rdx+%ld], %d    ; number of free variables\n",
+          offsetof(FirstClass, val.closure.n_free_vars), n_free_vars);
+}
+
+/**
+ * Allocates a closure, leaving its address in rdx for emit_capture.
+ */
+void emit_make_closure(Buffer *out, char *name, int n_bound_vars,
+                       int n_free_vars, int nth_site) {
+  emit_alloc(out, get_closure_size(n_free_vars), nth_site);
+  bprintf(out, "\tmov rdx, rax\n");
+  emit_closure_fields(out, name, n_bound_vars, n_free_vars);
+}
+
+/**
+ * Makes a closure that doesn't escape in the frame, ending at offset, leaving
+ * its address in rdx for emit_capture. The collector scans it with the frame's
+ * other slots, so its free variables are kept alive and updated.
+ */
+void emit_make_stack_closure(Buffer *out, char *name, int n_bound_vars,
+                             int n_free_vars, int offset) {
+  bprintf(out, "\tlea rdx, [rbp-%d]    ; closure on stack\n", offset);
+  emit_closure_fields(out, name, n_bound_vars, n_free_vars);
+}
+
+/**
+ * Stores src as a free variable of the closure being made. Clobbers rax.
+ * Params:
+ *   nth_free: 0-indexed
+ */
+void emit_capture(Buffer *out, int nth_free, int n_free_vars, IROperand src) {
+  char *value = operand(src);
+  if (src.kind != ir_location || !IS_REG_LOCATION(src.loc)) {
+    bprintf(out, "\tmov rax, %s\n", value);
+    value = "rax";
+  }
+  bprintf(out, "\tmov QWORD [rdx+%ld], %s    ; free variable %d/%d\n",
+          offsetof(FirstClass, val.closure.freevar) + nth_free * sizeof(long),
+          value, nth_free + 1, n_free_vars);
+}
+
+void emit_closure_made(Buffer *out) {
+  bprintf(out, "\tmov rax, rdx    ; closure\n");
+}
+
+/**
+ * Emits a read-only closure record for a function with no free variables,
+ * laid out like the records in standard.asm. Every closure of such a function
+ * is identical, so this one is shared instead of allocating.
+ */
+void emit_static_closure(Buffer *out, char *name, int n_bound_vars) {
+  bprintf(out, "\tsection .rodata\n");
+  bprintf(out, "\talign 8\n");
+  bprintf(out, "%s_closure:\n", name);
+  bprintf(out, "\tdq %d, %s, %d, 0    ; closure with no free variables\n",
+          closure_tag, name, n_bound_vars);
+  bprintf(out, "\tsection .text\n");
+}
+
+void emit_global_head(Buffer *out) {
+  bprintf(out, "\tglobal main\n");
+  bprintf(out, "\textern printf                        ; C functions\n");
+  bprintf(out,
+          "\textern make_closure, call_closure, not_a_closure, "
+          "division_by_zero    ; built-in functions\n");
+  bprintf(out,
+          "\textern arena_top, arena_limit, arena_refill    ; allocator\n");
+  bprintf(out, "\textern gc_frames, gc_call            ; garbage collector\n");
+  bprintf(out, "\textern memo_lookup, memo_store       ; memo functions\n");
+  if (options.profile) {
+    bprintf(out, "\textern profile_start                 ; profiler\n");
+  }
+  if (options.heap_profile) {
+    bprintf(out,
+            "\textern heap_profile_start, heap_profile_alloc    ; heap "
+            "profiler\n");
+  }
+  bprintf(out,
+          "\textern lfl_plus, lfl_minus, lfl_equals, lfl_times, lfl_div, "
+          "lfl_mod, lfl_less, lfl_greater    ; standard library functions\n");
+  bprintf(out,
+          "\textern _plus, _minus, _equals, _times, _div, _mod, _less, "
+          "_greater    ; and their code\n");
+  bprintf(out, "\n");
+  bprintf(out, "\tsection .text\n");
+}
+
+/**
+ * main saves the C caller's values of the allocatable registers outside its
+ * frame, where the garbage collector won't mistake them for values, and
+ * clears them, as the collector stub scans them all.
+ */
+void emit_main_head(Buffer *out, int memory_reqd) {
+  bprintf(out, "main:\n");
+  for (int i_reg = 0; i_reg < N_ALLOC_REGISTERS; ++i_reg) {
+    bprintf(out, "\tpush %s\n", alloc_registers[i_reg]);
+  }
+  if (N_ALLOC_REGISTERS % 2 == 1) {
+    bprintf(out, "\tsub rsp, 8    ; keep stack 16-byte aligned\n");
+  }
+  for (int i_reg = 0; i_reg < N_ALLOC_REGISTERS; ++i_reg) {
+    bprintf(out, "\txor %s, %s\n", alloc_registers[i_reg],
+            alloc_registers[i_reg]);
+  }
+  emit_frame_head(out, memory_reqd);
+  emit_frame_link(out, memory_reqd, 0);
+  if (options.profile) {
+    bprintf(out, "\tmov rdi, profile_records\n");
+    bprintf(out, "\tcall profile_start\n");
+  }
+  if (options.heap_profile) {
+    bprintf(out, "\tmov rdi, heap_sites\n");
+    bprintf(out, "\tcall heap_profile_start\n");
+  }
+}
+
+/**
+ * Prints the result of main, in rax, and returns to the C caller.
+ */
+void emit_main_return(Buffer *out) {
+  emit_frame_tail(out);
+  bprintf(out, "\tmov rsi, rax        ; will print rax\n");
+  bprintf(out, "\tsar rsi, 1          ; untag integer\n");
+  bprintf(out, "\tmov rdi, message\n");
+  bprintf(out, "\tmov rax, 0\n");
+  bprintf(out, "\tcall printf\n");
+  bprintf(out, "\tmov rax, 0            ; exit code 0\n");
+  bprintf(out, "\tleave\n");
+  if (N_ALLOC_REGISTERS % 2 == 1) {
+    bprintf(out, "\tadd rsp, 8\n");
+  }
+  for (int i_reg = N_ALLOC_REGISTERS - 1; i_reg >= 0; --i_reg) {
+    bprintf(out, "\tpop %s\n", alloc_registers[i_reg]);
+  }
+  bprintf(out, "\tret\n");
+}
+
+void emit_main_tail(Buffer *out) {
+  bprintf(out, "called_non_closure:    ; calls jump here if operator is integer\n");
+  bprintf(out, "\tmov rdi, r10\n");
+  bprintf(out, "\tcall not_a_closure    ; doesn't return\n");
+  bprintf(out, "divided_by_zero:    ; div and mod jump here if divisor is 0\n");
+  bprintf(out, "\tcall division_by_zero    ; doesn't return\n");
+  bprintf(out, "\n");
+  bprintf(out, "\tsection .data\n");
+  bprintf(out,
           "message: db \"%%d\", 10, 0        ; 10 is newline, 0 is "
           "end-of-string\n");
+  if (options.profile) {
+    emit_profile_records(out);
+  }
+  if (options.heap_profile) {
+    emit_heap_sites(out);
+  }
 }
 
-void emit_let(FILE *fp, int nth, char *arg) {
-  fprintf(fp, "\tmov QWORD [rbp-%d], rax    ; let %s\n", nth, arg);
+/**
+ * Loads the operands args[0..n_args-1] into the argument registers, pushing
+ * any beyond those onto the stack, last first.
+ * Returns:
+ *   Bytes pushed, for emit_pop_args to remove after the call
+ */
+int emit_args(Buffer *out, int n_args, IROperand *args) {
+  int n_stack_args = n_args > N_ARG_REGISTERS ? n_args - N_ARG_REGISTERS : 0;
+  int stack_bytes = 8 * n_stack_args;
+  if (n_stack_args % 2 == 1) {
+    bprintf(out, "\tsub rsp, 8    ; keep stack 16-byte aligned\n");
+    stack_bytes += 8;
+  }
+  for (int i_arg = n_args - 1; i_arg >= N_ARG_REGISTERS; --i_arg) {
+    bprintf(out, "\tpush %s    ; operand %d/%d\n", operand(args[i_arg]),
+            i_arg + 1, n_args);
+  }
+  for (int i_arg = n_args - 1; i_arg >= 0; --i_arg) {
+    if (i_arg < N_ARG_REGISTERS) {
+      bprintf(out, "\tmov %s, %s    ; operand %d/%d\n", arg_registers[i_arg],
+              operand(args[i_arg]), i_arg + 1, n_args);
+    }
+  }
+  return stack_bytes;
+}
+
+void emit_pop_args(Buffer *out, int stack_bytes) {
+  if (stack_bytes > 0) {
+    bprintf(out, "\tadd rsp, %d    ; remove stack operands\n", stack_bytes);
+  }
+}
+
+/**
+ * Passes the closure src in r10, from which the callee takes its free
+ * variables, unless the callee doesn't need one.
+ */
+static void emit_closure_arg(Buffer *out, IROperand src) {
+  if (src.kind != ir_none) {
+    bprintf(out, "\tmov r10, %s    ; closure\n", operand(src));
+  }
+}
+
+/**
+ * Calls the closure srcs[0] with the operands srcs[1..n_args], by its code
+ * label if known, else through its code pointer, once checked that it is a
+ * closure.
+ */
+void emit_call(Buffer *out, int n_args, IROperand *srcs, char *code) {
+  int stack_bytes = emit_args(out, n_args, srcs + 1);
+  emit_closure_arg(out, srcs[0]);
+  if (code != NULL) {
+    bprintf(out, "\tcall %s            ; known call, output goes to rax\n",
+            code);
+  } else {
+    bprintf(out, "\ttest r10, %d\n", INT_TAG);
+    bprintf(out, "\tjnz called_non_closure\n");
+    bprintf(out, "\tcall [r10+%ld]            ; output goes to rax\n",
+            offsetof(FirstClass, val.closure.codeptr));
+  }
+  emit_pop_args(out, stack_bytes);
 }
 
-void emit_fn_name(FILE *fp, char *var) {
-  fprintf(fp, "\tmov rax, %s            ; access %s\n", var, var);
+/**
+ * Computes the standard library function name of the operands srcs[0] and
+ * srcs[1] into rax, as its code in standard.asm does.
+ */
+void emit_primitive(Buffer *out, char *name, IROperand *srcs) {
+  char *a = operand(srcs[0]);
+  char *b = operand(srcs[1]);
+  bprintf(out, "\tmov rax, %s    ; %s\n", a, name);
+  if (strcmp(name, "plus") == 0) {
+    bprintf(out, "\tadd rax, %s\n", b);
+    bprintf(out, "\tdec rax    ; (2a+1) + (2b+1) - 1\n");
+  } else if (strcmp(name, "minus") == 0) {
+    bprintf(out, "\tsub rax, %s\n", b);
+    bprintf(out, "\tor rax, 1    ; (2a+1) - (2b+1) + 1\n");
+  } else if (strcmp(name, "times") == 0) {
+    bprintf(out, "\tsar rax, 1\n");
+    bprintf(out, "\tmov r11, %s\n", b);
+    bprintf(out, "\tdec r11\n");
+    bprintf(out, "\timul rax, r11\n");
+    bprintf(out, "\tor rax, 1    ; a(2b) + 1\n");
+  } else if (strcmp(name, "div") == 0 || strcmp(name, "mod") == 0) {
+    bprintf(out, "\tsar rax, 1\n");
+    bprintf(out, "\tmov r11, %s\n", b);
+    bprintf(out, "\tsar r11, 1\n");
+    bprintf(out, "\tjz divided_by_zero\n");
+    bprintf(out, "\tcqo\n");
+    bprintf(out, "\tidiv r11\n");
+    bprintf(out, "\tlea rax, [%s*2+1]\n",
+            strcmp(name, "div") == 0 ? "rax" : "rdx");
+  } else {
+    // Comparisons, of tagged integers, as tagging keeps their order
+    char *condition = strcmp(name, "equals") == 0 ? "e"
+                      : strcmp(name, "less") == 0 ? "l"
+                                                  : "g";
+    bprintf(out, "\tcmp rax, %s\n", b);
+    bprintf(out, "\tset%s al\n", condition);
+    bprintf(out, "\tmovzx eax, al\n");
+    bprintf(out, "\tlea rax, [rax*2+1]\n");
+  }
 }
 
-void emit_var(FILE *fp, int nth, char *var) {
-  fprintf(fp, "\tmov rax, QWORD [rbp-%d]    ; access %s\n", nth, var);
+/**
+ * Calls the function being defined, from tail position, by replacing its
+ * bound variables with the operands srcs[1..n_args] and jumping to the block
+ * target, which loads them. Its free variables and closure stay the same.
+ */
+void emit_self_tail_call(Buffer *out, int n_args, IROperand *srcs, int target) {
+  // Operands are never in arg slots, so can all be moved before any is lost
+  for (int i_arg = 0; i_arg < n_args; ++i_arg) {
+    IROperand src = srcs[i_arg + 1];
+    char *value = operand(src);
+    if (src.kind != ir_location || !IS_REG_LOCATION(src.loc)) {
+      bprintf(out, "\tmov rax, %s\n", value);
+      value = "rax";
+    }
+    bprintf(out, "\tmov QWORD [rbp-%d], %s    ; arg %d/%d\n",
+            GC_FRAME_HEADER_SIZE + (i_arg + 1) * 8, value, i_arg + 1, n_args);
+  }
+  bprintf(out, "\tjmp .L%d            ; self tail call\n", target);
 }
 
-void emit_integer(FILE *fp, int x) {
-  fprintf(fp, "\tmov rax, %d                ; integer constant\n", x);
+/**
+ * Calls from tail position, by removing the caller's frame and jumping, so
+ * that the callee returns to the caller's caller. All args must fit in the
+ * argument registers. Jumps to code if known, else to the code of the
+ * closure srcs[0].
+ */
+void emit_tail_call(Buffer *out, int n_args, IROperand *srcs, char *code,
+                    int used_regs, int memory_reqd) {
+  emit_args(out, n_args, srcs + 1);
+  emit_closure_arg(out, srcs[0]);
+  if (code == NULL) {
+    bprintf(out, "\ttest r10, %d\n", INT_TAG);
+    bprintf(out, "\tjnz called_non_closure\n");
+  }
+  emit_restore_registers(out, used_regs, memory_reqd);
+  bprintf(out, "\tmov r11, QWORD [rbp-8]\n");
+  bprintf(out, "\tmov QWORD [gc_frames], r11    ; unlink frame\n");
+  bprintf(out, "\tleave\n");
+  if (code == NULL) {
+    bprintf(out, "\tjmp [r10+%ld]            ; tail call\n",
+            offsetof(FirstClass, val.closure.codeptr));
+  } else {
+    bprintf(out, "\tjmp %s            ; known tail call\n", code);
+  }
 }
 
 /**
+ * Bump-allocates n_bytes from the runtime arena, leaving the address in rax.
+ * Only calls into the runtime when the current chunk is full.
+ * Clobbers rcx and rdi, or all caller-saved registers if heap profiling.
  * Params:
- *   nth_operand: 0-indexed
- */
-void emit_operand(FILE *fp, int offset, int nth_operand, int n_operands) {
-  // Save evaluated operand in memory
-  fprintf(fp, "\tmov QWORD [rbp-%d], rax    ; preparing operand %d/%d\n",
-          offset, nth_operand + 1, n_operands);
-}
-
-void emit_call(FILE *fp, int n_args, int *offsets, int offset) {
-  fprintf(fp, "\tmov QWORD [rbp-%d], rax    ; preparing closure\n", offset);
-  // Put required number of args into arg registers
-  if (n_args >= 4) {
-    fprintf(fp, "\tmov r8, QWORD [rbp-%d]    ; operand 4/%d\n", offsets[4],
-            n_args);
-  }
-  if (n_args >= 3) {
-    fprintf(fp, "\tmov rcx, QWORD [rbp-%d]    ; operand 3/%d\n", offsets[3],
-            n_args);
-  }
-  if (n_args >= 2) {
-    fprintf(fp, "\tmov rdx, QWORD [rbp-%d]    ; operand 2/%d\n", offsets[2],
-            n_args);
-  }
-  if (n_args >= 1) {
-    fprintf(fp, "\tmov rsi, QWORD [rbp-%d]    ; operand 1/%d\n", offsets[1],
-            n_args);
-  }
-  // Put closure address in first arg register
-  fprintf(fp, "\tmov rdi, QWORD [rbp-%d]    ; operator location\n", offsets[0]);
-  fprintf(fp, "\tcall call_closure            ; output goes to rax\n");
-}
-
-void emit_recursive_call(FILE *fp, int n_args, int *offsets, char *name,
-                         int malloc_offset) {
-  // Put required number of args onto the heap
-  // TODO Make memory required a parameter
-  fprintf(fp, "\tmov rdi, %d        ; memory for recursive call variables\n",
-          n_args * 8);
-  fprintf(fp, "\tcall malloc             ; memory location goes to rax\n");
-  fprintf(fp, "\tmov QWORD [rbp-%d], rax\n", malloc_offset);
+ *   nth_site: From add_heap_site, or -1 if not heap profiling
+ */
+void emit_alloc(Buffer *out, int n_bytes, int nth_site) {
+  int nth = n_allocs_emitted++;
+  n_bytes = (n_bytes + 7) & ~7;
+  if (nth_site >= 0) {
+    bprintf(out, "\tmov rdi, %d\n", n_bytes);
+    bprintf(out, "\tmov rsi, %d    ; allocation site\n", nth_site + 1);
+    bprintf(out, "\tmov r11, heap_profile_alloc\n");
+    bprintf(out, "\tcall gc_call\n");
+    return;
+  }
+  bprintf(out, "\tmov rax, QWORD [arena_top]    ; allocate %d bytes\n",
+          n_bytes);
+  bprintf(out, "\tlea rcx, [rax+%d]\n", ARENA_HEADER_SIZE + n_bytes);
+  bprintf(out, "\tcmp rcx, QWORD [arena_limit]\n");
+  bprintf(out, "\tja .Alloc%dSlow\n", nth);
+  bprintf(out, "\tmov QWORD [arena_top], rcx\n");
+  bprintf(out, "\tmov QWORD [rax], %d    ; header for collector\n", n_bytes);
+  bprintf(out, "\tadd rax, %d\n", ARENA_HEADER_SIZE);
+  bprintf(out, "\tjmp .Alloc%dDone\n", nth);
+  bprintf(out, ".Alloc%dSlow:\n", nth);
+  bprintf(out, "\tmov rdi, %d\n", n_bytes);
+  bprintf(out, "\tmov r11, arena_refill    ; chunk full, so get another\n");
+  bprintf(out, "\tcall gc_call\n");
+  bprintf(out, ".Alloc%dDone:\n", nth);
+}
+
+/**
+ * Jumps to the block target if src is false.
+ */
+void emit_branch(Buffer *out, IROperand src, int target) {
+  bprintf(out, "\tcmp %s, %ld    ; 0 is false\n", operand(src), TAG_INT(0));
+  bprintf(out, "\tje .L%d\n", target);
+}
+
+/**
+ * Moves the function's args to the stack: bound variables from the argument
+ * registers and then the caller's stack, and free variables from the closure
+ * in r10. The closure itself is stored after them.
+ */
+void emit_fn_head(Buffer *out, char *name, Map *args, int n_bound_vars,
+                  int memory_reqd) {
+  int n_args = args->list->len;
+  bprintf(out, "%s:\n", name);
+  emit_frame_head(out, memory_reqd);
   for (int i_arg = 0; i_arg < n_args; ++i_arg) {
-    // offsets[0] is reserved for function name, so it's skipped
-    fprintf(
-        fp,
-        "\tmov rbx, QWORD [rbp-%d]    ; operand %d/%d for recursive call...\n",
-        offsets[i_arg + 1], i_arg + 1, n_args);
-    fprintf(fp, "\tmov QWORD [rax+%d], rbx    ; ...loaded onto heap\n",
-            i_arg * 8);
-  }
-  fprintf(
-      fp,
-      "\tmov rdi, QWORD [rbp-%d]        ; pointer to args for recursive call\n",
-      malloc_offset);
-  fprintf(fp, "\tcall %s            ; output goes to rax\n", name);
-  // TODO Free malloc'd memory but moving rax to stack, moving malloc result to
-  // rax,
-  // TODO freeing memory, then moving call result back to rax
-}
-
-void emit_if_pred(FILE *fp, int nth_if) {
-  fprintf(fp, "\tcmp rax, 0\n");
-  fprintf(fp, "\tje .L%dFalse\n", nth_if);
-}
-
-void emit_if_true(FILE *fp, int nth_if) {
-  fprintf(fp, "\tjmp .L%dDone\n", nth_if);
-  fprintf(fp, ".L%dFalse:\n", nth_if);
-}
-
-void emit_if_false(FILE *fp, int nth_if) { fprintf(fp, ".L%dDone:\n", nth_if); }
-
-void emit_fn_head(FILE *fp, char *name, Map *args, int memory_reqd) {
-  fprintf(fp, "%s:\n", name);
-  fprintf(fp, "\tpush rbp\n");
-  fprintf(fp, "\tmov rbp, rsp\n");
-  fprintf(fp, "\tsub rsp, %d        ; memory for local variables\n",
-          memory_reqd);
-  fprintf(fp, "\tmov rax, rdi       ; pointer to vector of arguments\n");
-  for (int i_arg = 1; i_arg <= args->list->len; ++i_arg) {
-    fprintf(fp, "\tmov rbx, QWORD [rax+%d]    ; move %s from heap\n",
-            (i_arg - 1) * 8, (char *)get_key_i(args, i_arg - 1));
-    fprintf(fp, "\tmov QWORD [rbp-%d], rbx    ; move %s to stack\n", i_arg * 8,
-            (char *)get_key_i(args, i_arg - 1));
-  }
-}
-
-int emit_fn_tail(FILE *fp) {
-  fprintf(fp, "\tleave\n");
-  fprintf(fp, "\tret\n");
-}
\ No newline at end of file
+    char *arg = (char *)get_key_i(args, i_arg);
+    int arg_offset = GC_FRAME_HEADER_SIZE + (i_arg + 1) * 8;
+    if (i_arg >= n_bound_vars) {
+      bprintf(out, "\tmov rax, QWORD [r10+%ld]    ; move %s from closure\n",
+              offsetof(FirstClass, val.closure.freevar) +
+                  (i_arg - n_bound_vars) * sizeof(long),
+              arg);
+      bprintf(out, "\tmov QWORD [rbp-%d], rax    ; move %s to stack\n",
+              arg_offset, arg);
+    } else if (i_arg < N_ARG_REGISTERS) {
+      bprintf(out, "\tmov QWORD [rbp-%d], %s    ; move %s to stack\n",
+              arg_offset, arg_registers[i_arg], arg);
+    } else {
+      bprintf(out, "\tmov rax, QWORD [rbp+%d]    ; move %s from caller\n",
+              16 + (i_arg - N_ARG_REGISTERS) * 8, arg);
+      bprintf(out, "\tmov QWORD [rbp-%d], rax    ; move %s to stack\n",
+              arg_offset, arg);
+    }
+  }
+  bprintf(out, "\tmov QWORD [rbp-%d], r10    ; own closure\n",
+          GC_FRAME_HEADER_SIZE + (n_args + 1) * 8);
+  emit_frame_link(out, memory_reqd, n_args + 1);
+}
+
+static int get_save_offset(int memory_reqd, int nth_saved) {
+  // Saved registers take the last slots
+  return GC_FRAME_HEADER_SIZE + memory_reqd - 8 * nth_saved;
+}
+
+/**
+ * Saves the caller's values of the registers in used_regs, in slots so that
+ * the garbage collector updates them.
+ */
+void emit_save_registers(Buffer *out, int used_regs, int memory_reqd) {
+  int n_saved = 0;
+  for (int i_reg = 0; i_reg < N_ALLOC_REGISTERS; ++i_reg) {
+    if (used_regs & (1 << i_reg)) {
+      bprintf(out, "\tmov QWORD [rbp-%d], %s    ; save caller's\n",
+              get_save_offset(memory_reqd, n_saved++), alloc_registers[i_reg]);
+    }
+  }
+}
+
+/**
+ * Restores the registers saved by emit_save_registers. Preserves rax.
+ */
+void emit_restore_registers(Buffer *out, int used_regs, int memory_reqd) {
+  int n_saved = 0;
+  for (int i_reg = 0; i_reg < N_ALLOC_REGISTERS; ++i_reg) {
+    if (used_regs & (1 << i_reg)) {
+      bprintf(out, "\tmov %s, QWORD [rbp-%d]    ; restore caller's\n",
+              alloc_registers[i_reg], get_save_offset(memory_reqd, n_saved++));
+    }
+  }
+}
+
+int emit_fn_tail(Buffer *out) {
+  emit_frame_tail(out);
+  bprintf(out, "\tleave\n");
+  bprintf(out, "\tret\n");
+}
+
+/**
+ * Gives a lambda or call a profile record, emitted by emit_profile_records.
+ * Returns:
+ *   The record's number, for emit_profile_end
+ */
+int add_profiled_node(AST *ast) {
+  if (profiled_nodes == NULL) {
+    profiled_nodes = make_list();
+  }
+  push_tail(profiled_nodes, ast);
+  return profiled_nodes->len - 1;
+}
+
+/**
+ * Emits a ProfileRecord for each profiled lambda and call, and the table of
+ * them that main passes to profile_start. They're emitted together at the end
+ * so that their labels don't end the scope of functions' local labels.
+ */
+void emit_profile_records(Buffer *out) {
+  int n_records = profiled_nodes == NULL ? 0 : profiled_nodes->len;
+  bprintf(out, "\talign 8\n");
+  bprintf(out, "profile_records:    ; for profile_start\n");
+  for (int i_record = 0; i_record < n_records; ++i_record) {
+    bprintf(out, "\tdq _profile%d\n", i_record);
+  }
+  bprintf(out, "\tdq 0\n");
+  for (int i_record = 0; i_record < n_records; ++i_record) {
+    AST *ast = get_i(profiled_nodes, i_record);
+    char *name;
+    int kind;
+    if (ast->tag == lambda_exp) {
+      name = ast->content.lambdaExp->name;
+      kind = profile_function;
+    } else {
+      AST *first = ast->content.listExp->first;
+      name = first->tag == var_exp ? first->content.varExp->name : "(...)";
+      kind = profile_call_site;
+    }
+    bprintf(out, "_profile%d:\n", i_record);
+    bprintf(out, "\tdq 0, 0, _profile%dName, %d, %d, %d    ; profile of %s\n",
+            i_record, ast->line, ast->column, kind, name);
+    bprintf(out, "_profile%dName:\n", i_record);
+    bprintf(out, "\tdb \"");
+    for (char *ch = name; *ch != '\0'; ++ch) {
+      if (*ch == '"') {
+        bprintf(out, "\", 34, \"");
+      } else {
+        bputc(out, *ch);
+      }
+    }
+    bprintf(out, "\", 0\n");
+    bprintf(out, "\talign 8\n");
+  }
+}
+
+/**
+ * Jumps to the block target with the cached result of a memo function for its
+ * args, which emit_fn_head has put in its first slots, in rax, if there is
+ * one.
+ */
+void emit_memo_lookup(Buffer *out, char *name, int n_args, int target) {
+  bprintf(out, "\tmov rdi, %s_memo\n", name);
+  bprintf(out, "\tlea rsi, [rbp-%d]    ; args, last first\n",
+          GC_FRAME_HEADER_SIZE + n_args * 8);
+  bprintf(out, "\tmov rdx, %d\n", n_args);
+  bprintf(out, "\tcall memo_lookup\n");
+  bprintf(out, "\ttest rax, rax\n");
+  bprintf(out, "\tjnz .L%d    ; cached\n", target);
+}
+
+/**
+ * Caches the result of a memo function, in rax, and preserves it.
+ */
+void emit_memo_store(Buffer *out, char *name, int n_args) {
+  bprintf(out, "\tmov rdi, %s_memo\n", name);
+  bprintf(out, "\tlea rsi, [rbp-%d]    ; args, last first\n",
+          GC_FRAME_HEADER_SIZE + n_args * 8);
+  bprintf(out, "\tmov rdx, %d\n", n_args);
+  bprintf(out, "\tmov rcx, rax\n");
+  bprintf(out, "\tcall memo_store\n");
+}
+
+/**
+ * Emits the pointer to a memo function's cache, which the runtime makes on
+ * the first call.
+ */
+void emit_memo_cache(Buffer *out, char *name) {
+  bprintf(out, "\tsection .data\n");
+  bprintf(out, "\talign 8\n");
+  bprintf(out, "%s_memo:\n", name);
+  bprintf(out, "\tdq 0\n");
+  bprintf(out, "\tsection .text\n");
+}
+
+/**
+ * Gives an allocating expression an allocation site, emitted by
+ * emit_heap_sites.
+ * Returns:
+ *   The site's number, from 0, for emit_alloc
+ */
+int add_heap_site(AST *ast) {
+  if (heap_site_nodes == NULL) {
+    heap_site_nodes = make_list();
+  }
+  push_tail(heap_site_nodes, ast);
+  return heap_site_nodes->len - 1;
+}
+
+/**
+ * Emits a HeapSite for each allocating expression, and the table of them
+ * that main passes to heap_profile_start.
+ */
+void emit_heap_sites(Buffer *out) {
+  int n_sites = heap_site_nodes == NULL ? 0 : heap_site_nodes->len;
+  bprintf(out, "\talign 8\n");
+  bprintf(out, "heap_sites:    ; for heap_profile_start\n");
+  for (int i_site = 0; i_site < n_sites; ++i_site) {
+    bprintf(out, "\tdq _heapSite%d\n", i_site);
+  }
+  bprintf(out, "\tdq 0\n");
+  for (int i_site = 0; i_site < n_sites; ++i_site) {
+    AST *ast = get_i(heap_site_nodes, i_site);
+    bprintf(out, "_heapSite%d:\n", i_site);
+    bprintf(out, "\tdq _heapSite%dName, %d, %d, 0, 0, 0, 0, 0\n", i_site,
+            ast->line, ast->column);
+    bprintf(out, "_heapSite%dName:\n", i_site);
+    bprintf(out, "\tdb \"%s\", 0\n", ast->content.makeClosureExp->name);
+    bprintf(out, "\talign 8\n");
+  }
+}
+
+/**
+ * Stores the time stamp counter, tagged so that the collector skips it.
+ * Clobbers rax and rdx.
+ */
+void emit_profile_start(Buffer *out, int offset) {
+  bprintf(out, "\trdtsc\n");
+  bprintf(out, "\tshl rdx, 32\n");
+  bprintf(out, "\tor rax, rdx\n");
+  bprintf(out, "\tor rax, %d\n", INT_TAG);
+  bprintf(out, "\tmov QWORD [rbp-%d], rax    ; time of entry\n", offset);
+}
+
+/**
+ * Adds the cycles since emit_profile_start to the nth profile record.
+ * Preserves rax.
+ */
+void emit_profile_end(Buffer *out, int nth, int offset) {
+  bprintf(out, "\tmov r11, rax\n");
+  bprintf(out, "\trdtsc\n");
+  bprintf(out, "\tshl rdx, 32\n");
+  bprintf(out, "\tor rax, rdx\n");
+  bprintf(out, "\tsub rax, QWORD [rbp-%d]    ; cycles since entry\n", offset);
+  bprintf(out, "\tadd QWORD [_profile%d+%ld], rax\n", nth,
+          offsetof(ProfileRecord, cycles));
+  bprintf(out, "\tinc QWORD [_profile%d+%ld]\n", nth,
+          offsetof(ProfileRecord, n_calls));
+  bprintf(out, "\tmov rax, r11\n");
+}
+
+static int get_frame_size(int memory_reqd) {
+  // Keep rsp 16-byte aligned for calls
+  return (GC_FRAME_HEADER_SIZE + memory_reqd + 15) & ~15;
+}
+
+void emit_frame_head(Buffer *out, int memory_reqd) {
+  bprintf(out, "\tpush rbp\n");
+  bprintf(out, "\tmov rbp, rsp\n");
+  bprintf(out, "\tsub rsp, %d        ; memory for local variables\n",
+          get_frame_size(memory_reqd));
+}
+
+/**
+ * Links the frame into the chain of frames that the garbage collector scans,
+ * and clears all but the first n_filled slots. Clobbers the argument
+ * registers.
+ */
+void emit_frame_link(Buffer *out, int memory_reqd, int n_filled) {
+  int n_slots = (get_frame_size(memory_reqd) - GC_FRAME_HEADER_SIZE) / 8;
+  bprintf(out, "\tmov rax, QWORD [gc_frames]\n");
+  bprintf(out, "\tmov QWORD [rbp-8], rax    ; link frame for collector\n");
+  bprintf(out, "\tmov QWORD [rbp-16], %d    ; number of slots\n", n_slots);
+  bprintf(out, "\tmov QWORD [gc_frames], rbp\n");
+  if (n_slots > n_filled) {
+    bprintf(out, "\tmov rdi, rsp\n");
+    bprintf(out, "\tmov rcx, %d\n", n_slots - n_filled);
+    bprintf(out, "\txor eax, eax\n");
+    bprintf(out, "\trep stosq                 ; clear slots\n");
+  }
+}
+
+/**
+ * Unlinks the frame linked by emit_frame_link. Preserves rax.
+ */
+void emit_frame_tail(Buffer *out) {
+  bprintf(out, "\tmov rcx, QWORD [rbp-8]\n");
+  bprintf(out, "\tmov QWORD [gc_frames], rcx    ; unlink frame\n");
+}
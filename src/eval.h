@@ -1,45 +1,88 @@
-#include <stdio.h>
 #include "ast.h"
+#include "buffer.h"
+#include "ir.h"
 
 #ifndef EVAL_H
 #define EVAL_H
 
-int eval(FILE *fp, AST *ast, int nth_if, int offset);
+// Calls pass this many args in registers and the rest on the stack, as in the
+// System V ABI. The closure being called is passed in r10.
+#define N_ARG_REGISTERS 6
 
-int get_memory_reqd_by_fn(AST *ast);
+// Prefixed to the name of a standard library function to give the symbol of
+// its closure, so that it doesn't replace a C library function of that name
+#define STANDARD_CLOSURE_PREFIX "lfl_"
 
-void emit_make_closure(FILE *fp, char *name, int n_bound_vars, int n_free_vars,
-                       int *offsets);
+void eval(Buffer *out, AST *global);
 
-void emit_global_head(FILE *fp);
+void emit_make_closure(Buffer *out, char *name, int n_bound_vars,
+                       int n_free_vars, int nth_site);
 
-void emit_main_head(FILE *fp, int memory_reqd);
+void emit_make_stack_closure(Buffer *out, char *name, int n_bound_vars,
+                             int n_free_vars, int offset);
 
-void emit_main_tail(FILE *fp);
+void emit_capture(Buffer *out, int nth_free, int n_free_vars, IROperand src);
 
-void emit_let(FILE *fp, int nth, char *arg);
+void emit_closure_made(Buffer *out);
 
-void emit_fn_name(FILE *fp, char *name);
+void emit_static_closure(Buffer *out, char *name, int n_bound_vars);
 
-void emit_var(FILE *fp, int nth, char *var);
+void emit_global_head(Buffer *out);
 
-void emit_integer(FILE *fp, int x);
+void emit_main_head(Buffer *out, int memory_reqd);
 
-void emit_operand(FILE *fp, int offset, int nth_operand, int n_operands);
+void emit_main_return(Buffer *out);
 
-void emit_call(FILE *fp, int n_args, int *arg_offsets, int offset);
+void emit_main_tail(Buffer *out);
 
-void emit_recursive_call(FILE *fp, int n_args, int *offsets, char *name,
-                         int malloc_offset);
+int emit_args(Buffer *out, int n_args, IROperand *args);
 
-void emit_if_pred(FILE *fp, int nth_if);
+void emit_pop_args(Buffer *out, int stack_bytes);
 
-void emit_if_true(FILE *fp, int nth_if);
+void emit_call(Buffer *out, int n_args, IROperand *srcs, char *code);
 
-void emit_if_false(FILE *fp, int nth_if);
+void emit_self_tail_call(Buffer *out, int n_args, IROperand *srcs, int target);
 
-void emit_fn_head(FILE *fp, char *name, Map *args, int memory_reqd);
+void emit_primitive(Buffer *out, char *name, IROperand *srcs);
 
-int emit_fn_tail(FILE *fp);
+void emit_tail_call(Buffer *out, int n_args, IROperand *srcs, char *code,
+                    int used_regs, int memory_reqd);
+
+void emit_alloc(Buffer *out, int n_bytes, int nth_site);
+
+void emit_branch(Buffer *out, IROperand src, int target);
+
+void emit_fn_head(Buffer *out, char *name, Map *args, int n_bound_vars,
+                  int memory_reqd);
+
+void emit_save_registers(Buffer *out, int used_regs, int memory_reqd);
+
+void emit_restore_registers(Buffer *out, int used_regs, int memory_reqd);
+
+int emit_fn_tail(Buffer *out);
+
+int add_profiled_node(AST *ast);
+
+void emit_profile_records(Buffer *out);
+
+void emit_memo_lookup(Buffer *out, char *name, int n_args, int target);
+
+void emit_memo_store(Buffer *out, char *name, int n_args);
+
+void emit_memo_cache(Buffer *out, char *name);
+
+int add_heap_site(AST *ast);
+
+void emit_heap_sites(Buffer *out);
+
+void emit_profile_start(Buffer *out, int offset);
+
+void emit_profile_end(Buffer *out, int nth, int offset);
+
+void emit_frame_head(Buffer *out, int memory_reqd);
+
+void emit_frame_link(Buffer *out, int memory_reqd, int n_filled);
+
+void emit_frame_tail(Buffer *out);
 
 #endif
\ No newline at end of file
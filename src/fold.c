@@ -0,0 +1,111 @@
+#include "fold.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ast.h"
+#include "known.h"
+#include "scope.h"
+
+/**
+ * Constant folding and propagation, between make_scopes and closure_convert.
+ *
+ * Primitive applications to integers are replaced by their results,
+ * variables bound by a let or def to an integer by the integer, and ifs with
+ * an integer predicate by the branch taken. As this runs first, lambdas that
+ * only used such variables no longer capture them.
+ */
+
+/**
+ * Computes (name a b) as the generated code would.
+ * Returns:
+ *   1 if the result is known and fits an integer constant, else 0, leaving it
+ *   to run time, which also reports division by zero
+ */
+static int apply_primitive(char *name, long a, long b, long *result) {
+  if (strcmp(name, "plus") == 0) {
+    *result = a + b;
+  } else if (strcmp(name, "minus") == 0) {
+    *result = a - b;
+  } else if (strcmp(name, "times") == 0) {
+    *result = a * b;
+  } else if (strcmp(name, "div") == 0 || strcmp(name, "mod") == 0) {
+    if (b == 0) {
+      return 0;
+    }
+    *result = strcmp(name, "div") == 0 ? a / b : a % b;
+  } else if (strcmp(name, "equals") == 0) {
+    *result = a == b;
+  } else if (strcmp(name, "less") == 0) {
+    *result = a < b;
+  } else if (strcmp(name, "greater") == 0) {
+    *result = a > b;
+  } else {
+    return 0;
+  }
+  return *result >= INT_MIN && *result <= INT_MAX;
+}
+
+/**
+ * Turns ast into the integer val in place, freeing what it was.
+ */
+static void make_integer(AST *ast, int val) {
+  if (ast->tag == var_exp) {
+    free(ast->content.varExp->name);
+    free(ast->content.varExp);
+  } else {
+    for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+      free_ast(get_child(ast, i_exp));
+    }
+    free_list(ast->content.listExp->rest);
+    free(ast->content.listExp);
+  }
+  ast->tag = integer_exp;
+  ast->content.integerExp = val;
+}
+
+void fold_constants(AST *ast) {
+  // Children first, so constants are folded before they're propagated
+  for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+    fold_constants(get_child(ast, i_exp));
+  }
+  switch (ast->tag) {
+    case var_exp: {
+      AST *let = find_let(ast);
+      if (let != NULL && let->content.letExp->defn->tag == integer_exp) {
+        make_integer(ast, let->content.letExp->defn->content.integerExp);
+      }
+      break;
+    }
+    case list_exp: {
+      char *name = get_primitive(ast);
+      if (name == NULL) {
+        break;
+      }
+      AST *a = get_child(ast, 1);
+      AST *b = get_child(ast, 2);
+      long result;
+      if (a->tag == integer_exp && b->tag == integer_exp &&
+          apply_primitive(name, a->content.integerExp, b->content.integerExp,
+                          &result)) {
+        make_integer(ast, result);
+      }
+      break;
+    }
+    case if_exp:
+      if (ast->content.ifExp->pred->tag == integer_exp) {
+        SIfExp *branches = ast->content.ifExp;
+        AST *taken = branches->pred->content.integerExp != 0
+                         ? branches->case_true
+                         : branches->case_false;
+        free_ast(branches->pred);
+        free_ast(taken == branches->case_true ? branches->case_false
+                                              : branches->case_true);
+        // Branches have no variables in their own symbol tables
+        replace_node(ast, taken);
+        free(branches);
+      }
+      break;
+    default:
+      break;
+  }
+}
@@ -0,0 +1,7 @@
+#include "ast.h"
+#ifndef FOLD_H
+#define FOLD_H
+
+void fold_constants(AST *ast);
+
+#endif
@@ -0,0 +1,252 @@
+#include "gc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "closure.h"
+
+/**
+ * Copying garbage collector for the arena.
+ *
+ * Roots are the slots of every generated frame on the gc_frames chain, plus
+ * locals registered by the runtime with gc_push_root. Live objects are copied
+ * into fresh chunks, Cheney-style, and the old chunks are freed.
+ *
+ * Every word of every root and object is a value: either a tagged integer, or
+ * a pointer that refers to an object if it is in one of the old chunks.
+ * Closures' other words (code pointer and variable counts) never point into
+ * the heap, so don't need to be distinguished.
+ */
+
+long *gc_frames = NULL;
+void (*gc_survivor_hook)(long header) = NULL;
+
+static long *roots[GC_MAX_ROOTS];
+static int n_roots = 0;
+
+static long heap_limit = 0;  // 0 until read from environment
+static long threshold = GC_MIN_HEAP;
+static long n_collections = 0;
+static long live_bytes = 0;
+static long bytes_copied = 0;
+
+// Chunks being collected
+static ArenaChunk **from_chunks;
+static int n_from_chunks;
+
+// Chunks copied into, oldest first, so they can be scanned in order
+static ArenaChunk **to_chunks;
+static int n_to_chunks;
+static int max_to_chunks;
+
+static long read_heap_limit(void) {
+  char *env = getenv("LFL_HEAP_LIMIT");
+  if (env == NULL) {
+    return GC_DEFAULT_HEAP_LIMIT;
+  }
+  char *suffix;
+  long limit = strtol(env, &suffix, 10);
+  switch (*suffix) {
+    case 'g':
+    case 'G':
+      limit <<= 10;
+      // Intentional fall-through
+    case 'm':
+    case 'M':
+      limit <<= 10;
+      // Intentional fall-through
+    case 'k':
+    case 'K':
+      limit <<= 10;
+      break;
+  }
+  return limit;
+}
+
+static long get_heap_size(void) {
+  ArenaStats stats;
+  arena_get_stats(&stats);
+  return stats.bytes_reserved;
+}
+
+/**
+ * Called by the arena when its current chunk is full. Collects if reserving
+ * another n_bytes would take the heap past the collection threshold.
+ */
+void gc_maybe_collect(long n_bytes) {
+  if (heap_limit == 0) {
+    gc_set_heap_limit(read_heap_limit());
+    if (getenv("LFL_GC_STATS") != NULL) {
+      atexit(gc_print_stats);
+    }
+  }
+  if (arena_chunks != NULL && get_heap_size() + n_bytes > threshold) {
+    gc_collect();
+  }
+}
+
+/**
+ * Called by the arena before it reserves n_bytes more for a new chunk.
+ * Exits if that would exceed the heap limit.
+ */
+void gc_reserve(long n_bytes) {
+  if (get_heap_size() + n_bytes > heap_limit) {
+    fprintf(stderr, "ERROR! Heap limit of %ld bytes exceeded.\n", heap_limit);
+    exit(1);
+  }
+}
+
+void gc_set_heap_limit(long n_bytes) {
+  heap_limit = n_bytes;
+  if (threshold > heap_limit) {
+    threshold = heap_limit;
+  }
+}
+
+void gc_push_root(long *root) {
+  if (n_roots == GC_MAX_ROOTS) {
+    fprintf(stderr, "ERROR! Too many garbage collector roots.\n");
+    exit(1);
+  }
+  roots[n_roots++] = root;
+}
+
+void gc_pop_roots(int n) { n_roots -= n; }
+
+/**
+ * Returns:
+ *   1 if val refers to an object in the chunks being collected
+ */
+static int is_from_object(long val) {
+  if (IS_INT(val)) {
+    return 0;
+  }
+  for (int i_chunk = 0; i_chunk < n_from_chunks; ++i_chunk) {
+    ArenaChunk *chunk = from_chunks[i_chunk];
+    if ((char *)val > chunk->start && (char *)val <= chunk->top) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void *to_alloc(long n_bytes) {
+  if (ARENA_HEADER_SIZE + n_bytes > arena_limit - arena_top) {
+    long chunk_size = ARENA_HEADER_SIZE + n_bytes > ARENA_CHUNK_SIZE
+                          ? ARENA_HEADER_SIZE + n_bytes
+                          : ARENA_CHUNK_SIZE;
+    ArenaChunk *chunk = arena_make_chunk(chunk_size);
+    arena_push_chunk(chunk);
+    if (n_to_chunks == max_to_chunks) {
+      max_to_chunks = max_to_chunks ? 2 * max_to_chunks : 16;
+      to_chunks = realloc(to_chunks, max_to_chunks * sizeof(*to_chunks));
+    }
+    to_chunks[n_to_chunks++] = chunk;
+  }
+  return arena_alloc(n_bytes);
+}
+
+/**
+ * If *ref is an object being collected, copies it (once) and updates *ref to
+ * the copy.
+ */
+static void forward(long *ref) {
+  if (!is_from_object(*ref)) {
+    return;
+  }
+  long *obj = (long *)*ref;
+  long header = obj[-1];
+  if (header & 1) {
+    // Already copied, and header replaced by address of copy
+    *ref = header & ~1L;
+    return;
+  }
+  long size = ARENA_SIZE(header);
+  long *copy = to_alloc(size);
+  memcpy(copy, obj, size);
+  copy[-1] = header;  // Keeping the allocation site
+  bytes_copied += ARENA_HEADER_SIZE + size;
+  if (gc_survivor_hook != NULL) {
+    gc_survivor_hook(header);
+  }
+  obj[-1] = (long)copy | 1;
+  *ref = (long)copy;
+}
+
+void gc_collect(void) {
+  // Detach the current chunks from the arena; they become from-space
+  arena_chunks->top = arena_top;
+  n_from_chunks = 0;
+  for (ArenaChunk *chunk = arena_chunks; chunk != NULL; chunk = chunk->next) {
+    ++n_from_chunks;
+  }
+  from_chunks = malloc(n_from_chunks * sizeof(*from_chunks));
+  int i_chunk = 0;
+  for (ArenaChunk *chunk = arena_chunks; chunk != NULL; chunk = chunk->next) {
+    from_chunks[i_chunk++] = chunk;
+  }
+  arena_chunks = NULL;
+  arena_top = NULL;
+  arena_limit = NULL;
+  n_to_chunks = 0;
+  long copied_before = bytes_copied;
+  // Copy objects directly reachable from roots
+  for (long *frame = gc_frames; frame != NULL; frame = (long *)frame[-1]) {
+    long n_slots = frame[-2];
+    long *slots = frame - 2 - n_slots;
+    for (long i_slot = 0; i_slot < n_slots; ++i_slot) {
+      forward(&slots[i_slot]);
+    }
+  }
+  for (int i_root = 0; i_root < n_roots; ++i_root) {
+    forward(roots[i_root]);
+  }
+  // Scan copies, copying what they refer to, until caught up
+  for (int i_to = 0; i_to < n_to_chunks; ++i_to) {
+    ArenaChunk *chunk = to_chunks[i_to];
+    char *p = chunk->start;
+    while (p < (chunk == arena_chunks ? arena_top : chunk->top)) {
+      long size = ARENA_SIZE(*(long *)p);
+      long *obj = (long *)(p + ARENA_HEADER_SIZE);
+      for (long i_word = 0; i_word < size / 8; ++i_word) {
+        forward(&obj[i_word]);
+      }
+      p += ARENA_HEADER_SIZE + size;
+    }
+  }
+  for (i_chunk = 0; i_chunk < n_from_chunks; ++i_chunk) {
+    free(from_chunks[i_chunk]);
+  }
+  free(from_chunks);
+  n_from_chunks = 0;
+  if (gc_survivor_hook != NULL) {
+    gc_survivor_hook(0);
+  }
+  ++n_collections;
+  live_bytes = bytes_copied - copied_before;
+  threshold = 2 * live_bytes > GC_MIN_HEAP ? 2 * live_bytes : GC_MIN_HEAP;
+  if (threshold > heap_limit) {
+    threshold = heap_limit;
+  }
+}
+
+void gc_get_stats(GCStats *stats) {
+  stats->n_collections = n_collections;
+  stats->heap_size = get_heap_size();
+  stats->live_bytes = live_bytes;
+  stats->bytes_copied = bytes_copied;
+  stats->heap_limit = heap_limit;
+}
+
+/**
+ * Registered with atexit when the LFL_GC_STATS environment variable is set.
+ */
+void gc_print_stats(void) {
+  GCStats stats;
+  gc_get_stats(&stats);
+  fprintf(stderr,
+          "gc: %ld collections, %ld bytes heap, %ld bytes live after last "
+          "collection, %ld bytes copied in total, %ld bytes limit\n",
+          stats.n_collections, stats.heap_size, stats.live_bytes,
+          stats.bytes_copied, stats.heap_limit);
+}
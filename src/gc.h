@@ -0,0 +1,51 @@
+#ifndef GC_H
+#define GC_H
+
+// Cap on the heap, overridden by the LFL_HEAP_LIMIT environment variable
+// (bytes, with optional k/m/g suffix) or gc_set_heap_limit.
+#define GC_DEFAULT_HEAP_LIMIT (256L << 20)
+// Heap size below which no collection is attempted.
+#ifndef GC_MIN_HEAP
+#define GC_MIN_HEAP (4L << 20)
+#endif
+#define GC_MAX_ROOTS 64
+
+// Frame layout of generated functions, relative to rbp:
+//   [rbp-8]   rbp of the previous generated frame, or 0
+//   [rbp-16]  number of slots
+//   [rbp-24]  first slot, then downwards
+// Every slot is scanned as a root, so they are cleared on entry.
+#define GC_FRAME_HEADER_SIZE 16
+
+typedef struct GCStats {
+  long n_collections;
+  long heap_size;     // Bytes currently reserved for the heap
+  long live_bytes;    // Bytes that survived the last collection
+  long bytes_copied;  // Total over all collections
+  long heap_limit;
+} GCStats;
+
+// rbp of the innermost generated frame. Maintained by generated code.
+extern long *gc_frames;
+
+// Called with the header of each object copied by a collection, and then with
+// 0 when the collection is done, if set.
+extern void (*gc_survivor_hook)(long header);
+
+void gc_maybe_collect(long n_bytes);
+
+void gc_reserve(long n_bytes);
+
+void gc_collect(void);
+
+void gc_push_root(long *root);
+
+void gc_pop_roots(int n);
+
+void gc_set_heap_limit(long n_bytes);
+
+void gc_get_stats(GCStats *stats);
+
+void gc_print_stats(void);
+
+#endif
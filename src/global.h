@@ -2,4 +2,6 @@
 #define TOKENISE_ERROR 2
 #define PARSE_ERROR 3
 #define SCOPE_ERROR 4
-#define IO_ERROR 5
\ No newline at end of file
+#define IO_ERROR 5
+#define ASSEMBLE_ERROR 6
+#define LOAD_ERROR 7
\ No newline at end of file
@@ -0,0 +1,101 @@
+#include "heap_profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "arena.h"
+#include "gc.h"
+
+/**
+ * Allocation-site heap profiler for programs compiled with --heap-profile.
+ *
+ * Such programs allocate through heap_profile_alloc, which records the site
+ * in the high bits of the object's header. The garbage collector passes the
+ * header of every object that survives a collection to a hook, from which
+ * each site's live bytes are counted.
+ *
+ * The report is tab-separated, with a header row, and goes to the file named
+ * by the LFL_HEAP_PROFILE environment variable, or stderr.
+ */
+
+static HeapSite runtime_site = {.name = "(runtime)", .line = -1, .column = -1};
+
+// Indexed by site number. Site 0 is the runtime's own.
+static HeapSite **heap_sites = NULL;
+static long n_heap_sites = 0;
+
+static void count_survivor(long header) {
+  if (header != 0) {
+    long nth_site = ARENA_SITE(header);
+    if (nth_site < n_heap_sites) {
+      heap_sites[nth_site]->surviving_bytes +=
+          ARENA_HEADER_SIZE + ARENA_SIZE(header);
+    }
+    return;
+  }
+  // Collection over
+  for (long i_site = 0; i_site < n_heap_sites; ++i_site) {
+    HeapSite *site = heap_sites[i_site];
+    site->live_bytes = site->surviving_bytes;
+    if (site->live_bytes > site->peak_live_bytes) {
+      site->peak_live_bytes = site->live_bytes;
+    }
+    site->surviving_bytes = 0;
+  }
+}
+
+/**
+ * Called by main of a heap-profiled program.
+ * Params:
+ *   sites: Sites of generated code, from 1, NULL-terminated
+ */
+void heap_profile_start(HeapSite **sites) {
+  n_heap_sites = 1;
+  while (sites[n_heap_sites - 1] != NULL) {
+    ++n_heap_sites;
+  }
+  heap_sites = malloc(n_heap_sites * sizeof(*heap_sites));
+  heap_sites[HEAP_SITE_RUNTIME] = &runtime_site;
+  for (long i_site = 1; i_site < n_heap_sites; ++i_site) {
+    heap_sites[i_site] = sites[i_site - 1];
+  }
+  gc_survivor_hook = count_survivor;
+  atexit(heap_profile_print_report);
+}
+
+/**
+ * Allocates like arena_alloc, counting the allocation against a site.
+ */
+void *heap_profile_alloc(long n_bytes, long nth_site) {
+  long *obj = arena_alloc(n_bytes);
+  if (nth_site < n_heap_sites) {
+    HeapSite *site = heap_sites[nth_site];
+    ++site->n_allocs;
+    site->bytes += ARENA_HEADER_SIZE + ARENA_SIZE(obj[-1]);
+  }
+  obj[-1] |= nth_site << ARENA_SITE_SHIFT;
+  return obj;
+}
+
+/**
+ * Registered with atexit by heap_profile_start.
+ */
+void heap_profile_print_report(void) {
+  char *path = getenv("LFL_HEAP_PROFILE");
+  FILE *fp = path == NULL ? stderr : fopen(path, "w");
+  if (fp == NULL) {
+    perror("ERROR! Could not open heap profile");
+    return;
+  }
+  fprintf(fp,
+          "site\tfunction\tline\tcolumn\tallocs\tbytes\tlive_bytes\t"
+          "peak_live_bytes\n");
+  for (long i_site = 0; i_site < n_heap_sites; ++i_site) {
+    HeapSite *site = heap_sites[i_site];
+    // Positions 1-indexed, as editors show them, or 0 if unknown
+    fprintf(fp, "%ld\t%s\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\n", i_site,
+            site->name, site->line + 1, site->column + 1, site->n_allocs,
+            site->bytes, site->live_bytes, site->peak_live_bytes);
+  }
+  if (fp != stderr) {
+    fclose(fp);
+  }
+}
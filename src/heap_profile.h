@@ -0,0 +1,27 @@
+#ifndef HEAP_PROFILE_H
+#define HEAP_PROFILE_H
+
+// Site of allocations made by the runtime itself rather than generated code.
+#define HEAP_SITE_RUNTIME 0
+
+// Allocation counts for one site, laid out by programs compiled with
+// --heap-profile. Live bytes are only known when the garbage collector runs,
+// so are as of collections.
+typedef struct HeapSite {
+  char *name;  // Function whose closures are allocated here
+  long line;   // Source position, 0-indexed, or -1 if unknown
+  long column;
+  long n_allocs;
+  long bytes;            // Total, including headers
+  long live_bytes;       // Reachable at the last collection
+  long peak_live_bytes;  // Most reachable at any collection
+  long surviving_bytes;  // Counted during a collection
+} HeapSite;
+
+void heap_profile_start(HeapSite **sites);
+
+void *heap_profile_alloc(long n_bytes, long nth_site);
+
+void heap_profile_print_report(void);
+
+#endif
@@ -0,0 +1,154 @@
+#include "inline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ast.h"
+#include "scope.h"
+
+/**
+ * Inliner, between make_scopes and fold_constants.
+ *
+ * A call of a small, non-recursive lambda bound by a let or def is replaced
+ * by the lambda's body, with the operands bound to its args by lets:
+ *   (f a b) with f = (lambda x y body) becomes (let y' b (let x' a body'))
+ * where body' is a copy of body using the fresh names x' and y'. Operands
+ * are bound last first, the order that calls evaluate them in. fold_constants
+ * then propagates constant operands, and shake_tree drops the definition if
+ * no calls are left.
+ */
+
+static int n_renamed = 0;
+
+static int count_nodes(AST *ast) {
+  int n_nodes = 1;
+  for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+    n_nodes += count_nodes(get_child(ast, i_exp));
+  }
+  return n_nodes;
+}
+
+static int is_within(AST *ast, AST *root) {
+  for (; ast != NULL; ast = ast->parent) {
+    if (ast == root) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Returns:
+ *   1 if every variable in ast, which is in lambda, that isn't defined within
+ *   lambda refers to the same definition at call as it does in lambda, so
+ *   that nothing the body refers to is captured by a definition in between
+ */
+static int is_scope_safe(AST *ast, AST *lambda, AST *call) {
+  if (ast->tag == var_exp) {
+    char *name = ast->content.varExp->name;
+    AST *definer = find_definer(ast, name);
+    if (definer == NULL ||
+        (!is_within(definer, lambda) && definer != find_definer(call, name))) {
+      return 0;
+    }
+  }
+  for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+    if (!is_scope_safe(get_child(ast, i_exp), lambda, call)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Returns:
+ *   The lambda that call's operator is bound to, if call can be inlined, else
+ *   NULL
+ */
+static AST *get_inlinable_lambda(AST *call) {
+  AST *first = call->content.listExp->first;
+  if (first->tag != var_exp) {
+    return NULL;
+  }
+  AST *let = find_let(first);
+  if (let == NULL || let->content.letExp->is_recursive) {
+    return NULL;
+  }
+  AST *lambda = let->content.letExp->defn;
+  if (lambda->tag != lambda_exp || lambda->content.lambdaExp->is_memo ||
+      lambda->content.lambdaExp->args->list->len !=
+          call->content.listExp->rest->len ||
+      count_nodes(lambda->content.lambdaExp->body) > INLINE_MAX_SIZE ||
+      !is_scope_safe(lambda->content.lambdaExp->body, lambda, call)) {
+    return NULL;
+  }
+  return lambda;
+}
+
+/**
+ * Gives the variables in copy that refer to lambda's args the fresh names,
+ * where original is the part of lambda's body that copy is a copy of.
+ */
+static void rename_args(AST *copy, AST *original, AST *lambda, char **fresh) {
+  if (original->tag == var_exp) {
+    Map *args = lambda->content.lambdaExp->args;
+    char *name = original->content.varExp->name;
+    if (find_definer(original, name) == lambda->content.lambdaExp->body) {
+      for (int i_arg = 0; i_arg < args->list->len; ++i_arg) {
+        if (strcmp(get_key_i(args, i_arg), name) == 0) {
+          free(copy->content.varExp->name);
+          copy->content.varExp->name = malloc(strlen(fresh[i_arg]) + 1);
+          strcpy(copy->content.varExp->name, fresh[i_arg]);
+        }
+      }
+    }
+  }
+  for (int i_exp = 0; i_exp < get_n_children(original); ++i_exp) {
+    rename_args(get_child(copy, i_exp), get_child(original, i_exp), lambda,
+                fresh);
+  }
+}
+
+static void inline_call(AST *call, AST *lambda) {
+  Map *args = lambda->content.lambdaExp->args;
+  int n_args = args->list->len;
+  char **fresh = malloc(n_args * sizeof(*fresh));
+  for (int i_arg = 0; i_arg < n_args; ++i_arg) {
+    // Symbols can't contain ';', so these can't clash with the program's
+    char *name = get_key_i(args, i_arg);
+    fresh[i_arg] = malloc(strlen(name) + 16);
+    sprintf(fresh[i_arg], "%s;%d", name, n_renamed++);
+  }
+  AST *body = copy_ast(lambda->content.lambdaExp->body);
+  rename_args(body, lambda->content.lambdaExp->body, lambda, fresh);
+  AST *result = body;
+  SListExp *list = call->content.listExp;
+  for (int i_arg = 0; i_arg < n_args; ++i_arg) {
+    AST *operand = get_i(list->rest, i_arg);
+    AST *let = make_letExp(fresh[i_arg], operand, result, 0);
+    operand->parent = let;
+    result->parent = let;
+    result = let;
+  }
+  make_scopes(result);
+  free_ast(list->first);
+  free_list(list->rest);
+  free(list);
+  free(fresh);
+  replace_node(call, result);
+}
+
+/**
+ * Inlines the calls in ast. Definitions are inlined into before the bodies
+ * that use them, so inlined bodies are already inlined into.
+ */
+void inline_calls(AST *ast) {
+  for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+    inline_calls(get_child(ast, i_exp));
+  }
+  if (ast->tag == list_exp) {
+    AST *lambda = get_inlinable_lambda(ast);
+    if (lambda != NULL) {
+      inline_call(ast, lambda);
+    }
+  }
+}
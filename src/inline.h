@@ -0,0 +1,10 @@
+#include "ast.h"
+#ifndef INLINE_H
+#define INLINE_H
+
+// Largest lambda body, in AST nodes, that calls are replaced with
+#define INLINE_MAX_SIZE 16
+
+void inline_calls(AST *ast);
+
+#endif
@@ -0,0 +1,593 @@
+#include "ir.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ast.h"
+#include "closure.h"
+#include "escape.h"
+#include "eval.h"
+#include "gc.h"
+#include "known.h"
+#include "options.h"
+#include "regalloc.h"
+#include "scope.h"
+#include "tail.h"
+
+/**
+ * Lowering of lifted functions to a linear, three-address intermediate
+ * representation, which eval turns into assembly.
+ *
+ * Each expression is lowered to instructions that leave its value in the
+ * accumulator. Values needed later, the args, let-bound variables and the
+ * operands of calls, are then moved to their own temporary location: the
+ * register allocated to them, or else a frame slot. Slots count up from the
+ * frame header, after the args, and are free again once their value is dead:
+ * after the call it's an operand of, or the let that binds it. So the
+ * branches of an if, and operands evaluated one after another, share slots.
+ * Closures made in the frame keep theirs for as long as they are the value.
+ */
+
+/**
+ * Returns:
+ *   Newly allocated string, formatted as by printf
+ */
+static char *format(char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  char *str = malloc(len + 1);
+  va_start(args, fmt);
+  vsnprintf(str, len + 1, fmt, args);
+  va_end(args);
+  return str;
+}
+
+/**
+ * Returns:
+ *   Where a value is kept: the register allocated to it, or else its slot
+ */
+static int get_location(int reg, int offset) {
+  return reg >= 0 ? REG_LOCATION(reg) : offset;
+}
+
+/**
+ * Returns:
+ *   Where a value needed later is kept: the register allocated to it, or else
+ *   the slot after *offset, which *offset is then moved to
+ */
+static int add_temporary(int reg, int *offset) {
+  if (reg >= 0) {
+    return REG_LOCATION(reg);
+  }
+  *offset += 8;
+  return *offset;
+}
+
+static IROperand location_operand(int loc) {
+  IROperand operand = {ir_location, loc, NULL};
+  return operand;
+}
+
+static IROperand symbol_operand(char *symbol) {
+  IROperand operand = {ir_symbol, 0, symbol};
+  return operand;
+}
+
+static int lower(IRFn *ir, AST *ast, int offset);
+
+static int new_label(IRFn *ir) { return ir->n_labels++; }
+
+/**
+ * Ends the current block, if any, and starts adding to a new one.
+ */
+static void start_block(IRFn *ir, int label) {
+  if (ir->n_blocks == ir->max_blocks) {
+    ir->max_blocks = ir->max_blocks ? 2 * ir->max_blocks : 16;
+    ir->blocks = realloc(ir->blocks, ir->max_blocks * sizeof(*ir->blocks));
+  }
+  IRBlock *block = calloc(1, sizeof(*block));
+  block->label = label;
+  ir->blocks[ir->n_blocks++] = block;
+}
+
+/**
+ * Appends an instruction to the current block, with n_srcs operands, all
+ * ir_none.
+ * Returns:
+ *   The instruction, valid until the next is added
+ */
+static IRInstr *add_instr(IRFn *ir, IROp op, int dst, int n_srcs) {
+  IRBlock *block = ir->blocks[ir->n_blocks - 1];
+  if (block->n_instrs == block->max_instrs) {
+    block->max_instrs = block->max_instrs ? 2 * block->max_instrs : 16;
+    block->instrs =
+        realloc(block->instrs, block->max_instrs * sizeof(*block->instrs));
+  }
+  IRInstr *instr = &block->instrs[block->n_instrs++];
+  memset(instr, 0, sizeof(*instr));
+  instr->op = op;
+  instr->dst = dst;
+  instr->n_srcs = n_srcs;
+  instr->srcs = calloc(n_srcs > 0 ? n_srcs : 1, sizeof(*instr->srcs));
+  instr->nth = -1;
+  return instr;
+}
+
+static void add_move(IRFn *ir, int dst, IROperand src, char *comment) {
+  IRInstr *instr = add_instr(ir, ir_move, dst, 1);
+  instr->srcs[0] = src;
+  instr->comment = comment;
+}
+
+static void add_profile_start(IRFn *ir, int offset) {
+  add_instr(ir, ir_profile_start, IR_ACC, 0)->value = offset;
+}
+
+static void add_profile_end(IRFn *ir, int nth, int offset) {
+  IRInstr *instr = add_instr(ir, ir_profile_end, IR_ACC, 0);
+  instr->value = offset;
+  instr->nth = nth;
+}
+
+/**
+ * Returns:
+ *   Where var's value is, or the symbol of a standard library function's
+ *   closure
+ */
+static IROperand get_var_operand(AST *var) {
+  char *name = var->content.varExp->name;
+  if (find_scope(var, name) == NULL) {
+    printf("ERROR! Undefined symbol: %s.\n", name);
+  }
+  int *loc = get_in_scope(var, name);
+  if (loc == NULL) {
+    return symbol_operand(format(STANDARD_CLOSURE_PREFIX "%s", name));
+  }
+  return location_operand(*loc);
+}
+
+/**
+ * Lowers a call, whose operands are at srcs[1..], into ir. Slots from offset
+ * on are free.
+ */
+static void lower_call(IRFn *ir, AST *ast, IROperand *srcs, int offset) {
+  int n_operands = ast->content.listExp->rest->len;
+  AST *first = ast->content.listExp->first;
+  // The slot reserved for the call's result is unused, so holds the time of
+  // the call when profiling
+  int is_tail = ast->content.listExp->is_tail;
+  char *primitive = get_primitive(ast);
+  int nth_profile = -1;
+  if (options.profile && !is_tail && primitive == NULL) {
+    nth_profile = add_profiled_node(ast);
+  }
+  if (options.profile && is_tail) {
+    // The caller's call ends here, as its frame is reused or removed. Its
+    // entry time is after the args and own closure.
+    add_profile_end(ir, ir->nth_profile,
+                    GC_FRAME_HEADER_SIZE +
+                        (ir->fn->content.lambdaExp->args->list->len + 2) * 8);
+  }
+  IRInstr *instr;
+  if (primitive != NULL) {
+    instr = add_instr(ir, ir_primitive, IR_ACC, 2);
+    instr->name = primitive;
+    instr->srcs[0] = srcs[1];
+    instr->srcs[1] = srcs[2];
+    return;
+  }
+  IROp op = is_tail ? ir_tail_call : ir_call;
+  if (first->tag == var_exp && first->content.varExp->is_recursive) {
+    // Its free variables are passed on by passing on its own closure
+    char *name = first->content.varExp->name;
+    srcs[0] = location_operand(*(int *)get_in_scope(first, name));
+    if (is_tail) {
+      instr = add_instr(ir, ir_self_tail_call, IR_ACC, n_operands + 1);
+      instr->target = ir->blocks[0]->label;
+    } else {
+      if (nth_profile >= 0) {
+        add_profile_start(ir, offset + 8);
+      }
+      instr = add_instr(ir, ir_call, IR_ACC, n_operands + 1);
+      instr->code = name;
+    }
+  } else {
+    // Unless known, first is function, so lower it then call
+    AST *known_fn = ast->content.listExp->known_fn;
+    if (is_operator_needed(ast)) {
+      offset = lower(ir, first, offset);
+      int loc = add_temporary(first->reg, &offset);
+      add_move(ir, loc, location_operand(IR_ACC), format("preparing closure"));
+      srcs[0] = location_operand(loc);
+    } else if (known_fn != NULL) {
+      srcs[0] = symbol_operand(
+          format("%s_closure", known_fn->content.makeClosureExp->name));
+    }
+    if (op == ir_call && nth_profile >= 0) {
+      add_profile_start(ir, offset + 8);
+    }
+    instr = add_instr(ir, op, IR_ACC, n_operands + 1);
+    instr->code = get_known_code(ast);
+  }
+  memcpy(instr->srcs, srcs, (n_operands + 1) * sizeof(*srcs));
+  if (instr->op != ir_call) {
+    start_block(ir, new_label(ir));
+  }
+  if (nth_profile >= 0) {
+    add_profile_end(ir, nth_profile, offset + 8);
+  }
+}
+
+/**
+ * Lowers ast into ir, leaving its value in the accumulator. Slots from offset
+ * on are free.
+ * Returns:
+ *   The end of the slots still in use once the value is computed, which is
+ *   offset unless the value is a closure made in the frame
+ */
+static int lower(IRFn *ir, AST *ast, int offset) {
+  switch (ast->tag) {
+    case if_exp: {
+      int false_label = new_label(ir);
+      int done_label = new_label(ir);
+      lower(ir, ast->content.ifExp->pred, offset);
+      IRInstr *branch = add_instr(ir, ir_branch, IR_ACC, 1);
+      branch->srcs[0] = location_operand(IR_ACC);
+      branch->target = false_label;
+      start_block(ir, new_label(ir));
+      // Only one branch is taken, so both have the same slots
+      int true_end = lower(ir, ast->content.ifExp->case_true, offset);
+      add_instr(ir, ir_jump, IR_ACC, 0)->target = done_label;
+      start_block(ir, false_label);
+      int false_end = lower(ir, ast->content.ifExp->case_false, offset);
+      start_block(ir, done_label);
+      offset = true_end > false_end ? true_end : false_end;
+      break;
+    }
+    case let_exp: {
+      int body_offset = lower(ir, ast->content.letExp->defn, offset);
+      int *arg_ptr = malloc(sizeof(*arg_ptr));
+      *arg_ptr = add_temporary(ast->content.letExp->reg, &body_offset);
+      map_insert_value(ast->content.letExp->body->symbol_table,
+                       ast->content.letExp->arg, arg_ptr);
+      add_move(ir, *arg_ptr, location_operand(IR_ACC),
+               format("let %s", ast->content.letExp->arg));
+      int body_end = lower(ir, ast->content.letExp->body, body_offset);
+      // The variable, and its closure if made in the frame, are dead now,
+      // unless they're under a closure that is the value
+      offset = body_end > body_offset ? body_end : offset;
+      break;
+    }
+    case list_exp: {  // Function call
+      // For example: (f 1 (add 2 3))
+      // For example: ((g 4) 1 (add 2 3))
+      // For example: (f x y)
+      int n_operands = ast->content.listExp->rest->len;
+      // +1 for the closure called, which stays ir_none if not needed
+      IROperand *srcs = calloc(n_operands + 1, sizeof(*srcs));
+      // Operands keep their slots until the call, after which they're dead
+      int operand_offset = offset;
+      for (int i_operand = n_operands - 1; i_operand >= 0; --i_operand) {
+        AST *child = (AST *)get_i(ast->content.listExp->rest, i_operand);
+        operand_offset = lower(ir, child, operand_offset);
+        int loc = add_temporary(child->reg, &operand_offset);
+        add_move(ir, loc, location_operand(IR_ACC),
+                 format("preparing operand %d/%d", i_operand + 1, n_operands));
+        srcs[i_operand + 1] = location_operand(loc);
+      }
+      lower_call(ir, ast, srcs, operand_offset);
+      free(srcs);
+      break;
+    }
+    case var_exp:
+      // For example: x
+      add_move(ir, IR_ACC, get_var_operand(ast),
+               format("access %s", ast->content.varExp->name));
+      break;
+    case integer_exp:
+      // For example: 1
+      add_instr(ir, ir_int, IR_ACC, 0)->value = ast->content.integerExp;
+      break;
+    case make_closure_exp: {
+      SMakeClosureExp *closure = ast->content.makeClosureExp;
+      if (closure->n_free_vars == 0) {
+        add_move(ir, IR_ACC,
+                 symbol_operand(format("%s_closure", closure->name)),
+                 format("static closure"));
+        break;
+      }
+      IRInstr *instr =
+          add_instr(ir, ir_make_closure, IR_ACC, closure->n_free_vars);
+      instr->name = closure->name;
+      instr->n_bound_vars = closure->n_bound_vars;
+      if (closure->is_on_stack) {
+        offset += get_closure_size(closure->n_free_vars);
+        instr->stack_offset = offset;
+      } else if (options.heap_profile) {
+        instr->nth = add_heap_site(ast);
+      }
+      // Free variables are plain variables
+      for (int i_free = 0; i_free < closure->n_free_vars; ++i_free) {
+        instr->srcs[i_free] =
+            get_var_operand(get_i(closure->free_vars, i_free));
+      }
+      break;
+    }
+    default:
+      printf("ERROR! Unexpected exp type in lower.\n");
+      JSONify_AST(ast);
+      break;
+  }
+  return offset;
+}
+
+/**
+ * Lowers a lifted lambda, or main if fn is the global node, after deciding
+ * which calls are tail calls, which closures are made in the frame, and which
+ * values are kept in registers.
+ */
+IRFn *lower_fn(AST *fn) {
+  IRFn *ir = calloc(1, sizeof(*ir));
+  ir->fn = fn;
+  ir->nth_profile = -1;
+  start_block(ir, new_label(ir));
+  if (fn->tag == global_exp) {
+    find_stack_closures(fn);
+    ir->used_regs = allocate_registers(fn);
+    lower(ir, fn->content.globalExp->main, GC_FRAME_HEADER_SIZE);
+    add_instr(ir, ir_return, IR_ACC, 1)->srcs[0] = location_operand(IR_ACC);
+    ir->memory_reqd = get_memory_reqd_by_fn(ir);
+    return ir;
+  }
+  SLambdaExp *lambda = fn->content.lambdaExp;
+  mark_tail_calls(fn);
+  find_stack_closures(fn);
+  ir->used_regs = allocate_registers(fn);
+  lambda->used_regs = ir->used_regs;
+  // eval's prologue leaves the args in their slots, and self tail calls
+  // replace them and jump to the entry block
+  int n_args = lambda->args->list->len;
+  int arg_offset = GC_FRAME_HEADER_SIZE;
+  for (int i_arg = 0; i_arg < n_args; ++i_arg) {
+    arg_offset += 8;  // Assumes all args are 8 bytes
+    int *i_arg_ptr = malloc(sizeof(*i_arg_ptr));
+    *i_arg_ptr = get_location(lambda->arg_regs[i_arg], arg_offset);
+    map_insert_value(lambda->body->symbol_table, get_key_i(lambda->args, i_arg),
+                     i_arg_ptr);
+    if (IS_REG_LOCATION(*i_arg_ptr)) {
+      // The slot keeps it too, for memo functions' lookups
+      add_move(ir, *i_arg_ptr, location_operand(arg_offset),
+               format("%s", (char *)get_key_i(lambda->args, i_arg)));
+    }
+  }
+  // The function's own closure is stored after its args, under the
+  // function's name, which is what recursive references use
+  arg_offset += 8;
+  int *closure_ptr = malloc(sizeof(*closure_ptr));
+  *closure_ptr = get_location(lambda->arg_regs[n_args], arg_offset);
+  map_insert_value(lambda->body->symbol_table, lambda->name, closure_ptr);
+  if (IS_REG_LOCATION(*closure_ptr)) {
+    add_move(ir, *closure_ptr, location_operand(arg_offset),
+             format("own closure"));
+  }
+  if (options.profile) {
+    ir->nth_profile = add_profiled_node(fn);
+    arg_offset += 8;  // For the entry time
+    add_profile_start(ir, arg_offset);
+  }
+  int memo_done_label = -1;
+  if (lambda->is_memo) {
+    memo_done_label = new_label(ir);
+    IRInstr *lookup = add_instr(ir, ir_memo_lookup, IR_ACC, 0);
+    lookup->name = lambda->name;
+    lookup->value = n_args;
+    lookup->target = memo_done_label;
+    start_block(ir, new_label(ir));
+  }
+  lower(ir, lambda->body, arg_offset);
+  if (lambda->is_memo) {
+    IRInstr *store = add_instr(ir, ir_memo_store, IR_ACC, 1);
+    store->name = lambda->name;
+    store->value = n_args;
+    store->srcs[0] = location_operand(IR_ACC);
+    start_block(ir, memo_done_label);
+  }
+  if (options.profile) {
+    add_profile_end(ir, ir->nth_profile, arg_offset);
+  }
+  add_instr(ir, ir_return, IR_ACC, 1)->srcs[0] = location_operand(IR_ACC);
+  ir->memory_reqd = get_memory_reqd_by_fn(ir);
+  return ir;
+}
+
+/**
+ * Frees what instr owns: its operands, their symbols, and its comment.
+ */
+void free_ir_instr(IRInstr *instr) {
+  for (int i_src = 0; i_src < instr->n_srcs; ++i_src) {
+    free(instr->srcs[i_src].symbol);
+  }
+  free(instr->srcs);
+  free(instr->comment);
+}
+
+void free_ir_fn(IRFn *ir) {
+  for (int i_block = 0; i_block < ir->n_blocks; ++i_block) {
+    IRBlock *block = ir->blocks[i_block];
+    for (int i_instr = 0; i_instr < block->n_instrs; ++i_instr) {
+      free_ir_instr(&block->instrs[i_instr]);
+    }
+    free(block->instrs);
+    free(block);
+  }
+  free(ir->blocks);
+  free(ir);
+}
+
+static void print_operand(IROperand operand) {
+  switch (operand.kind) {
+    case ir_none:
+      printf("-");
+      break;
+    case ir_symbol:
+      printf("%s", operand.symbol);
+      break;
+    case ir_location:
+      if (operand.loc == IR_ACC) {
+        printf("acc");
+      } else if (IS_REG_LOCATION(operand.loc)) {
+        printf("reg%d", REG_INDEX(operand.loc));
+      } else {
+        printf("[%d]", operand.loc);
+      }
+      break;
+  }
+}
+
+static void print_srcs(IRInstr *instr, int from) {
+  printf("(");
+  for (int i_src = from; i_src < instr->n_srcs; ++i_src) {
+    if (i_src > from) {
+      printf(", ");
+    }
+    print_operand(instr->srcs[i_src]);
+  }
+  printf(")");
+}
+
+/**
+ * Prints ir, for --ir. Slots are shown by their offset below rbp, as [24].
+ */
+void print_ir_fn(IRFn *ir) {
+  printf("%s:\n", ir->fn->tag == lambda_exp ? ir->fn->content.lambdaExp->name
+                                            : "main");
+  for (int i_block = 0; i_block < ir->n_blocks; ++i_block) {
+    IRBlock *block = ir->blocks[i_block];
+    printf("L%d:\n", block->label);
+    for (int i_instr = 0; i_instr < block->n_instrs; ++i_instr) {
+      IRInstr *instr = &block->instrs[i_instr];
+      IROperand dst = location_operand(instr->dst);
+      printf("\t");
+      switch (instr->op) {
+        case ir_int:
+          print_operand(dst);
+          printf(" = %ld", instr->value);
+          break;
+        case ir_move:
+          print_operand(dst);
+          printf(" = ");
+          print_operand(instr->srcs[0]);
+          break;
+        case ir_primitive:
+          print_operand(dst);
+          printf(" = %s", instr->name);
+          print_srcs(instr, 0);
+          break;
+        case ir_call:
+          print_operand(dst);
+          printf(" = ");
+          // Intentional fall-through
+        case ir_tail_call:
+          printf("%s %s ", instr->op == ir_call ? "call" : "tail call",
+                 instr->code != NULL ? instr->code : "*");
+          print_operand(instr->srcs[0]);
+          print_srcs(instr, 1);
+          break;
+        case ir_self_tail_call:
+          printf("self tail call ");
+          print_srcs(instr, 1);
+          printf(", goto L%d", instr->target);
+          break;
+        case ir_make_closure:
+          print_operand(dst);
+          printf(" = closure %s", instr->name);
+          print_srcs(instr, 0);
+          if (instr->stack_offset > 0) {
+            printf(" in [%d]", instr->stack_offset);
+          }
+          break;
+        case ir_branch:
+          printf("if not ");
+          print_operand(instr->srcs[0]);
+          printf(" goto L%d", instr->target);
+          break;
+        case ir_jump:
+          printf("goto L%d", instr->target);
+          break;
+        case ir_memo_lookup:
+          print_operand(dst);
+          printf(" = memo lookup %s, goto L%d if cached", instr->name,
+                 instr->target);
+          break;
+        case ir_memo_store:
+          printf("memo store %s ", instr->name);
+          print_operand(instr->srcs[0]);
+          break;
+        case ir_profile_start:
+          printf("profile start [%ld]", instr->value);
+          break;
+        case ir_profile_end:
+          printf("profile end %d [%ld]", instr->nth, instr->value);
+          break;
+        case ir_return:
+          printf("return ");
+          print_operand(instr->srcs[0]);
+          break;
+      }
+      if (instr->comment != NULL) {
+        printf("    ; %s", instr->comment);
+      }
+      printf("\n");
+    }
+  }
+}
+
+static int count_regs(int regs) {
+  int n_regs = 0;
+  for (int i_reg = 0; i_reg < N_ALLOC_REGISTERS; ++i_reg) {
+    n_regs += (regs >> i_reg) & 1;
+  }
+  return n_regs;
+}
+
+int get_closure_size(int n_free_vars) {
+  return sizeof(FirstClass) + n_free_vars * sizeof(long);
+}
+
+static int get_slot_end(int end, int loc) { return loc > end ? loc : end; }
+
+/**
+ * Returns:
+ *   Bytes of slots that ir's frame needs after its header: up to the highest
+ *   slot used, after the args, own closure and entry time that a function's
+ *   prologue stores, and then one for each register it saves. eval rounds the
+ *   frame up to keep the stack 16-byte aligned at calls.
+ */
+int get_memory_reqd_by_fn(IRFn *ir) {
+  int end = GC_FRAME_HEADER_SIZE;
+  int n_saved = 0;
+  if (ir->fn->tag == lambda_exp) {
+    end += 8 * (ir->fn->content.lambdaExp->args->list->len + 1) +
+           (options.profile ? 8 : 0);
+    n_saved = count_regs(ir->used_regs);
+  }
+  for (int i_block = 0; i_block < ir->n_blocks; ++i_block) {
+    IRBlock *block = ir->blocks[i_block];
+    for (int i_instr = 0; i_instr < block->n_instrs; ++i_instr) {
+      IRInstr *instr = &block->instrs[i_instr];
+      end = get_slot_end(end, instr->dst);
+      for (int i_src = 0; i_src < instr->n_srcs; ++i_src) {
+        if (instr->srcs[i_src].kind == ir_location) {
+          end = get_slot_end(end, instr->srcs[i_src].loc);
+        }
+      }
+      if (instr->op == ir_profile_start || instr->op == ir_profile_end) {
+        end = get_slot_end(end, instr->value);
+      }
+      end = get_slot_end(end, instr->stack_offset);
+    }
+  }
+  return end - GC_FRAME_HEADER_SIZE + 8 * n_saved;
+}
@@ -0,0 +1,86 @@
+#include "ast.h"
+#ifndef IR_H
+#define IR_H
+
+// The accumulator, rax, which holds the value of the expression just lowered.
+// Other locations are the frame slots and registers of regalloc.h, which
+// hold the function's args, let-bound values and operands.
+#define IR_ACC 0
+
+typedef struct IROperand {
+  enum {
+    ir_none,      // No value, such as the closure of a standard library call
+    ir_location,  // Value at loc
+    ir_symbol,    // Address of the label symbol
+  } kind;
+  int loc;
+  char *symbol;
+} IROperand;
+
+typedef enum IROp {
+  ir_int,             // dst = value, as a tagged integer
+  ir_move,            // dst = srcs[0]
+  ir_primitive,       // dst = name(srcs[0], srcs[1]), computed inline
+  ir_call,            // dst = call closure srcs[0] with args srcs[1..]
+  ir_tail_call,       // Return the result of calling srcs[0] with srcs[1..]
+  ir_self_tail_call,  // Make srcs[1..] the function's args and jump to target
+  ir_make_closure,    // dst = closure of function name, capturing srcs
+  ir_branch,          // Jump to target if srcs[0] is false
+  ir_jump,            // Jump to target
+  ir_memo_lookup,     // dst = result cached for the args, jumping to target
+                      // if there is one
+  ir_memo_store,      // Cache srcs[0] as the result for the args
+  ir_profile_start,   // Store the time in slot value
+  ir_profile_end,     // Add the time since slot value to profile record nth
+  ir_return,          // Return srcs[0]
+} IROp;
+
+typedef struct IRInstr {
+  IROp op;
+  int dst;  // Location defined, if the op defines one
+  int n_srcs;
+  IROperand *srcs;
+  char *name;  // Primitive, function of a closure, or memo function
+  char *code;  // Label of the code called, if known, else NULL
+  long value;  // Integer, slot, or number of memo args
+  int nth;     // Profile record, or allocation site, or -1
+  int n_bound_vars;
+  int stack_offset;  // End of a closure made in the frame, else 0
+  int target;        // Label of the block jumped to
+  char *comment;
+} IRInstr;
+
+// Straight-line code, entered only at its start. Jumps, tail calls and
+// returns end blocks, and a block not ended by one continues into the next.
+typedef struct IRBlock {
+  int label;
+  int n_instrs;
+  int max_instrs;
+  IRInstr *instrs;
+} IRBlock;
+
+// The code of a lifted function, or of main
+typedef struct IRFn {
+  AST *fn;  // The lambda, or the global node for main
+  int used_regs;
+  int memory_reqd;
+  int nth_profile;  // The lambda's profile record, or -1
+  int n_blocks;
+  int max_blocks;
+  IRBlock **blocks;  // In the order emitted, starting with the entry
+  int n_labels;
+} IRFn;
+
+IRFn *lower_fn(AST *fn);
+
+void free_ir_instr(IRInstr *instr);
+
+void free_ir_fn(IRFn *ir);
+
+void print_ir_fn(IRFn *ir);
+
+int get_memory_reqd_by_fn(IRFn *ir);
+
+int get_closure_size(int n_free_vars);
+
+#endif
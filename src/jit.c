@@ -0,0 +1,243 @@
+#include "jit.h"
+#include "arena.h"
+#include "closure.h"
+#include "eval.h"
+#include "gc.h"
+#include "heap_profile.h"
+#include "memo.h"
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * Loading of assembled code into memory of this process, linked with the
+ * runtime the compiler itself is built with, so that it can be run there
+ * rather than written out and linked by gcc.
+ *
+ * The code is placed near the runtime's variables, which it addresses relative
+ * to rip. Calls to functions further away, such as those of the C library, go
+ * through trampolines after the code.
+ */
+
+// The standard library, from standard.asm: the closures and the code of its
+// functions
+#define STANDARD_FUNCTION(name)                                      \
+  extern char standard_##name[] __asm__(STANDARD_CLOSURE_PREFIX #name); \
+  extern char standard_code_##name[] __asm__("_" #name);
+STANDARD_FUNCTION(plus)
+STANDARD_FUNCTION(minus)
+STANDARD_FUNCTION(equals)
+STANDARD_FUNCTION(times)
+STANDARD_FUNCTION(div)
+STANDARD_FUNCTION(mod)
+STANDARD_FUNCTION(less)
+STANDARD_FUNCTION(greater)
+extern char gc_call[];
+
+typedef struct RuntimeSymbol {
+  char *name;
+  void *address;
+} RuntimeSymbol;
+
+#define STANDARD_SYMBOLS(name)                      \
+  {STANDARD_CLOSURE_PREFIX #name, standard_##name}, \
+      {"_" #name, standard_code_##name}
+
+// Everything the emitted code declares extern
+static RuntimeSymbol runtime_symbols[] = {
+    {"printf", printf},
+    {"make_closure", make_closure},
+    {"call_closure", call_closure},
+    {"not_a_closure", not_a_closure},
+    {"division_by_zero", division_by_zero},
+    {"arena_top", &arena_top},
+    {"arena_limit", &arena_limit},
+    {"arena_refill", arena_refill},
+    {"gc_frames", &gc_frames},
+    {"gc_call", gc_call},
+    {"memo_lookup", memo_lookup},
+    {"memo_store", memo_store},
+    {"profile_start", profile_start},
+    {"heap_profile_start", heap_profile_start},
+    {"heap_profile_alloc", heap_profile_alloc},
+    STANDARD_SYMBOLS(plus),
+    STANDARD_SYMBOLS(minus),
+    STANDARD_SYMBOLS(equals),
+    STANDARD_SYMBOLS(times),
+    STANDARD_SYMBOLS(div),
+    STANDARD_SYMBOLS(mod),
+    STANDARD_SYMBOLS(less),
+    STANDARD_SYMBOLS(greater)};
+
+static int section_protections[N_SECTIONS] = {
+    PROT_READ | PROT_EXEC, PROT_READ | PROT_WRITE, PROT_READ};
+
+static void *find_runtime_symbol(char *name) {
+  int n_symbols = sizeof(runtime_symbols) / sizeof(runtime_symbols[0]);
+  for (int i_symbol = 0; i_symbol < n_symbols; ++i_symbol) {
+    if (strcmp(runtime_symbols[i_symbol].name, name) == 0) {
+      return runtime_symbols[i_symbol].address;
+    }
+  }
+  return NULL;
+}
+
+static long round_up(long n, long multiple) {
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+static long distance(char *a, char *b) { return a > b ? a - b : b - a; }
+
+/**
+ * Maps size bytes, readable and writable, within JIT_REACH of target, trying
+ * addresses on either side of it in turn, as the kernel takes them as hints.
+ * Returns:
+ *   The memory, or NULL if none could be mapped there
+ */
+static char *map_near(char *target, long size) {
+  long step = JIT_REACH / 4;
+  for (int i_try = 0; i_try < 6; ++i_try) {
+    long offset = (i_try / 2 + 1) * step;
+    if (i_try % 2 == 1 && (unsigned long)target < (unsigned long)offset) {
+      continue;
+    }
+    char *hint = i_try % 2 == 0 ? target + offset : target - offset;
+    char *memory = mmap(hint, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      continue;
+    }
+    if (distance(memory, target) < JIT_REACH &&
+        distance(memory + size, target) < JIT_REACH) {
+      return memory;
+    }
+    munmap(memory, size);
+  }
+  return NULL;
+}
+
+/**
+ * Fills in the fields of section, loaded at start, with the addresses of
+ * symbols. Calls out of reach of a symbol go to its trampoline instead.
+ * Returns:
+ *   0, or -1 if a symbol is out of reach and has no trampoline
+ */
+static int relocate(Object *object, SectionId i_section, char *start,
+                    char **addresses, char **trampolines) {
+  ObjectSection *section = &object->sections[i_section];
+  for (int i_reloc = 0; i_reloc < section->n_relocations; ++i_reloc) {
+    Relocation *reloc = &section->relocations[i_reloc];
+    char *field = start + reloc->offset;
+    long value = (long)(addresses[reloc->symbol] + reloc->addend);
+    if (reloc->type == reloc_abs64) {
+      memcpy(field, &value, sizeof(value));
+      continue;
+    }
+    if (reloc->type == reloc_pc32 || reloc->type == reloc_call32) {
+      value -= (long)field;
+    }
+    if (reloc->type == reloc_call32 && value != (int)value &&
+        trampolines[reloc->symbol] != NULL) {
+      value = trampolines[reloc->symbol] + reloc->addend - field;
+    }
+    if (value != (int)value) {
+      printf("ERROR! Symbol %s is out of reach of the loaded code\n",
+             object->symbols[reloc->symbol].name);
+      return -1;
+    }
+    int field_value = value;
+    memcpy(field, &field_value, sizeof(field_value));
+  }
+  return 0;
+}
+
+/**
+ * Loads object into executable memory, linked with the runtime. The memory is
+ * never unmapped, as the program is run until the compiler exits.
+ * Returns:
+ *   The object's main, or NULL if object couldn't be loaded
+ */
+JitMain load_object(Object *object) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  int i_main = get_symbol(object, "main");
+  int n_undefined = 0;
+  for (int i_symbol = 0; i_symbol < object->n_symbols; ++i_symbol) {
+    n_undefined += object->symbols[i_symbol].section < 0;
+  }
+  // Offsets of the sections in the memory, each starting a page so that it can
+  // be protected as its own, with the trampolines after the text
+  long starts[N_SECTIONS];
+  long trampolines_start = 0;
+  long size = 0;
+  for (int i_section = 0; i_section < N_SECTIONS; ++i_section) {
+    starts[i_section] = size;
+    size += object->sections[i_section].bytes->len;
+    if (i_section == section_text) {
+      size = trampolines_start = round_up(size, JIT_TRAMPOLINE_SIZE);
+      size += n_undefined * JIT_TRAMPOLINE_SIZE;
+    }
+    size = round_up(size, page_size);
+  }
+  char *memory = map_near((char *)&gc_frames, size);
+  if (memory == NULL) {
+    printf("ERROR! Could not map memory for the code near the runtime\n");
+    return NULL;
+  }
+  for (int i_section = 0; i_section < N_SECTIONS; ++i_section) {
+    Buffer *bytes = object->sections[i_section].bytes;
+    memcpy(memory + starts[i_section], bytes->text, bytes->len);
+  }
+
+  char **addresses = calloc(object->n_symbols, sizeof(*addresses));
+  char **trampolines = calloc(object->n_symbols, sizeof(*trampolines));
+  char *trampoline = memory + trampolines_start;
+  int result = 0;
+  for (int i_symbol = 0; i_symbol < object->n_symbols && result == 0;
+       ++i_symbol) {
+    ObjectSymbol *symbol = &object->symbols[i_symbol];
+    if (symbol->section >= 0) {
+      addresses[i_symbol] = memory + starts[symbol->section] + symbol->offset;
+      continue;
+    }
+    addresses[i_symbol] = find_runtime_symbol(symbol->name);
+    if (addresses[i_symbol] == NULL) {
+      printf("ERROR! Undefined symbol %s in the assembled code\n",
+             symbol->name);
+      result = -1;
+      continue;
+    }
+    static const unsigned char jmp_indirect[] = {0xFF, 0x25, 0, 0, 0, 0};
+    memcpy(trampoline, jmp_indirect, sizeof(jmp_indirect));
+    memcpy(trampoline + sizeof(jmp_indirect), &addresses[i_symbol],
+           sizeof(addresses[i_symbol]));
+    trampolines[i_symbol] = trampoline;
+    trampoline += JIT_TRAMPOLINE_SIZE;
+  }
+  for (int i_section = 0; i_section < N_SECTIONS && result == 0;
+       ++i_section) {
+    result = relocate(object, i_section, memory + starts[i_section],
+                      addresses, trampolines);
+  }
+  for (int i_section = 0; i_section < N_SECTIONS && result == 0;
+       ++i_section) {
+    long end = i_section + 1 < N_SECTIONS ? starts[i_section + 1] : size;
+    if (end > starts[i_section] &&
+        mprotect(memory + starts[i_section], end - starts[i_section],
+                 section_protections[i_section]) != 0) {
+      printf("ERROR! Could not protect the memory of the loaded code\n");
+      perror("Failed: ");
+      result = -1;
+    }
+  }
+  JitMain main_function = (JitMain)addresses[i_main];
+  free(addresses);
+  free(trampolines);
+  if (result != 0) {
+    munmap(memory, size);
+    return NULL;
+  }
+  return main_function;
+}
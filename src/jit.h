@@ -0,0 +1,17 @@
+#include "object.h"
+#ifndef JIT_H
+#define JIT_H
+
+// Distance from the runtime's variables the loaded code is placed within, at
+// most, so that it can address them relative to rip
+#define JIT_REACH (1L << 30)
+
+// Bytes of each trampoline: jmp [rip+0], then the address jumped to
+#define JIT_TRAMPOLINE_SIZE 16
+
+// The generated main, as loaded into this process
+typedef int (*JitMain)(void);
+
+JitMain load_object(Object *object);
+
+#endif
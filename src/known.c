@@ -0,0 +1,86 @@
+#include "known.h"
+#include <string.h>
+#include "ast.h"
+#include "scope.h"
+
+/**
+ * Known-call analysis. A call whose operator is a variable bound by a let or
+ * def to a lambda always calls that lambda's lifted function, and one whose
+ * operator is a standard library function always calls its code, so eval
+ * calls them directly instead of through the closure's code pointer.
+ */
+
+/**
+ * Sets known_fn of the calls in ast whose operator is bound to a lambda taking
+ * as many args as the call passes. Must be run after make_scopes and before
+ * lift_lambdas, which adds the args and the operands together, and before
+ * closure_convert, which replaces the lambdas with make_closure nodes that
+ * name their lifted functions.
+ */
+void find_known_calls(AST *ast) {
+  if (ast->tag == list_exp && ast->content.listExp->first->tag == var_exp) {
+    AST *let = find_let(ast->content.listExp->first);
+    if (let != NULL) {
+      AST *defn = let->content.letExp->defn;
+      if (defn->tag == lambda_exp && defn->content.lambdaExp->args->list->len ==
+                                         ast->content.listExp->rest->len) {
+        ast->content.listExp->known_fn = defn;
+      }
+    }
+  }
+  for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+    find_known_calls(get_child(ast, i_exp));
+  }
+}
+
+/**
+ * Returns:
+ *   Label of the code that call always calls, or NULL if it's unknown
+ */
+char *get_known_code(AST *call) {
+  if (call->content.listExp->known_fn != NULL) {
+    return call->content.listExp->known_fn->content.makeClosureExp->name;
+  }
+  AST *first = call->content.listExp->first;
+  if (first->tag != var_exp) {
+    return NULL;
+  }
+  char *name = first->content.varExp->name;
+  AST *scope = find_definer(first, name);
+  if (scope != NULL && scope->tag == global_exp &&
+      map_in(scope->content.globalExp->standard, name)) {
+    return map_get(scope->content.globalExp->standard, name);
+  }
+  return NULL;
+}
+
+/**
+ * Returns:
+ *   Name of the standard library function that call applies to two operands,
+ *   which eval computes inline instead of calling, or NULL
+ */
+char *get_primitive(AST *call) {
+  if (call->content.listExp->known_fn != NULL ||
+      call->content.listExp->rest->len != 2 || get_known_code(call) == NULL) {
+    return NULL;
+  }
+  return call->content.listExp->first->content.varExp->name;
+}
+
+/**
+ * Returns:
+ *   1 if calling call needs its operator's value, which is the closure passed
+ *   to the callee; 0 if the callee is the function being defined, whose own
+ *   closure is passed on, or the closure is static or unused
+ */
+int is_operator_needed(AST *call) {
+  AST *first = call->content.listExp->first;
+  if (first->tag == var_exp && first->content.varExp->is_recursive) {
+    return 0;
+  }
+  AST *known_fn = call->content.listExp->known_fn;
+  if (known_fn != NULL) {
+    return known_fn->content.makeClosureExp->n_free_vars > 0;
+  }
+  return get_known_code(call) == NULL;
+}
@@ -0,0 +1,13 @@
+#include "ast.h"
+#ifndef KNOWN_H
+#define KNOWN_H
+
+void find_known_calls(AST *ast);
+
+char *get_known_code(AST *call);
+
+int is_operator_needed(AST *call);
+
+char *get_primitive(AST *call);
+
+#endif
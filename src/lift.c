@@ -0,0 +1,142 @@
+#include "lift.h"
+#include <string.h>
+#include "ast.h"
+#include "eval.h"
+#include "scope.h"
+
+/**
+ * Lambda lifting, between find_known_calls and closure_convert.
+ *
+ * A lambda bound by a let or def that is only ever called, with as many
+ * operands as it takes args, needs no closure: its free variables are added
+ * to its args, and each call passes them too:
+ *   (f a) with f = (lambda x (plus x y)) becomes (f a y)
+ *   with f = (lambda x y (plus x y))
+ * The lambda then captures nothing, so gets a static closure, and its calls
+ * are known calls. Variables referring to lifted lambdas aren't free
+ * variables either, as known calls of static closures never read them.
+ * Calls are found known before lifting, as a free variable added to args
+ * no longer refers to the let that binds its lambda.
+ * Lambdas used as values are left to closure_convert.
+ */
+
+static int is_within(AST *ast, AST *root) {
+  for (; ast != NULL; ast = ast->parent) {
+    if (ast == root) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Returns:
+ *   1 if var refers to a lifted lambda
+ */
+int is_lifted_var(AST *var) {
+  AST *let = find_let(var);
+  return let != NULL && let->content.letExp->is_lifted;
+}
+
+/**
+ * Adds the variables in ast, which is in lambda, that are defined outside
+ * lambda to free_vars, with the nodes that define them. Standard library
+ * functions and lifted lambdas aren't added.
+ */
+static void find_free_vars(AST *ast, AST *lambda, Map *free_vars) {
+  if (ast->tag == var_exp) {
+    char *name = ast->content.varExp->name;
+    AST *definer = find_definer(ast, name);
+    if (definer != NULL && definer->tag != global_exp &&
+        !is_within(definer, lambda) && !is_lifted_var(ast) &&
+        !map_in(free_vars, name)) {
+      map_insert_value(free_vars, name, definer);
+    }
+  }
+  for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+    find_free_vars(get_child(ast, i_exp), lambda, free_vars);
+  }
+}
+
+/**
+ * Adds the calls in ast of let's lambda to calls.
+ * Returns:
+ *   1 if every reference in ast to let's variable is the operator of a call
+ *   that the lambda can be lifted at, else 0
+ */
+static int find_calls(AST *ast, AST *let, Map *free_vars, LL *calls) {
+  if (ast->tag == var_exp) {
+    char *name = ast->content.varExp->name;
+    AST *definer = find_definer(ast, name);
+    if (strcmp(name, let->content.letExp->arg) == 0 &&
+        (definer == let->content.letExp->body ||
+         definer == let->content.letExp->defn)) {
+      AST *call = ast->parent;
+      Map *args = let->content.letExp->defn->content.lambdaExp->args;
+      if (call->tag != list_exp || call->content.listExp->first != ast ||
+          call->content.listExp->rest->len != args->list->len) {
+        return 0;
+      }
+      // Each free variable must mean the same at the call
+      for (int i_var = 0; i_var < free_vars->list->len; ++i_var) {
+        char *var = get_key_i(free_vars, i_var);
+        if (find_definer(call, var) != map_get(free_vars, var)) {
+          return 0;
+        }
+      }
+      push_tail(calls, call);
+    }
+  }
+  for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+    if (!find_calls(get_child(ast, i_exp), let, free_vars, calls)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Lifts let's lambda if it can be.
+ */
+static void lift(AST *let) {
+  AST *lambda = let->content.letExp->defn;
+  if (lambda->tag != lambda_exp || lambda->content.lambdaExp->is_memo) {
+    return;
+  }
+  Map *args = lambda->content.lambdaExp->args;
+  Map *free_vars = make_map(str_eq);
+  find_free_vars(lambda->content.lambdaExp->body, lambda, free_vars);
+  int n_free_vars = free_vars->list->len;
+  LL *calls = make_list();
+  // Recursive calls are in the lambda, so are found in the whole let
+  if (args->list->len + n_free_vars <= N_ARG_REGISTERS &&
+      find_calls(let, let, free_vars, calls)) {
+    let->content.letExp->is_lifted = 1;
+    for (int i_var = 0; i_var < n_free_vars; ++i_var) {
+      char *var = get_key_i(free_vars, i_var);
+      map_insert_key(args, var);
+      map_insert_key(lambda->content.lambdaExp->body->symbol_table, var);
+      for (int i_call = 0; i_call < calls->len; ++i_call) {
+        AST *call = get_i(calls, i_call);
+        AST *operand = make_varExp(var);
+        operand->parent = call;
+        push_tail(call->content.listExp->rest, operand);
+      }
+    }
+  }
+  free_list(calls);
+}
+
+/**
+ * Lifts the lambdas of the lets in ast, outermost first, so that a lambda's
+ * calls of lambdas lifted before it pass their free variables, which then
+ * become its own.
+ */
+void lift_lambdas(AST *ast) {
+  if (ast->tag == let_exp) {
+    lift(ast);
+  }
+  for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+    lift_lambdas(get_child(ast, i_exp));
+  }
+}
@@ -0,0 +1,9 @@
+#include "ast.h"
+#ifndef LIFT_H
+#define LIFT_H
+
+void lift_lambdas(AST *ast);
+
+int is_lifted_var(AST *var);
+
+#endif
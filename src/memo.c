@@ -0,0 +1,102 @@
+#include "memo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "closure.h"
+
+/**
+ * Result caches of functions defined with memo or defmemo.
+ *
+ * Generated code looks up a memoised function's arguments on entry, and
+ * stores its result on return. Only calls whose arguments and result are all
+ * integers are cached, since heap objects move during garbage collection and
+ * the caches aren't roots.
+ */
+
+static MemoCache *memo_caches = NULL;
+
+static MemoCache *make_cache(long n_keys) {
+  if (memo_caches == NULL && getenv("LFL_MEMO_STATS") != NULL) {
+    atexit(memo_print_stats);
+  }
+  MemoCache *cache = malloc(sizeof(*cache));
+  long *entries = calloc(MEMO_CACHE_SIZE * (n_keys + 1), sizeof(*entries));
+  if (cache == NULL || entries == NULL) {
+    fprintf(stderr, "ERROR! Out of memory.\n");
+    exit(1);
+  }
+  cache->n_keys = n_keys;
+  cache->n_hits = 0;
+  cache->n_misses = 0;
+  cache->entries = entries;
+  cache->next = memo_caches;
+  memo_caches = cache;
+  return cache;
+}
+
+/**
+ * Returns:
+ *   Entry that keys belong in, or NULL if any key isn't an integer
+ */
+static long *find_entry(MemoCache *cache, long *keys) {
+  unsigned long hash = 0;
+  for (long i_key = 0; i_key < cache->n_keys; ++i_key) {
+    if (!IS_INT(keys[i_key])) {
+      return NULL;
+    }
+    hash = (hash ^ keys[i_key]) * 0x100000001b3UL;  // FNV-1a style
+  }
+  hash ^= hash >> 29;
+  return cache->entries + (hash % MEMO_CACHE_SIZE) * (cache->n_keys + 1);
+}
+
+/**
+ * Params:
+ *   cache: Function's cache, made on first use
+ * Returns:
+ *   Cached result of the call with args keys, or 0 if none
+ */
+long memo_lookup(MemoCache **cache, long *keys, long n_keys) {
+  if (*cache == NULL) {
+    *cache = make_cache(n_keys);
+  }
+  long *entry = find_entry(*cache, keys);
+  if (entry == NULL || entry[n_keys] == 0) {
+    ++(*cache)->n_misses;
+    return 0;
+  }
+  for (long i_key = 0; i_key < n_keys; ++i_key) {
+    if (entry[i_key] != keys[i_key]) {
+      ++(*cache)->n_misses;
+      return 0;
+    }
+  }
+  ++(*cache)->n_hits;
+  return entry[n_keys];
+}
+
+/**
+ * Caches val as the result of the call with args keys, if it's an integer.
+ * Returns:
+ *   val
+ */
+long memo_store(MemoCache **cache, long *keys, long n_keys, long val) {
+  long *entry = find_entry(*cache, keys);
+  if (entry == NULL || !IS_INT(val)) {
+    return val;
+  }
+  for (long i_key = 0; i_key < n_keys; ++i_key) {
+    entry[i_key] = keys[i_key];
+  }
+  entry[n_keys] = val;
+  return val;
+}
+
+/**
+ * Registered with atexit when the LFL_MEMO_STATS environment variable is set.
+ */
+void memo_print_stats(void) {
+  for (MemoCache *cache = memo_caches; cache != NULL; cache = cache->next) {
+    fprintf(stderr, "memo: %ld hits, %ld misses, %d entries\n", cache->n_hits,
+            cache->n_misses, MEMO_CACHE_SIZE);
+  }
+}
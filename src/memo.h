@@ -0,0 +1,24 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+// Entries in each memoised function's cache. A new result evicts whichever
+// entry its arguments hash to.
+#ifndef MEMO_CACHE_SIZE
+#define MEMO_CACHE_SIZE (1 << 12)
+#endif
+
+typedef struct MemoCache {
+  long n_keys;  // Arguments of the function, bound then free
+  long n_hits;
+  long n_misses;
+  long *entries;  // Each n_keys keys then the result; result 0 if empty
+  struct MemoCache *next;  // Cache of another function, for statistics
+} MemoCache;
+
+long memo_lookup(MemoCache **cache, long *keys, long n_keys);
+
+long memo_store(MemoCache **cache, long *keys, long n_keys, long val);
+
+void memo_print_stats(void);
+
+#endif
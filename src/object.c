@@ -0,0 +1,274 @@
+#include "object.h"
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Objects of assembled code, and writing them out as relocatable ELF64 object
+ * files, which link like the ones NASM makes from the emitted code.
+ */
+
+char *section_names[N_SECTIONS] = {".text", ".data", ".rodata"};
+
+static int section_flags[N_SECTIONS] = {SHF_ALLOC | SHF_EXECINSTR,
+                                        SHF_ALLOC | SHF_WRITE, SHF_ALLOC};
+
+static int elf_relocation_types[] = {R_X86_64_64, R_X86_64_32S,
+                                     R_X86_64_PC32, R_X86_64_PLT32};
+
+Object *make_object(void) {
+  Object *object = calloc(1, sizeof(*object));
+  for (int i_section = 0; i_section < N_SECTIONS; ++i_section) {
+    object->sections[i_section].bytes = make_buffer();
+    object->sections[i_section].alignment = 8;
+  }
+  object->sections[section_text].alignment = 16;
+  object->table_size = 2 * OBJECT_INITIAL_SYMBOLS;
+  object->table = malloc(object->table_size * sizeof(*object->table));
+  memset(object->table, -1, object->table_size * sizeof(*object->table));
+  return object;
+}
+
+void free_object(Object *object) {
+  for (int i_section = 0; i_section < N_SECTIONS; ++i_section) {
+    free_buffer(object->sections[i_section].bytes);
+    free(object->sections[i_section].relocations);
+  }
+  for (int i_symbol = 0; i_symbol < object->n_symbols; ++i_symbol) {
+    free(object->symbols[i_symbol].name);
+  }
+  free(object->symbols);
+  free(object->table);
+  free(object);
+}
+
+static unsigned long hash(char *name) {
+  unsigned long h = 5381;
+  for (char *c = name; *c != '\0'; ++c) {
+    h = h * 33 + *c;
+  }
+  return h;
+}
+
+/**
+ * Returns:
+ *   The slot of the table that holds name, or the empty one where it belongs
+ */
+static int find_slot(Object *object, char *name) {
+  int slot = hash(name) & (object->table_size - 1);
+  while (object->table[slot] >= 0 &&
+         strcmp(object->symbols[object->table[slot]].name, name) != 0) {
+    slot = (slot + 1) & (object->table_size - 1);
+  }
+  return slot;
+}
+
+static void grow_table(Object *object) {
+  free(object->table);
+  object->table_size *= 2;
+  object->table = malloc(object->table_size * sizeof(*object->table));
+  memset(object->table, -1, object->table_size * sizeof(*object->table));
+  for (int i_symbol = 0; i_symbol < object->n_symbols; ++i_symbol) {
+    object->table[find_slot(object, object->symbols[i_symbol].name)] =
+        i_symbol;
+  }
+}
+
+/**
+ * Returns:
+ *   The index of the symbol name, which is added, undefined, if new
+ */
+int get_symbol(Object *object, char *name) {
+  int slot = find_slot(object, name);
+  if (object->table[slot] >= 0) {
+    return object->table[slot];
+  }
+  if (object->n_symbols == object->max_symbols) {
+    object->max_symbols =
+        object->max_symbols == 0 ? OBJECT_INITIAL_SYMBOLS
+                                 : 2 * object->max_symbols;
+    object->symbols = realloc(object->symbols,
+                              object->max_symbols * sizeof(*object->symbols));
+  }
+  ObjectSymbol *symbol = &object->symbols[object->n_symbols];
+  symbol->name = strdup(name);
+  symbol->section = -1;
+  symbol->offset = 0;
+  symbol->is_global = 0;
+  object->table[slot] = object->n_symbols++;
+  if (2 * object->n_symbols > object->table_size) {
+    grow_table(object);
+  }
+  return object->n_symbols - 1;
+}
+
+void add_relocation(Object *object, SectionId section, long offset,
+                    int symbol, RelocationType type, long addend) {
+  ObjectSection *s = &object->sections[section];
+  if (s->n_relocations == s->max_relocations) {
+    s->max_relocations = s->max_relocations == 0 ? 64 : 2 * s->max_relocations;
+    s->relocations =
+        realloc(s->relocations, s->max_relocations * sizeof(*s->relocations));
+  }
+  s->relocations[s->n_relocations++] =
+      (Relocation){offset, symbol, type, addend};
+}
+
+static void pad(Buffer *out, int alignment) {
+  while (out->len % alignment != 0) {
+    bputc(out, 0);
+  }
+}
+
+static Elf64_Shdr make_section_header(int name, int type, long flags,
+                                      long offset, long size, int alignment) {
+  Elf64_Shdr header = {0};
+  header.sh_name = name;
+  header.sh_type = type;
+  header.sh_flags = flags;
+  header.sh_offset = offset;
+  header.sh_size = size;
+  header.sh_addralign = alignment;
+  return header;
+}
+
+/**
+ * Writes object to out, which is empty, as a relocatable ELF64 object file.
+ * Its sections are followed by one relocation section for each, then the
+ * symbol table, its names, and the section names. Externs that are never
+ * used are left out.
+ */
+void write_elf(Object *object, Buffer *out) {
+  Buffer *names = make_buffer();    // .strtab
+  Buffer *symbols = make_buffer();  // .symtab
+  bputc(names, '\0');
+  Elf64_Sym null_symbol = {0};
+  bwrite(symbols, &null_symbol, sizeof(null_symbol));
+  // ELF indexes of the symbols, which have the local ones first
+  int *elf_indexes = calloc(object->n_symbols, sizeof(*elf_indexes));
+  for (int i_section = 0; i_section < N_SECTIONS; ++i_section) {
+    ObjectSection *section = &object->sections[i_section];
+    for (int i_reloc = 0; i_reloc < section->n_relocations; ++i_reloc) {
+      elf_indexes[section->relocations[i_reloc].symbol] = -1;
+    }
+  }
+  int n_elf_symbols = 1;
+  int n_locals = 1;
+  for (int is_global = 0; is_global <= 1; ++is_global) {
+    for (int i_symbol = 0; i_symbol < object->n_symbols; ++i_symbol) {
+      ObjectSymbol *symbol = &object->symbols[i_symbol];
+      if (symbol->is_global != is_global ||
+          (symbol->section < 0 && elf_indexes[i_symbol] != -1)) {
+        continue;
+      }
+      Elf64_Sym elf_symbol = {0};
+      elf_symbol.st_name = names->len;
+      elf_symbol.st_info =
+          ELF64_ST_INFO(is_global ? STB_GLOBAL : STB_LOCAL, STT_NOTYPE);
+      elf_symbol.st_shndx =
+          symbol->section < 0 ? SHN_UNDEF : 1 + symbol->section;
+      elf_symbol.st_value = symbol->offset;
+      bwrite(symbols, &elf_symbol, sizeof(elf_symbol));
+      bwrite(names, symbol->name, strlen(symbol->name) + 1);
+      elf_indexes[i_symbol] = n_elf_symbols++;
+    }
+    if (!is_global) {
+      n_locals = n_elf_symbols;
+    }
+  }
+
+  // Section headers: null, the sections, their relocations, then the rest
+  enum {
+    i_relocations = 1 + N_SECTIONS,
+    i_symtab = i_relocations + N_SECTIONS,
+    i_strtab,
+    i_shstrtab,
+    i_note,
+    n_headers
+  };
+  Elf64_Shdr headers[n_headers] = {{0}};
+  Buffer *header_names = make_buffer();  // .shstrtab
+  bputc(header_names, '\0');
+  Elf64_Ehdr elf_header = {0};
+  bwrite(out, &elf_header, sizeof(elf_header));
+  for (int i_section = 0; i_section < N_SECTIONS; ++i_section) {
+    ObjectSection *section = &object->sections[i_section];
+    pad(out, section->alignment);
+    headers[1 + i_section] = make_section_header(
+        header_names->len, SHT_PROGBITS, section_flags[i_section], out->len,
+        section->bytes->len, section->alignment);
+    bputs(header_names, section_names[i_section]);
+    bputc(header_names, '\0');
+    bwrite(out, section->bytes->text, section->bytes->len);
+  }
+  for (int i_section = 0; i_section < N_SECTIONS; ++i_section) {
+    ObjectSection *section = &object->sections[i_section];
+    pad(out, 8);
+    Elf64_Shdr *header = &headers[i_relocations + i_section];
+    *header = make_section_header(header_names->len, SHT_RELA, SHF_INFO_LINK,
+                                  out->len,
+                                  section->n_relocations * sizeof(Elf64_Rela),
+                                  8);
+    header->sh_link = i_symtab;
+    header->sh_info = 1 + i_section;
+    header->sh_entsize = sizeof(Elf64_Rela);
+    bprintf(header_names, ".rela%s", section_names[i_section]);
+    bputc(header_names, '\0');
+    for (int i_reloc = 0; i_reloc < section->n_relocations; ++i_reloc) {
+      Relocation *reloc = &section->relocations[i_reloc];
+      Elf64_Rela elf_reloc;
+      elf_reloc.r_offset = reloc->offset;
+      elf_reloc.r_info = ELF64_R_INFO(elf_indexes[reloc->symbol],
+                                      elf_relocation_types[reloc->type]);
+      elf_reloc.r_addend = reloc->addend;
+      bwrite(out, &elf_reloc, sizeof(elf_reloc));
+    }
+  }
+  pad(out, 8);
+  headers[i_symtab] = make_section_header(header_names->len, SHT_SYMTAB, 0,
+                                          out->len, symbols->len, 8);
+  headers[i_symtab].sh_link = i_strtab;
+  headers[i_symtab].sh_info = n_locals;
+  headers[i_symtab].sh_entsize = sizeof(Elf64_Sym);
+  bputs(header_names, ".symtab");
+  bputc(header_names, '\0');
+  bwrite(out, symbols->text, symbols->len);
+  headers[i_strtab] = make_section_header(header_names->len, SHT_STRTAB, 0,
+                                          out->len, names->len, 1);
+  bputs(header_names, ".strtab");
+  bputc(header_names, '\0');
+  bwrite(out, names->text, names->len);
+  // Marks the stack as not executable
+  headers[i_note] = make_section_header(header_names->len, SHT_PROGBITS, 0,
+                                        out->len, 0, 1);
+  bputs(header_names, ".note.GNU-stack");
+  bputc(header_names, '\0');
+  headers[i_shstrtab] = make_section_header(header_names->len, SHT_STRTAB, 0,
+                                            out->len, 0, 1);
+  bputs(header_names, ".shstrtab");
+  bputc(header_names, '\0');
+  headers[i_shstrtab].sh_size = header_names->len;
+  bwrite(out, header_names->text, header_names->len);
+  pad(out, 8);
+
+  memcpy(elf_header.e_ident, ELFMAG, SELFMAG);
+  elf_header.e_ident[EI_CLASS] = ELFCLASS64;
+  elf_header.e_ident[EI_DATA] = ELFDATA2LSB;
+  elf_header.e_ident[EI_VERSION] = EV_CURRENT;
+  elf_header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  elf_header.e_type = ET_REL;
+  elf_header.e_machine = EM_X86_64;
+  elf_header.e_version = EV_CURRENT;
+  elf_header.e_shoff = out->len;
+  elf_header.e_ehsize = sizeof(Elf64_Ehdr);
+  elf_header.e_shentsize = sizeof(Elf64_Shdr);
+  elf_header.e_shnum = n_headers;
+  elf_header.e_shstrndx = i_shstrtab;
+  bwrite(out, headers, sizeof(headers));
+  memcpy(out->text, &elf_header, sizeof(elf_header));
+
+  free(elf_indexes);
+  free_buffer(names);
+  free_buffer(symbols);
+  free_buffer(header_names);
+}
@@ -0,0 +1,71 @@
+#include "buffer.h"
+#ifndef OBJECT_H
+#define OBJECT_H
+
+// Slots in each object's table of symbols, doubling whenever it's half full
+#define OBJECT_INITIAL_SYMBOLS 1024
+
+// Sections that code and data are assembled into
+typedef enum SectionId {
+  section_text,
+  section_data,
+  section_rodata,
+  N_SECTIONS
+} SectionId;
+
+extern char *section_names[N_SECTIONS];
+
+typedef enum RelocationType {
+  reloc_abs64,   // The symbol's address, in 8 bytes
+  reloc_abs32,   // The symbol's address, in 4 bytes sign-extended to 8
+  reloc_pc32,    // The symbol's address relative to the field, in 4 bytes
+  reloc_call32,  // As reloc_pc32, for a call or jump to a function
+} RelocationType;
+
+// A field of a section to be filled in with the address of a symbol, once
+// it's known, plus addend
+typedef struct Relocation {
+  long offset;  // Of the field, in its section
+  int symbol;
+  RelocationType type;
+  long addend;
+} Relocation;
+
+typedef struct ObjectSymbol {
+  char *name;
+  int section;  // SectionId, or -1 if not defined in the object
+  long offset;  // In the section
+  short is_global;  // Declared global or extern
+} ObjectSymbol;
+
+typedef struct ObjectSection {
+  Buffer *bytes;
+  int alignment;
+  int n_relocations;
+  int max_relocations;
+  Relocation *relocations;
+} ObjectSection;
+
+// Machine code and data, as assembled from the emitted code, with the
+// addresses it needs of symbols not yet filled in
+typedef struct Object {
+  ObjectSection sections[N_SECTIONS];
+  int n_symbols;
+  int max_symbols;
+  ObjectSymbol *symbols;
+  int *table;  // Hash table of symbols by name, -1 where empty
+  int table_size;
+} Object;
+
+Object *make_object(void);
+
+void free_object(Object *object);
+
+int get_symbol(Object *object, char *name);
+
+void add_relocation(Object *object, SectionId section, long offset,
+                    int symbol, RelocationType type, long addend);
+
+void write_elf(Object *object, Buffer *out);
+
+#endif
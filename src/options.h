@@ -0,0 +1,18 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+// Command-line options of the compiler, set by main.
+typedef struct Options {
+  short profile;       // --profile: make generated code count calls and cycles
+  short heap_profile;  // --heap-profile: attribute allocations to their sites
+  short ir;            // --ir: print each function's intermediate code
+  short to_stdout;     // --stdout: write the code to stdout, not a file, and
+                       // messages to stderr
+  short elf;           // --elf: write an ELF64 object, rather than NASM
+  short run;           // --run: run the code in the compiler's own process,
+                       // rather than writing it out
+} Options;
+
+extern Options options;
+
+#endif
@@ -12,10 +12,12 @@
  */
 int parse(LL *tokens, AST *global) {
   LL *stack = make_list();
-  AST *list_start_delim = make_listStart();
   while (tokens->len > 0) {
     Token *token = (Token *)pop_head(tokens);
     if (strcmp(token->name, "(") == 0) {
+      // Each delimiter holds the position of its list
+      AST *list_start_delim = make_listStart();
+      set_position(list_start_delim, token->line, token->start_char);
       push_head(stack, list_start_delim);
     } else if (strcmp(token->name, ")") == 0) {
       // Function complete, so wind back stack until start of function
@@ -33,6 +35,8 @@ int parse(LL *tokens, AST *global) {
         }
       }
       node->content.listExp->first = elem2;
+      set_position(node, elem1->line, elem1->column);
+      free_ast_node(elem1);
       if (stack->len == 0) {
         // We have completed a global-level list
         join_parents(node);
@@ -55,6 +59,7 @@ int parse(LL *tokens, AST *global) {
       } else {
         node = make_varExp(token->name);
       }
+      set_position(node, token->line, token->start_char);
       push_head(stack, node);
     }
   }
@@ -75,7 +80,8 @@ int process_defines(AST *global) {
   while (global->content.globalExp->rest->len > 0) {
     AST *def = (AST *)pop_tail(global->content.globalExp->rest);
     char *name = def->content.listExp->first->content.varExp->name;
-    if (strcmp(name, "def") == 0 || strcmp(name, "defrec") == 0) {
+    if (strcmp(name, "def") == 0 || strcmp(name, "defrec") == 0 ||
+        strcmp(name, "defmemo") == 0) {
       // What was main becomes the last element of def,
       // which will later be transformed into the body of a let
       push_tail(def->content.listExp->rest, global->content.globalExp->main);
@@ -84,7 +90,8 @@ int process_defines(AST *global) {
       def->parent = global;
     } else {
       printf(
-          "ERROR! All but last global expression must be 'def' or 'defrec'.");
+          "ERROR! All but last global expression must be 'def', 'defrec' or "
+          "'defmemo'.");
       return PARSE_ERROR;
     }
   }
@@ -101,11 +108,13 @@ int parse_special_forms(AST *ast) {
     if (ast->content.listExp->first->tag == var_exp) {
       AST *new_exp;
       char *name = ast->content.listExp->first->content.varExp->name;
+      short is_memo = strcmp(name, "defmemo") == 0;
       if (strcmp(name, "let") == 0 || strcmp(name, "letrec") == 0 ||
-          strcmp(name, "def") == 0 || strcmp(name, "defrec") == 0) {
+          strcmp(name, "def") == 0 || strcmp(name, "defrec") == 0 ||
+          is_memo) {
         if (ast->content.listExp->rest->len != 3) {
           printf(
-              "ERROR! 'let/letrec/def/defrec' expression must have "
+              "ERROR! 'let/letrec/def/defrec/defmemo' expression must have "
               "argument, definition and body.\n");
           return PARSE_ERROR;
         }
@@ -127,10 +136,19 @@ int parse_special_forms(AST *ast) {
         if (result != 0) {
           return result;
         }
-        ast->content.letExp = make_letExp(arg, defn, body,
-                                          strcmp(name, "letrec") == 0 ||
-                                              strcmp(name, "defrec") == 0)
-                                  ->content.letExp;
+        if (is_memo) {
+          // (defmemo f (lambda ...) ...) is (defrec f (memo (lambda ...)) ...)
+          if (defn->tag != lambda_exp) {
+            printf("ERROR! 'defmemo' definition must be a lambda.\n");
+            return PARSE_ERROR;
+          }
+          defn->content.lambdaExp->is_memo = 1;
+        }
+        ast->content.letExp =
+            make_letExp(arg, defn, body,
+                        strcmp(name, "letrec") == 0 ||
+                            strcmp(name, "defrec") == 0 || is_memo)
+                ->content.letExp;
         ast->tag = let_exp;
       } else if (strcmp(name, "lambda") == 0 || strcmp(name, "λ") == 0) {
         // Lambda args are all of rest other than last element, which is body
@@ -159,6 +177,25 @@ int parse_special_forms(AST *ast) {
         // TODO Free overwritten listExp?
         ast->content.lambdaExp = make_lambdaExp(args, body)->content.lambdaExp;
         ast->tag = lambda_exp;
+      } else if (strcmp(name, "memo") == 0) {
+        // (memo (lambda args body)): lambda whose results are cached
+        if (ast->content.listExp->rest->len != 1) {
+          printf("ERROR! 'memo' expression must have one lambda.\n");
+          return PARSE_ERROR;
+        }
+        AST *lambda = (AST *)ast->content.listExp->rest->head->val;
+        int result = parse_special_forms(lambda);
+        if (result != 0) {
+          return result;
+        }
+        if (lambda->tag != lambda_exp) {
+          printf("ERROR! 'memo' expression must have one lambda.\n");
+          return PARSE_ERROR;
+        }
+        lambda->content.lambdaExp->is_memo = 1;
+        ast->content.lambdaExp = lambda->content.lambdaExp;
+        ast->content.lambdaExp->body->parent = ast;
+        ast->tag = lambda_exp;
       } else if (strcmp(name, "if") == 0) {
         if (ast->content.listExp->rest->len != 3) {
           printf(
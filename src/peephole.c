@@ -0,0 +1,678 @@
+#include "peephole.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Peephole optimiser, run on the code eval emits before it's written out.
+ *
+ * eval emits each expression's code on its own, leaving its value in rax, so
+ * the joins between expressions are full of values moved through rax that
+ * could be moved directly, registers that are loaded and then overwritten,
+ * values stored and immediately loaded back, and comparisons turned into
+ * integers only to be compared again by an if. The code is split into lines,
+ * which the rules below rewrite until none applies.
+ *
+ * Only the instructions eval emits are understood. Any other instruction is
+ * assumed to read every register, so nothing is removed because of it.
+ */
+
+typedef struct Line {
+  char *text;     // As emitted, or NULL once rewritten from the fields below
+  char *label;    // Name if the line is a label, else NULL
+  char *op;       // Mnemonic, or NULL if the line has no instruction
+  char *args[2];  // Operands, if op is understood and has at most two
+  int n_args;     // -1 if op isn't understood, so args weren't split
+  char *comment;  // Without ';', or NULL
+  int is_deleted;
+} Line;
+
+typedef struct Code {
+  Line *lines;
+  int n_lines;
+} Code;
+
+enum { RAX, RBX, RCX, RDX, RSI, RDI, RBP, RSP, R8, R9, R10, R11, N_REGS = 16 };
+
+// Each register's names by size: 64, 32, 16 and 8 bits
+static char *registers[N_REGS][4] = {
+    {"rax", "eax", "ax", "al"},     {"rbx", "ebx", "bx", "bl"},
+    {"rcx", "ecx", "cx", "cl"},     {"rdx", "edx", "dx", "dl"},
+    {"rsi", "esi", "si", "sil"},    {"rdi", "edi", "di", "dil"},
+    {"rbp", "ebp", "bp", "bpl"},    {"rsp", "esp", "sp", "spl"},
+    {"r8", "r8d", "r8w", "r8b"},    {"r9", "r9d", "r9w", "r9b"},
+    {"r10", "r10d", "r10w", "r10b"}, {"r11", "r11d", "r11w", "r11b"},
+    {"r12", "r12d", "r12w", "r12b"}, {"r13", "r13d", "r13w", "r13b"},
+    {"r14", "r14d", "r14w", "r14b"}, {"r15", "r15d", "r15w", "r15b"}};
+
+// Registers a call may read: arguments, closure and gc_call's target
+static int call_args[] = {RDI, RSI, RDX, RCX, R8, R9, R10, R11};
+
+// Registers whose values are needed after a function returns
+static int callee_saved[] = {RAX, RBX, RBP, RSP, 12, 13, 14, 15};
+
+// Instructions that overwrite their first operand without reading it
+static char *moves[] = {"mov", "movzx", "lea", "pop"};
+
+// Instructions that read all their operands, and may write the first
+static char *updates[] = {"add", "sub", "or",  "and",  "xor", "imul",
+                          "sar", "shl", "dec", "inc",  "cmp", "test",
+                          "push"};
+
+static char *directives[] = {"section", "global", "extern", "align",
+                             "db",      "dw",     "dd",     "dq"};
+
+#define N_ELEMENTS(array) (sizeof(array) / sizeof(*(array)))
+
+static int is_in(char *word, char **words, int n_words) {
+  for (int i_word = 0; i_word < n_words; ++i_word) {
+    if (strcmp(word, words[i_word]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int is_reg_in(int reg, int *regs, int n_regs) {
+  for (int i_reg = 0; i_reg < n_regs; ++i_reg) {
+    if (regs[i_reg] == reg) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int is_understood(char *op) {
+  return is_in(op, moves, N_ELEMENTS(moves)) ||
+         is_in(op, updates, N_ELEMENTS(updates)) || strcmp(op, "call") == 0 ||
+         strcmp(op, "ret") == 0 || strcmp(op, "leave") == 0 || op[0] == 'j' ||
+         strncmp(op, "set", 3) == 0;
+}
+
+static int is_directive(Line *line) {
+  return !line->is_deleted && line->op != NULL &&
+         is_in(line->op, directives, N_ELEMENTS(directives));
+}
+
+static int is_instruction(Line *line) {
+  return !line->is_deleted && line->op != NULL && !is_directive(line);
+}
+
+static char *trim(char *s) {
+  while (isspace(*s)) {
+    ++s;
+  }
+  char *end = s + strlen(s);
+  while (end > s && isspace(end[-1])) {
+    *--end = '\0';
+  }
+  return s;
+}
+
+/**
+ * Splits line->text, which it keeps, into the other fields, pointing into a
+ * copy of it.
+ */
+static void parse_line(Line *line) {
+  char *s = strdup(line->text);
+  line->label = NULL;
+  line->op = NULL;
+  line->n_args = -1;
+  line->comment = NULL;
+  line->is_deleted = 0;
+  if (*s == '\0' || *s == ';') {
+    return;
+  }
+  if (!isspace(*s)) {
+    // Labels start lines; a label of data is followed by it
+    line->label = s;
+    s[strcspn(s, ":")] = '\0';
+    return;
+  }
+  s = trim(s);
+  if (*s == '\0' || *s == ';') {
+    return;
+  }
+  line->op = s;
+  s += strcspn(s, " \t");
+  if (*s != '\0') {
+    *s++ = '\0';
+  }
+  if (!is_understood(line->op)) {
+    return;
+  }
+  char *comment = strchr(s, ';');
+  if (comment != NULL) {
+    *comment = '\0';
+    line->comment = trim(comment + 1);
+  }
+  s = trim(s);
+  line->n_args = 0;
+  if (*s == '\0') {
+    return;
+  }
+  // Operands are split at commas outside brackets
+  line->args[line->n_args++] = s;
+  for (int depth = 0; *s != '\0'; ++s) {
+    if (*s == '[') {
+      ++depth;
+    } else if (*s == ']') {
+      --depth;
+    } else if (*s == ',' && depth == 0) {
+      *s = '\0';
+      if (line->n_args == 2) {
+        line->n_args = -1;  // Not understood after all
+        return;
+      }
+      line->args[line->n_args++] = trim(s + 1);
+    }
+  }
+  line->args[0] = trim(line->args[0]);
+}
+
+static void set_instruction(Line *line, char *op, char *arg0, char *arg1) {
+  line->text = NULL;
+  line->op = op;
+  line->args[0] = arg0;
+  line->args[1] = arg1;
+  line->n_args = arg1 != NULL ? 2 : arg0 != NULL ? 1 : 0;
+}
+
+static void write_line(Buffer *out, Line *line) {
+  if (line->text != NULL) {
+    bputs(out, line->text);
+    bputc(out, '\n');
+    return;
+  }
+  bprintf(out, "\t%s", line->op);
+  for (int i_arg = 0; i_arg < line->n_args; ++i_arg) {
+    bprintf(out, "%s%s", i_arg == 0 ? " " : ", ", line->args[i_arg]);
+  }
+  if (line->comment != NULL) {
+    bprintf(out, "    ; %s", line->comment);
+  }
+  bputc(out, '\n');
+}
+
+/**
+ * Returns:
+ *   The register that operand is, or -1; sets *size to the index of its name
+ *   in registers, or -1
+ */
+static int get_register(char *operand, int *size) {
+  *size = -1;
+  for (int reg = 0; reg < N_REGS; ++reg) {
+    for (int i_size = 0; i_size < 4; ++i_size) {
+      if (strcmp(operand, registers[reg][i_size]) == 0) {
+        *size = i_size;
+        return reg;
+      }
+    }
+  }
+  return -1;
+}
+
+/**
+ * Returns:
+ *   The register that operand is, if all 64 bits of it, else -1
+ */
+static int get_full_register(char *operand) {
+  int size;
+  int reg = get_register(operand, &size);
+  return size == 0 ? reg : -1;
+}
+
+static int is_memory(char *operand) { return strchr(operand, '[') != NULL; }
+
+/**
+ * Returns:
+ *   1 if operand is a number that fits in an instruction's 32-bit immediate
+ */
+static int is_small_constant(char *operand) {
+  char *end;
+  long value = strtol(operand, &end, 10);
+  return end != operand && *end == '\0' && value >= -(1L << 31) &&
+         value < (1L << 31);
+}
+
+/**
+ * Returns:
+ *   1 if operand names any part of reg, including in an address
+ */
+static int mentions(char *operand, int reg) {
+  char word[16];
+  while (*operand != '\0') {
+    int len = 0;
+    while (isalnum(*operand) || *operand == '_') {
+      if (len < 15) {
+        word[len++] = *operand;
+      }
+      ++operand;
+    }
+    word[len] = '\0';
+    int size;
+    if (len > 0 && get_register(word, &size) == reg) {
+      return 1;
+    }
+    if (len == 0) {
+      ++operand;
+    }
+  }
+  return 0;
+}
+
+static int is_local(char *label) { return label[0] == '.'; }
+
+/**
+ * Returns:
+ *   Index of the label name, which the local jump at from jumps to, or -1.
+ *   Local labels belong to the last non-local label before them.
+ */
+static int find_label(Code *code, int from, char *name) {
+  int start = from;
+  while (start > 0 && (code->lines[start].label == NULL ||
+                       is_local(code->lines[start].label))) {
+    --start;
+  }
+  for (int i_line = start; i_line < code->n_lines; ++i_line) {
+    char *label = code->lines[i_line].label;
+    if (label != NULL && i_line > start && !is_local(label)) {
+      break;
+    }
+    if (label != NULL && strcmp(label, name) == 0) {
+      return i_line;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Returns:
+ *   1 if the value in reg after line from is never read, following at most
+ *   n_jumps jumps; 0 if it might be
+ */
+static int is_dead(Code *code, int from, int reg, int n_jumps) {
+  for (int i_line = from + 1; i_line < code->n_lines; ++i_line) {
+    Line *line = &code->lines[i_line];
+    if ((line->label != NULL && !is_local(line->label)) ||
+        is_directive(line)) {
+      return 0;  // Not code of the same function
+    }
+    if (!is_instruction(line)) {
+      continue;
+    }
+    char *op = line->op;
+    if (line->n_args < 0) {
+      return 0;
+    }
+    if (op[0] == 'j') {
+      char *target = line->args[0];
+      int is_jmp = strcmp(op, "jmp") == 0;
+      if (!is_local(target)) {
+        // Tail call, or error which doesn't return; only args are read
+        if (!(reg == RAX || reg == R11)) {
+          return 0;
+        }
+        if (is_jmp) {
+          return 1;
+        }
+        continue;
+      }
+      int i_target = find_label(code, i_line, target);
+      if (n_jumps == 0 || i_target < 0 ||
+          !is_dead(code, i_target, reg, n_jumps - 1)) {
+        return 0;
+      }
+      if (is_jmp) {
+        return 1;
+      }
+      continue;
+    }
+    if (strcmp(op, "ret") == 0) {
+      return !is_reg_in(reg, callee_saved, N_ELEMENTS(callee_saved));
+    }
+    if (strcmp(op, "call") == 0) {
+      if (is_reg_in(reg, call_args, N_ELEMENTS(call_args)) ||
+          mentions(line->args[0], reg)) {
+        return 0;
+      }
+      if (reg == RAX) {
+        // printf takes the number of vector args in al
+        return strcmp(line->args[0], "printf") != 0;
+      }
+      continue;
+    }
+    if (strcmp(op, "leave") == 0) {
+      if (reg == RBP || reg == RSP) {
+        return 0;
+      }
+      continue;
+    }
+    int is_read = 0;
+    for (int i_arg = 0; i_arg < line->n_args; ++i_arg) {
+      if (mentions(line->args[i_arg], reg)) {
+        is_read = 1;
+      }
+    }
+    int is_move = is_in(op, moves, N_ELEMENTS(moves));
+    int size;
+    if (line->n_args == 2 && strcmp(op, "xor") == 0 &&
+        strcmp(line->args[0], line->args[1]) == 0 &&
+        get_register(line->args[0], &size) == reg && size <= 1) {
+      return 1;  // Zeroes it
+    }
+    if (is_move && line->n_args >= 1 &&
+        get_register(line->args[0], &size) == reg) {
+      // Writing 32 bits zeroes the rest, so overwrites all of reg
+      if (size <= 1 && (line->n_args < 2 || !mentions(line->args[1], reg))) {
+        return 1;
+      }
+      return 0;
+    }
+    if (is_read) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Returns:
+ *   Index of the next instruction after i_line, or -1 if a label or the end
+ *   comes first
+ */
+static int next_instruction(Code *code, int i_line) {
+  for (++i_line; i_line < code->n_lines; ++i_line) {
+    Line *line = &code->lines[i_line];
+    if (line->label != NULL || is_directive(line)) {
+      return -1;
+    }
+    if (is_instruction(line)) {
+      return i_line;
+    }
+  }
+  return -1;
+}
+
+static int is_op(Line *line, char *op, int n_args) {
+  return line->op != NULL && strcmp(line->op, op) == 0 &&
+         line->n_args == n_args;
+}
+
+/**
+ * Rewrites the move at i_line, and the instruction after it, if that uses the
+ * value moved only once and it's not needed afterwards:
+ *   mov rax, X / mov D, rax  becomes  mov D, X
+ *   mov rax, X / cmp rax, Y  becomes  cmp X, Y
+ * Returns:
+ *   1 if it did
+ */
+static int forward_move(Code *code, int i_line) {
+  Line *line = &code->lines[i_line];
+  int reg = get_full_register(line->args[0]);
+  char *src = line->args[1];
+  int i_next = next_instruction(code, i_line);
+  if (reg < 0 || i_next < 0) {
+    return 0;
+  }
+  Line *next = &code->lines[i_next];
+  int is_src_reg = get_full_register(src) >= 0;
+  int is_src_small = is_src_reg || is_small_constant(src);
+  if (is_op(next, "mov", 2) && get_full_register(next->args[1]) == reg &&
+      !mentions(next->args[0], reg) &&
+      (is_src_small || !is_memory(next->args[0]))) {
+    // Memory to memory, or a 64-bit constant to memory, isn't encodable
+  } else if (is_op(next, "cmp", 2) && get_full_register(next->args[0]) == reg &&
+             !mentions(next->args[1], reg) &&
+             (is_src_reg || (is_memory(src) && !is_memory(next->args[1])))) {
+  } else if (is_op(next, "cmp", 2) && get_full_register(next->args[1]) == reg &&
+             !mentions(next->args[0], reg) && is_src_small) {
+  } else {
+    return 0;
+  }
+  if (!is_dead(code, i_next, reg, PEEPHOLE_MAX_JUMPS)) {
+    return 0;
+  }
+  int i_arg = get_full_register(next->args[0]) == reg ? 0 : 1;
+  next->args[i_arg] = src;
+  next->text = NULL;
+  line->is_deleted = 1;
+  return 1;
+}
+
+static char *negate_condition(char *condition) {
+  char *conditions[][2] = {{"e", "ne"}, {"l", "ge"}, {"g", "le"}};
+  for (size_t i_cond = 0; i_cond < N_ELEMENTS(conditions); ++i_cond) {
+    for (int i_side = 0; i_side < 2; ++i_side) {
+      if (strcmp(condition, conditions[i_cond][i_side]) == 0) {
+        return conditions[i_cond][1 - i_side];
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Jumps straight on a comparison that's made into an integer and then
+ * tested by an if:
+ *   cmp A, B / setCC al / movzx eax, al / lea rax, [rax*2+1] / cmp rax, 1 /
+ *   je L  becomes  cmp A, B / jNCC L
+ * Returns:
+ *   1 if it did
+ */
+static int fuse_condition(Code *code, int i_line) {
+  char *pattern[][3] = {{"movzx", "eax", "al"},
+                        {"lea", "rax", "[rax*2+1]"},
+                        {"cmp", "rax", "1"}};
+  Line *set = &code->lines[i_line];
+  if (strncmp(set->op, "set", 3) != 0 || set->n_args != 1 ||
+      strcmp(set->args[0], "al") != 0) {
+    return 0;
+  }
+  char *condition = negate_condition(set->op + 3);
+  int indices[N_ELEMENTS(pattern)];
+  int i_jump = i_line;
+  for (size_t i_pattern = 0; i_pattern < N_ELEMENTS(pattern); ++i_pattern) {
+    i_jump = next_instruction(code, i_jump);
+    if (i_jump < 0 || !is_op(&code->lines[i_jump], pattern[i_pattern][0], 2) ||
+        strcmp(code->lines[i_jump].args[0], pattern[i_pattern][1]) != 0 ||
+        strcmp(code->lines[i_jump].args[1], pattern[i_pattern][2]) != 0) {
+      return 0;
+    }
+    indices[i_pattern] = i_jump;
+  }
+  i_jump = next_instruction(code, i_jump);
+  if (condition == NULL || i_jump < 0 ||
+      !is_op(&code->lines[i_jump], "je", 1) ||
+      !is_local(code->lines[i_jump].args[0])) {
+    return 0;
+  }
+  Line *jump = &code->lines[i_jump];
+  int i_target = find_label(code, i_jump, jump->args[0]);
+  if (i_target < 0 || !is_dead(code, i_jump, RAX, PEEPHOLE_MAX_JUMPS) ||
+      !is_dead(code, i_target, RAX, PEEPHOLE_MAX_JUMPS)) {
+    return 0;
+  }
+  char *op = malloc(strlen(condition) + 2);
+  sprintf(op, "j%s", condition);
+  set_instruction(set, op, jump->args[0], NULL);
+  set->comment = jump->comment;
+  for (size_t i_pattern = 0; i_pattern < N_ELEMENTS(pattern); ++i_pattern) {
+    code->lines[indices[i_pattern]].is_deleted = 1;
+  }
+  jump->is_deleted = 1;
+  return 1;
+}
+
+/**
+ * Applies the jump rules to the jump at i_line:
+ *   A jump to a jump goes to the second's target instead.
+ *   jmp L just before L is removed.
+ * Returns:
+ *   1 if it changed anything
+ */
+static int thread_jump(Code *code, int i_line) {
+  Line *line = &code->lines[i_line];
+  char *target = line->args[0];
+  if (line->n_args != 1 || !is_local(target)) {
+    return 0;
+  }
+  int i_target = find_label(code, i_line, target);
+  if (i_target < 0) {
+    return 0;
+  }
+  if (strcmp(line->op, "jmp") == 0 && i_target > i_line) {
+    int is_next = 1;
+    for (int i_between = i_line + 1; i_between < i_target; ++i_between) {
+      if (is_instruction(&code->lines[i_between])) {
+        is_next = 0;
+      }
+    }
+    if (is_next) {
+      line->is_deleted = 1;
+      return 1;
+    }
+  }
+  int i_next = i_target;
+  while (i_next < code->n_lines && !is_instruction(&code->lines[i_next])) {
+    if (code->lines[i_next].label != NULL &&
+        !is_local(code->lines[i_next].label)) {
+      return 0;
+    }
+    ++i_next;
+  }
+  if (i_next == code->n_lines) {
+    return 0;
+  }
+  Line *next = &code->lines[i_next];
+  if (!is_op(next, "jmp", 1) || strcmp(next->args[0], target) == 0 ||
+      is_memory(next->args[0])) {
+    return 0;
+  }
+  line->args[0] = next->args[0];
+  line->text = NULL;
+  return 1;
+}
+
+/**
+ * Removes instructions after an unconditional jump or return, up to the next
+ * label.
+ * Returns:
+ *   1 if it removed any
+ */
+static int remove_unreachable(Code *code, int i_line) {
+  int is_removed = 0;
+  for (int i_next = next_instruction(code, i_line); i_next >= 0;
+       i_next = next_instruction(code, i_next)) {
+    code->lines[i_next].is_deleted = 1;
+    is_removed = 1;
+  }
+  return is_removed;
+}
+
+/**
+ * Returns:
+ *   1 if a rule changed the instruction at i_line or those after it
+ */
+static int apply_rules(Code *code, int i_line) {
+  Line *line = &code->lines[i_line];
+  if (line->n_args < 0) {
+    return 0;
+  }
+  if (is_op(line, "mov", 2)) {
+    char *dst = line->args[0];
+    char *src = line->args[1];
+    if (strcmp(dst, src) == 0) {
+      line->is_deleted = 1;
+      return 1;
+    }
+    int i_next = next_instruction(code, i_line);
+    Line *next = i_next >= 0 ? &code->lines[i_next] : NULL;
+    if (next != NULL && is_op(next, "mov", 2) &&
+        strcmp(next->args[0], src) == 0 && strcmp(next->args[1], dst) == 0) {
+      // Moving back what was just moved
+      next->is_deleted = 1;
+      return 1;
+    }
+    if (next != NULL && is_op(next, "mov", 2) && is_memory(dst) &&
+        get_full_register(src) >= 0 && strcmp(next->args[1], dst) == 0) {
+      // Loading what was just stored
+      next->args[1] = src;
+      next->text = NULL;
+      return 1;
+    }
+  }
+  int reg = line->n_args > 0 ? get_full_register(line->args[0]) : -1;
+  if (is_in(line->op, moves, N_ELEMENTS(moves)) &&
+      strcmp(line->op, "pop") != 0 && reg >= 0 && reg != RSP && reg != RBP &&
+      is_dead(code, i_line, reg, PEEPHOLE_MAX_JUMPS)) {
+    line->is_deleted = 1;
+    return 1;
+  }
+  if (is_op(line, "movzx", 2) && strcmp(line->args[0], "eax") == 0 &&
+      is_dead(code, i_line, RAX, PEEPHOLE_MAX_JUMPS)) {
+    line->is_deleted = 1;
+    return 1;
+  }
+  if (is_op(line, "mov", 2) && forward_move(code, i_line)) {
+    return 1;
+  }
+  if (strncmp(line->op, "set", 3) == 0) {
+    return fuse_condition(code, i_line);
+  }
+  if (line->op[0] == 'j' && thread_jump(code, i_line)) {
+    return 1;
+  }
+  if (is_op(line, "jmp", 1) || is_op(line, "ret", 0)) {
+    return remove_unreachable(code, i_line);
+  }
+  return 0;
+}
+
+static long count_instructions(Code *code) {
+  long n_instructions = 0;
+  for (int i_line = 0; i_line < code->n_lines; ++i_line) {
+    n_instructions += is_instruction(&code->lines[i_line]);
+  }
+  return n_instructions;
+}
+
+/**
+ * Optimises code, NASM as emitted by eval, and appends the result to out.
+ * Modifies code.
+ */
+void peephole(char *code_text, Buffer *out, PeepholeStats *stats) {
+  Code code;
+  code.n_lines = 0;
+  for (char *c = code_text; *c != '\0'; ++c) {
+    code.n_lines += *c == '\n';
+  }
+  code.lines = malloc(code.n_lines * sizeof(*code.lines));
+  char *text = code_text;
+  for (int i_line = 0; i_line < code.n_lines; ++i_line) {
+    char *end = strchr(text, '\n');
+    *end = '\0';
+    code.lines[i_line].text = text;
+    parse_line(&code.lines[i_line]);
+    text = end + 1;
+  }
+  stats->n_before = count_instructions(&code);
+  int is_changed = 1;
+  for (int i_pass = 0; i_pass < PEEPHOLE_MAX_PASSES && is_changed; ++i_pass) {
+    is_changed = 0;
+    for (int i_line = 0; i_line < code.n_lines; ++i_line) {
+      if (is_instruction(&code.lines[i_line])) {
+        is_changed |= apply_rules(&code, i_line);
+      }
+    }
+  }
+  stats->n_after = count_instructions(&code);
+  for (int i_line = 0; i_line < code.n_lines; ++i_line) {
+    if (!code.lines[i_line].is_deleted) {
+      write_line(out, &code.lines[i_line]);
+    }
+  }
+  // Strings parsed from lines, and new ones, are left for the process to free
+  free(code.lines);
+}
@@ -0,0 +1,18 @@
+#include "buffer.h"
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+// Times the rules are applied over the whole program, at most
+#define PEEPHOLE_MAX_PASSES 8
+
+// Jumps followed when finding whether a register is still needed
+#define PEEPHOLE_MAX_JUMPS 4
+
+typedef struct PeepholeStats {
+  long n_before;  // Instructions emitted by eval
+  long n_after;   // Instructions written out
+} PeepholeStats;
+
+void peephole(char *code, Buffer *out, PeepholeStats *stats);
+
+#endif
@@ -0,0 +1,68 @@
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Call profiler for programs compiled with --profile.
+ *
+ * Generated code keeps a ProfileRecord per lifted function and per call site,
+ * adding the cycles spent between entry and return to it. Counters aren't
+ * shared between threads, as generated code is single-threaded, so they need
+ * no locking. This only reports them at exit.
+ */
+
+static ProfileRecord **profile_records = NULL;
+static int n_profile_records = 0;
+
+/**
+ * Called by main of a profiled program.
+ * Params:
+ *   records: NULL-terminated
+ */
+void profile_start(ProfileRecord **records) {
+  profile_records = records;
+  for (n_profile_records = 0; records[n_profile_records] != NULL;
+       ++n_profile_records) {
+  }
+  atexit(profile_print_report);
+}
+
+static int compare_cycles(const void *a, const void *b) {
+  long cycles_a = (*(ProfileRecord **)a)->cycles;
+  long cycles_b = (*(ProfileRecord **)b)->cycles;
+  return (cycles_a < cycles_b) - (cycles_a > cycles_b);  // Most first
+}
+
+static void print_records(ProfileRecord **sorted, int kind, char *heading) {
+  fprintf(stderr, "profile: %s by inclusive cycles\n", heading);
+  fprintf(stderr, "%12s %16s %12s  %-16s %s\n", "calls", "cycles",
+          "cycles/call", "function", "source");
+  for (int i_record = 0; i_record < n_profile_records; ++i_record) {
+    ProfileRecord *record = sorted[i_record];
+    if (record->kind != kind || record->n_calls == 0) {
+      continue;
+    }
+    fprintf(stderr, "%12ld %16ld %12ld  %-16s ", record->n_calls,
+            record->cycles, record->cycles / record->n_calls, record->name);
+    if (record->line < 0) {
+      fprintf(stderr, "?\n");
+    } else {
+      // 1-indexed, as editors show it
+      fprintf(stderr, "%ld:%ld\n", record->line + 1, record->column + 1);
+    }
+  }
+}
+
+/**
+ * Registered with atexit by profile_start.
+ */
+void profile_print_report(void) {
+  ProfileRecord **sorted = malloc(n_profile_records * sizeof(*sorted));
+  for (int i_record = 0; i_record < n_profile_records; ++i_record) {
+    sorted[i_record] = profile_records[i_record];
+  }
+  qsort(sorted, n_profile_records, sizeof(*sorted), compare_cycles);
+  print_records(sorted, profile_function, "functions");
+  print_records(sorted, profile_call_site, "call sites");
+  free(sorted);
+}
@@ -0,0 +1,21 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+enum ProfileKind { profile_function, profile_call_site };
+
+// Counters for one lifted function or call site, laid out by programs
+// compiled with --profile, which update the first two fields directly.
+typedef struct ProfileRecord {
+  long n_calls;
+  long cycles;  // Inclusive of callees, as measured by rdtsc
+  char *name;   // Function, or function called at the call site
+  long line;    // Source position, 0-indexed, or -1 if unknown
+  long column;
+  long kind;    // A ProfileKind
+} ProfileRecord;
+
+void profile_start(ProfileRecord **records);
+
+void profile_print_report(void);
+
+#endif
@@ -0,0 +1,220 @@
+#include "regalloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include "ast.h"
+#include "known.h"
+#include "scope.h"
+
+/**
+ * Linear-scan register allocation for one generated function.
+ *
+ * The values that eval keeps in frame slots are the function's args and own
+ * closure, let-bound variables, and the operands and operator of calls
+ * waiting for the call. Each is live from where it's stored until its last
+ * use, numbered in the order that eval emits code. Values live at the same
+ * time get different registers, and when there aren't enough, the one whose
+ * use is furthest away stays in its slot.
+ */
+
+typedef struct Interval {
+  int start;
+  int end;
+  AST *node;  // Lambda for args, let for let-bound values, else operand
+  int nth_arg;
+  int *reg;  // Set to the register allocated, or -1
+} Interval;
+
+typedef struct Allocation {
+  AST *fn;
+  Interval *intervals;
+  int n_intervals;
+  int max_intervals;
+  int pos;  // Numbers the definitions and uses in evaluation order
+} Allocation;
+
+/**
+ * Adds the live range of a value defined at the current position.
+ * Returns:
+ *   Its index, as the intervals move when more are added
+ */
+static int add_interval(Allocation *alloc, AST *node, int nth_arg, int *reg) {
+  if (alloc->n_intervals == alloc->max_intervals) {
+    alloc->max_intervals = alloc->max_intervals ? 2 * alloc->max_intervals : 16;
+    alloc->intervals =
+        realloc(alloc->intervals,
+                alloc->max_intervals * sizeof(*alloc->intervals));
+  }
+  Interval *interval = &alloc->intervals[alloc->n_intervals++];
+  interval->start = alloc->pos;
+  interval->end = interval->start;
+  interval->node = node;
+  interval->nth_arg = nth_arg;
+  interval->reg = reg;
+  *reg = -1;
+  return alloc->n_intervals - 1;
+}
+
+static Interval *find_interval(Allocation *alloc, AST *node, int nth_arg) {
+  for (int i_interval = alloc->n_intervals - 1; i_interval >= 0;
+       --i_interval) {
+    Interval *interval = &alloc->intervals[i_interval];
+    if (interval->node == node && interval->nth_arg == nth_arg) {
+      return interval;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Extends the live range of the value that var refers to, if it's one of the
+ * function's.
+ */
+static void use_var(Allocation *alloc, AST *var) {
+  char *name = var->content.varExp->name;
+  Interval *interval = NULL;
+  if (alloc->fn->tag == lambda_exp &&
+      strcmp(name, alloc->fn->content.lambdaExp->name) == 0) {
+    // Own closure, kept after the args
+    interval = find_interval(alloc, alloc->fn,
+                             alloc->fn->content.lambdaExp->args->list->len);
+  } else {
+    AST *scope = find_scope(var, name);
+    if (scope == NULL) {
+      return;
+    }
+    if (alloc->fn->tag == lambda_exp &&
+        scope == alloc->fn->content.lambdaExp->body) {
+      Map *args = alloc->fn->content.lambdaExp->args;
+      for (int i_arg = 0; i_arg < args->list->len; ++i_arg) {
+        if (strcmp(get_key_i(args, i_arg), name) == 0) {
+          interval = find_interval(alloc, alloc->fn, i_arg);
+        }
+      }
+    } else if (scope->parent != NULL && scope->parent->tag == let_exp &&
+               scope == scope->parent->content.letExp->body) {
+      interval = find_interval(alloc, scope->parent, -1);
+    }
+  }
+  if (interval != NULL) {
+    interval->end = alloc->pos++;
+  }
+}
+
+/**
+ * Numbers ast's definitions and uses in the order that eval emits them.
+ */
+static void number(Allocation *alloc, AST *ast) {
+  switch (ast->tag) {
+    case var_exp:
+      use_var(alloc, ast);
+      break;
+    case if_exp:
+      number(alloc, ast->content.ifExp->pred);
+      number(alloc, ast->content.ifExp->case_true);
+      number(alloc, ast->content.ifExp->case_false);
+      break;
+    case let_exp:
+      number(alloc, ast->content.letExp->defn);
+      add_interval(alloc, ast, -1, &ast->content.letExp->reg);
+      ++alloc->pos;
+      number(alloc, ast->content.letExp->body);
+      break;
+    case list_exp: {
+      LL *rest = ast->content.listExp->rest;
+      AST *first = ast->content.listExp->first;
+      int *operands = malloc((rest->len + 1) * sizeof(*operands));
+      for (int i_operand = rest->len - 1; i_operand >= 0; --i_operand) {
+        AST *child = get_i(rest, i_operand);
+        number(alloc, child);
+        operands[i_operand + 1] = add_interval(alloc, child, -1, &child->reg);
+        ++alloc->pos;
+      }
+      int n_operators = 0;
+      if (first->tag == var_exp && first->content.varExp->is_recursive) {
+        use_var(alloc, first);
+      } else if (is_operator_needed(ast)) {
+        number(alloc, first);
+        operands[0] = add_interval(alloc, first, -1, &first->reg);
+        ++alloc->pos;
+        n_operators = 1;
+      }
+      // All used by the call
+      for (int i_operand = 1 - n_operators; i_operand <= rest->len;
+           ++i_operand) {
+        alloc->intervals[operands[i_operand]].end = alloc->pos;
+      }
+      ++alloc->pos;
+      free(operands);
+      break;
+    }
+    case make_closure_exp: {
+      LL *free_vars = ast->content.makeClosureExp->free_vars;
+      for (int i_free = 0; i_free < free_vars->len; ++i_free) {
+        number(alloc, get_i(free_vars, i_free));
+      }
+      break;
+    }
+    default:
+      // Integers, and lambdas, which are separate functions
+      break;
+  }
+}
+
+/**
+ * Allocates registers to the values of a lifted function, or of main if fn
+ * is the global node. Records them in the reg fields of the lets and
+ * operands, and in the lambda's arg_regs.
+ * Returns:
+ *   Bit mask of the registers used
+ */
+int allocate_registers(AST *fn) {
+  Allocation alloc = {fn, NULL, 0, 0, 0};
+  AST *body;
+  if (fn->tag == lambda_exp) {
+    SLambdaExp *lambda = fn->content.lambdaExp;
+    int n_args = lambda->args->list->len;
+    lambda->arg_regs = malloc((n_args + 1) * sizeof(*lambda->arg_regs));
+    // All defined on entry, including the own closure
+    for (int i_arg = 0; i_arg <= n_args; ++i_arg) {
+      add_interval(&alloc, fn, i_arg, &lambda->arg_regs[i_arg]);
+    }
+    ++alloc.pos;
+    body = lambda->body;
+  } else {
+    body = fn->content.globalExp->main;
+  }
+  number(&alloc, body);
+  // Intervals are in order of start. Active ones hold registers.
+  Interval *active[N_ALLOC_REGISTERS] = {NULL};
+  int used_regs = 0;
+  for (int i_interval = 0; i_interval < alloc.n_intervals; ++i_interval) {
+    Interval *interval = &alloc.intervals[i_interval];
+    int free_reg = -1;
+    int furthest_reg = -1;
+    for (int i_reg = 0; i_reg < N_ALLOC_REGISTERS; ++i_reg) {
+      if (active[i_reg] != NULL && active[i_reg]->end < interval->start) {
+        active[i_reg] = NULL;  // Expired
+      }
+      if (active[i_reg] == NULL) {
+        if (free_reg == -1) {
+          free_reg = i_reg;
+        }
+      } else if (furthest_reg == -1 ||
+                 active[i_reg]->end > active[furthest_reg]->end) {
+        furthest_reg = i_reg;
+      }
+    }
+    if (free_reg == -1 && active[furthest_reg]->end > interval->end) {
+      // Spill the value used last instead
+      *active[furthest_reg]->reg = -1;
+      free_reg = furthest_reg;
+    }
+    if (free_reg != -1) {
+      active[free_reg] = interval;
+      *interval->reg = free_reg;
+      used_regs |= 1 << free_reg;
+    }
+  }
+  free(alloc.intervals);
+  return used_regs;
+}
@@ -0,0 +1,18 @@
+#include "ast.h"
+#ifndef REGALLOC_H
+#define REGALLOC_H
+
+// Values are kept in the callee-saved registers rbx and r12-r15, so they
+// survive calls. Generated functions save the ones they use in frame slots,
+// which the garbage collector scans, so that it can update them.
+#define N_ALLOC_REGISTERS 5
+
+// Where a value is kept: a frame slot, as its offset below rbp, or the ith
+// register.
+#define REG_LOCATION(i) (-1 - (i))
+#define IS_REG_LOCATION(loc) ((loc) < 0)
+#define REG_INDEX(loc) (-1 - (loc))
+
+int allocate_registers(AST *fn);
+
+#endif
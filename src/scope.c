@@ -68,6 +68,42 @@ AST *find_scope(AST *ast, char *var) {
   }
 }
 
+/**
+ * Like find_scope, but without reporting undefined variables, for the passes
+ * that run before closure_convert checks them.
+ * Returns:
+ *  Pointer to the AST node that has the symbol table in which ast's variable
+ *  var is defined, or the global node if var is a standard library function,
+ *  or NULL if it is undefined
+ */
+AST *find_definer(AST *ast, char *var) {
+  for (; ast != NULL; ast = ast->parent) {
+    if (map_in(ast->symbol_table, var)) {
+      return ast;
+    }
+    if (ast->tag == global_exp &&
+        map_in(ast->content.globalExp->standard, var)) {
+      return ast;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Returns:
+ *  The let or def that binds the variable var refers to, or NULL if var is
+ *  bound otherwise or undefined
+ */
+AST *find_let(AST *var) {
+  AST *scope = find_definer(var, var->content.varExp->name);
+  if (scope != NULL && scope->parent != NULL &&
+      scope->parent->tag == let_exp &&
+      scope == scope->parent->content.letExp->body) {
+    return scope->parent;
+  }
+  return NULL;
+}
+
 /**
  * Returns:
  *  Value associated with var in scope,
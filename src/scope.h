@@ -8,4 +8,8 @@ AST *find_scope(AST *ast, char *var);
 
 void *get_in_scope(AST *ast, char *var);
 
+AST *find_definer(AST *ast, char *var);
+
+AST *find_let(AST *var);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,86 @@
+#include "shake.h"
+#include <stdlib.h>
+#include <string.h>
+#include "ast.h"
+#include "known.h"
+#include "scope.h"
+
+/**
+ * Dead-binding elimination, between fold_constants and closure_convert.
+ *
+ * defs are lets around main by now, so a let or def whose variable its body
+ * never refers to, and whose definition has no effects, is replaced by its
+ * body. The definition's lambdas are then never lifted, so emit no code.
+ * A defrec's references to itself are in its definition, so don't keep it.
+ */
+
+/**
+ * Adds change to the use counts of the lets that the variables in ast refer
+ * to.
+ */
+static void count_uses(AST *ast, int change) {
+  if (ast->tag == var_exp) {
+    AST *let = find_let(ast);
+    if (let != NULL) {
+      let->content.letExp->n_uses += change;
+    }
+  }
+  for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+    count_uses(get_child(ast, i_exp), change);
+  }
+}
+
+/**
+ * Returns:
+ *   1 if evaluating ast can't fail, loop or allocate anything reachable
+ *   afterwards, so can be skipped if its value is unused
+ */
+static int is_pure(AST *ast) {
+  switch (ast->tag) {
+    case integer_exp:
+    case var_exp:
+    case lambda_exp:
+      return 1;
+    case if_exp:
+    case let_exp:
+      for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+        if (!is_pure(get_child(ast, i_exp))) {
+          return 0;
+        }
+      }
+      return 1;
+    case list_exp: {
+      // Only primitives that can't fail, as calls might do anything
+      char *name = get_primitive(ast);
+      return name != NULL && strcmp(name, "div") != 0 &&
+             strcmp(name, "mod") != 0 && is_pure(get_child(ast, 1)) &&
+             is_pure(get_child(ast, 2));
+    }
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Removes ast's dead bindings, innermost first, so that those only used by
+ * removed definitions are removed too.
+ */
+static void shake(AST *ast) {
+  for (int i_exp = 0; i_exp < get_n_children(ast); ++i_exp) {
+    shake(get_child(ast, i_exp));
+  }
+  if (ast->tag == let_exp && ast->content.letExp->n_uses == 0 &&
+      is_pure(ast->content.letExp->defn)) {
+    SLetExp *let = ast->content.letExp;
+    count_uses(let->defn, -1);
+    free_ast(let->defn);
+    // The body's symbol table only holds the unused variable
+    replace_node(ast, let->body);
+    free(let);
+  }
+}
+
+void shake_tree(AST *global) {
+  count_uses(global, 1);
+  shake(global);
+}
@@ -0,0 +1,7 @@
+#include "ast.h"
+#ifndef SHAKE_H
+#define SHAKE_H
+
+void shake_tree(AST *global);
+
+#endif
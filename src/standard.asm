@@ -1,51 +1,133 @@
 bits 64
-	global plus, minus, equals
+	default rel				; so it links into position-independent code
+	global lfl_plus, lfl_minus, lfl_equals, lfl_times, lfl_div, lfl_mod
+	global lfl_less, lfl_greater
+	global _plus, _minus, _equals, _times, _div, _mod, _less, _greater
+	global gc_call
+	extern gc_frames, division_by_zero
 	section .text
+; Integers are tagged: n is represented as 2n+1
 _plus:
-	push 	rbp
-	mov 	rbp, rsp
-	mov 	rax, rdi	 		; pointer to 1st param
-	mov 	rbx, QWORD [rax] 	; 1st param
-	mov 	rcx, QWORD [rax+8]	; 2nd param
-	mov		rax, rbx
-	add 	rax, rcx
-	pop 	rbp
+	lea		rax, [rdi+rsi-1]	; (2a+1) + (2b+1) - 1
 	ret
 
 _minus:
-	push 	rbp
-	mov 	rbp, rsp
-	mov 	rax, rdi	 		; pointer to 1st param
-	mov 	rbx, QWORD [rax] 	; 1st param
-	mov 	rcx, QWORD [rax+8]	; 2nd param
-	mov		rax, rbx
-	sub 	rax, rcx
-	pop 	rbp
+	mov		rax, rdi	 		; 1st param
+	sub 	rax, rsi			; 2nd param
+	or		rax, 1				; (2a+1) - (2b+1) + 1
 	ret
 
 _equals:
-	push 	rbp
-	mov 	rbp, rsp
-	mov 	rax, rdi	 		; pointer to 1st param
-	mov 	rbx, QWORD [rax] 	; 1st param
-	mov 	rcx, QWORD [rax+8]	; 2nd param
-	cmp		rbx, rcx
+	cmp		rdi, rsi
 	je		LEqual
-	mov 	rax, 0
-	jmp		LDone
+	mov 	rax, 1				; 0
+	ret
 LEqual: 
-	mov		rax, 1
-LDone:
-	pop 	rbp
+	mov		rax, 3				; 1
+	ret
+
+_times:
+	mov		rax, rdi
+	sar		rax, 1				; a
+	lea		rcx, [rsi-1]		; 2b
+	imul	rax, rcx
+	or		rax, 1				; 2ab + 1
+	ret
+
+_div:
+	mov		rax, rdi
+	sar		rax, 1				; a
+	mov		rcx, rsi
+	sar		rcx, 1				; b
+	jz		LDivideByZero
+	cqo
+	idiv	rcx
+	lea		rax, [rax*2+1]		; quotient, rounded towards 0
+	ret
+
+_mod:
+	mov		rax, rdi
+	sar		rax, 1				; a
+	mov		rcx, rsi
+	sar		rcx, 1				; b
+	jz		LDivideByZero
+	cqo
+	idiv	rcx
+	lea		rax, [rdx*2+1]		; remainder, with the sign of a
+	ret
+
+LDivideByZero:
+	jmp		division_by_zero	; doesn't return
+
+; Tagging keeps integers' order, so they're compared tagged
+_less:
+	cmp		rdi, rsi
+	setl	al
+	movzx	eax, al
+	lea		rax, [rax*2+1]
 	ret
 
+_greater:
+	cmp		rdi, rsi
+	setg	al
+	movzx	eax, al
+	lea		rax, [rax*2+1]
+	ret
+
+; Calls the C function in r11 with args in rdi and rsi, from generated code
+; that may collect garbage. Generated code keeps values in rbx and r12-r15,
+; so they're saved in a frame that the collector scans (laid out as in gc.h),
+; and reloaded from it afterwards, updated.
+gc_call:
+	push	rbp
+	mov		rbp, rsp
+	sub		rsp, 64				; header and 6 slots, to keep alignment
+	mov		rax, [gc_frames]
+	mov		[rbp-8], rax		; link frame for collector
+	mov		QWORD [rbp-16], 6	; number of slots
+	mov		[gc_frames], rbp
+	mov		[rbp-24], rbx
+	mov		[rbp-32], r12
+	mov		[rbp-40], r13
+	mov		[rbp-48], r14
+	mov		[rbp-56], r15
+	mov		QWORD [rbp-64], 1	; unused, so integer 0
+	call	r11
+	mov		rbx, [rbp-24]
+	mov		r12, [rbp-32]
+	mov		r13, [rbp-40]
+	mov		r14, [rbp-48]
+	mov		r15, [rbp-56]
+	mov		rcx, [rbp-8]
+	mov		[gc_frames], rcx	; unlink frame
+	leave
+	ret
+
+; Closures of the functions, for passing them as values. Named apart from the
+; C library's functions, such as div, which they would otherwise replace.
 	section .data
-plus:
+	align 8
+lfl_plus:
 	dq 	1, _plus, 2, 0
 
-minus:	
+lfl_minus:	
 	dq	1, _minus, 2, 0
 
-equals:
+lfl_equals:
 	dq	1, _equals, 2, 0
 
+lfl_times:
+	dq	1, _times, 2, 0
+
+lfl_div:
+	dq	1, _div, 2, 0
+
+lfl_mod:
+	dq	1, _mod, 2, 0
+
+lfl_less:
+	dq	1, _less, 2, 0
+
+lfl_greater:
+	dq	1, _greater, 2, 0
+
@@ -0,0 +1,48 @@
+#include "tail.h"
+#include "ast.h"
+#include "eval.h"
+#include "known.h"
+
+/**
+ * Returns:
+ *   1 if call can be made by jumping: it's of the function itself, which
+ *   reassigns its args, or passes all its operands in registers
+ */
+static int can_jump(AST *call) {
+  AST *first = call->content.listExp->first;
+  return (first->tag == var_exp && first->content.varExp->is_recursive) ||
+         call->content.listExp->rest->len <= N_ARG_REGISTERS;
+}
+
+static void mark_tail_position(AST *ast) {
+  switch (ast->tag) {
+    case if_exp:
+      mark_tail_position(ast->content.ifExp->case_true);
+      mark_tail_position(ast->content.ifExp->case_false);
+      break;
+    case let_exp:
+      mark_tail_position(ast->content.letExp->body);
+      break;
+    case list_exp:
+      // Primitives are computed inline, so there's nothing to jump to
+      if (get_primitive(ast) == NULL && can_jump(ast)) {
+        ast->content.listExp->is_tail = 1;
+      }
+      break;
+    default:
+      // Not a call, so the function returns the value itself
+      break;
+  }
+}
+
+/**
+ * Marks the calls whose result a lifted function returns, which eval compiles
+ * into jumps. Memo functions store the result before returning it, so don't
+ * make tail calls.
+ */
+void mark_tail_calls(AST *lambda) {
+  if (lambda->content.lambdaExp->is_memo) {
+    return;
+  }
+  mark_tail_position(lambda->content.lambdaExp->body);
+}
@@ -0,0 +1,7 @@
+#include "ast.h"
+#ifndef TAIL_H
+#define TAIL_H
+
+void mark_tail_calls(AST *lambda);
+
+#endif
@@ -46,6 +46,7 @@ int tokenise(FILE *fp, LL *list) {
     if (tokenise_state == IN_COMMENT) {
       if (ch == '\n') {
         pos_line++;
+        pos_char = -1;
         tokenise_state = IN_WHITESPACE;
       }
     } else {
@@ -71,8 +72,13 @@ int tokenise(FILE *fp, LL *list) {
           tokenise_state = IN_COMMENT;
           break;
         case '\n':
+          if (tokenise_state == IN_SYMBOL) {
+            add_token(list, symbol, pos_line, start_char);
+          }
+          tokenise_state = IN_WHITESPACE;
           pos_line++;
-          // Intentional fall-through
+          pos_char = -1;  // Positions are within the line
+          break;
         case ' ':
         case '\t':
           if (tokenise_state == IN_SYMBOL) {
@@ -5,8 +5,8 @@
 
 typedef struct Token {
   char *name;
-  int line;
-  int start_char;
+  int line;        // 0-indexed
+  int start_char;  // 0-indexed within the line
   int end_char;
 } Token;
 
@@ -124,6 +124,355 @@
   [ "$output" = "4" ]
 }
 
+@test "example_free_vars" {
+  bin/compile examples/example_free_vars.code example_free_vars.asm > /dev/null
+  nasm -f elf64 example_free_vars.asm -o example_free_vars.o
+  gcc -no-pie -o example_free_vars example_free_vars.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_free_vars
+  [ "$status" -eq 0 ]
+  [ "$output" = "15" ]
+}
+
+@test "example_many_args" {
+  bin/compile examples/example_many_args.code example_many_args.asm > /dev/null
+  nasm -f elf64 example_many_args.asm -o example_many_args.o
+  gcc -no-pie -o example_many_args example_many_args.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_many_args
+  [ "$status" -eq 0 ]
+  [ "$output" = "31" ]
+}
+
+@test "example_gc" {
+  bin/compile examples/example_gc.code example_gc.asm > /dev/null
+  nasm -f elf64 example_gc.asm -o example_gc.o
+  gcc -no-pie -o example_gc example_gc.o lib/libclosure.a lib/libstandard.a; 
+  run env LFL_HEAP_LIMIT=1m ./example_gc
+  [ "$status" -eq 0 ]
+  [ "$output" = "30000" ]
+}
+
+@test "example_gc_live" {
+  bin/compile examples/example_gc_live.code example_gc_live.asm > /dev/null
+  nasm -f elf64 example_gc_live.asm -o example_gc_live.o
+  gcc -no-pie -o example_gc_live example_gc_live.o lib/libclosure.a lib/libstandard.a; 
+  run env LFL_HEAP_LIMIT=1m ./example_gc_live
+  [ "$status" -eq 0 ]
+  [ "$output" = "30012" ]
+}
+
+@test "example_spill" {
+  run bin/compile --ir examples/example_spill.code example_spill.asm
+  [ "$status" -eq 0 ]
+  [ "$(echo "$output" | grep -c '\] = acc    ; let')" -gt 0 ]
+  nasm -f elf64 example_spill.asm -o example_spill.o
+  gcc -no-pie -o example_spill example_spill.o lib/libclosure.a lib/libstandard.a; 
+  run env LFL_HEAP_LIMIT=1m ./example_spill
+  [ "$status" -eq 0 ]
+  [ "$output" = "2300000" ]
+}
+
+@test "example_memo" {
+  bin/compile examples/example_memo.code example_memo.asm > /dev/null
+  nasm -f elf64 example_memo.asm -o example_memo.o
+  gcc -no-pie -o example_memo example_memo.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_memo
+  [ "$status" -eq 0 ]
+  [ "$output" = "1134903170" ]
+}
+
+@test "example_memo_lambda" {
+  bin/compile examples/example_memo_lambda.code example_memo_lambda.asm > /dev/null
+  nasm -f elf64 example_memo_lambda.asm -o example_memo_lambda.o
+  gcc -no-pie -o example_memo_lambda example_memo_lambda.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_memo_lambda
+  [ "$status" -eq 0 ]
+  [ "$output" = "102334155" ]
+}
+
+@test "example_memo_free_vars" {
+  bin/compile examples/example_memo_free_vars.code example_memo_free_vars.asm > /dev/null
+  nasm -f elf64 example_memo_free_vars.asm -o example_memo_free_vars.o
+  gcc -no-pie -o example_memo_free_vars example_memo_free_vars.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_memo_free_vars
+  [ "$status" -eq 0 ]
+  [ "$output" = "8997" ]
+}
+
+@test "example_tail" {
+  bin/compile examples/example_tail.code example_tail.asm > /dev/null
+  nasm -f elf64 example_tail.asm -o example_tail.o
+  gcc -no-pie -o example_tail example_tail.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_tail
+  [ "$status" -eq 0 ]
+  [ "$output" = "10000001" ]
+}
+
+@test "example_known" {
+  bin/compile examples/example_known.code example_known.asm > /dev/null
+  [ "$(grep -c 'call _f[0-9]* .*known call' example_known.asm)" -eq 1 ]
+  [ "$(grep -c 'call \[r10' example_known.asm)" -eq 0 ]
+  nasm -f elf64 example_known.asm -o example_known.o
+  gcc -no-pie -o example_known example_known.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_known
+  [ "$status" -eq 0 ]
+  [ "$output" = "5" ]
+}
+
+@test "example_arithmetic" {
+  bin/compile examples/example_arithmetic.code example_arithmetic.asm > /dev/null
+  nasm -f elf64 example_arithmetic.asm -o example_arithmetic.o
+  gcc -no-pie -o example_arithmetic example_arithmetic.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_arithmetic
+  [ "$status" -eq 0 ]
+  [ "$output" = "-38" ]
+}
+
+@test "standard_closure_symbols" {
+  run nm -g lib/libstandard.a
+  [ "$status" -eq 0 ]
+  [[ "$output" == *" D lfl_div"* ]]
+  [[ "$output" != *" D div"* ]]
+}
+
+@test "example_fold" {
+  bin/compile examples/example_fold.code example_fold.asm > /dev/null
+  [ "$(grep -v extern example_fold.asm | grep -c 'imul\|idiv\|times\|greater')" -eq 0 ]
+  [ "$(grep -c '^_f[0-9]*:' example_fold.asm)" -eq 0 ]
+  grep -q 'mov rax, 99 .*integer constant 49' example_fold.asm
+  nasm -f elf64 example_fold.asm -o example_fold.o
+  gcc -no-pie -o example_fold example_fold.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_fold
+  [ "$status" -eq 0 ]
+  [ "$output" = "49" ]
+}
+
+@test "example_shake" {
+  bin/compile examples/example_shake.code example_shake.asm > /dev/null
+  [ "$(grep -c '^_f[0-9]*:' example_shake.asm)" -eq 0 ]
+  nasm -f elf64 example_shake.asm -o example_shake.o
+  gcc -no-pie -o example_shake example_shake.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_shake
+  [ "$status" -eq 0 ]
+  [ "$output" = "27" ]
+}
+
+@test "example_inline" {
+  run bin/compile --ir examples/example_inline.code example_inline.asm
+  [ "$status" -eq 0 ]
+  [ "$(echo "$output" | grep -c 'call ')" -eq 1 ]
+  [ "$(grep -c '^_f[0-9]*:' example_inline.asm)" -eq 1 ]
+  nasm -f elf64 example_inline.asm -o example_inline.o
+  gcc -no-pie -o example_inline example_inline.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_inline
+  [ "$status" -eq 0 ]
+  [ "$output" = "29" ]
+}
+
+@test "example_escape" {
+  bin/compile examples/example_escape.code example_escape.asm > /dev/null
+  nasm -f elf64 example_escape.asm -o example_escape.o
+  gcc -no-pie -o example_escape example_escape.o lib/libclosure.a lib/libstandard.a; 
+  run env LFL_HEAP_LIMIT=1k ./example_escape
+  [ "$status" -eq 0 ]
+  [ "$output" = "50005000" ]
+}
+
+@test "example_lift" {
+  bin/compile examples/example_lift.code example_lift.asm > /dev/null
+  nasm -f elf64 example_lift.asm -o example_lift.o
+  gcc -no-pie -o example_lift example_lift.o lib/libclosure.a lib/libstandard.a; 
+  run env LFL_HEAP_LIMIT=1k ./example_lift
+  [ "$status" -eq 0 ]
+  [ "$output" = "165" ]
+}
+
+@test "example_static" {
+  bin/compile examples/example_static.code example_static.asm > /dev/null
+  [ "$(grep -A2 'section .rodata' example_static.asm | grep -c '^_f[0-9]*_closure:')" -ge 1 ]
+  grep -q 'mov [a-z0-9]*, _f[0-9]*_closure' example_static.asm
+  nasm -f elf64 example_static.asm -o example_static.o
+  gcc -no-pie -o example_static example_static.o lib/libclosure.a lib/libstandard.a; 
+  run env LFL_HEAP_LIMIT=1k ./example_static
+  [ "$status" -eq 0 ]
+  [ "$output" = "1000" ]
+}
+
+@test "example_lift_known" {
+  bin/compile examples/example_lift_known.code example_lift_known.asm > /dev/null
+  [ "$(grep -c 'call _f[0-9]* .*known call' example_lift_known.asm)" -eq 2 ]
+  [ "$(grep -c 'call \[r10' example_lift_known.asm)" -eq 0 ]
+  nasm -f elf64 example_lift_known.asm -o example_lift_known.o
+  gcc -no-pie -o example_lift_known example_lift_known.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_lift_known
+  [ "$status" -eq 0 ]
+  [ "$output" = "31" ]
+}
+
+@test "example_ifs" {
+  run bin/compile --ir examples/example_ifs.code example_ifs.asm
+  [ "$status" -eq 0 ]
+  [[ "$output" == *"if not acc goto L"* ]]
+  nasm -f elf64 example_ifs.asm -o example_ifs.o
+  gcc -no-pie -o example_ifs example_ifs.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_ifs
+  [ "$status" -eq 0 ]
+  [ "$output" = "10" ]
+}
+
+@test "example_cse" {
+  run bin/compile --ir examples/example_cse.code example_cse.asm
+  [ "$status" -eq 0 ]
+  [ "$(echo "$output" | grep -c 'plus(')" -eq 2 ]
+  nasm -f elf64 example_cse.asm -o example_cse.o
+  gcc -no-pie -o example_cse example_cse.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_cse
+  [ "$status" -eq 0 ]
+  [ "$output" = "505" ]
+}
+
+@test "example_slots" {
+  run bin/compile examples/example_slots.code example_slots.asm
+  [ "$status" -eq 0 ]
+  [ "$(grep 'memory for local' example_slots.asm | grep -o '[0-9]*' | sort -n | tail -1)" -le 128 ]
+  nasm -f elf64 example_slots.asm -o example_slots.o
+  gcc -no-pie -o example_slots example_slots.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_slots
+  [ "$status" -eq 0 ]
+  [ "$output" = "44745" ]
+}
+
+@test "example_stdout" {
+  bin/compile --stdout examples/example.code > example_stdout.asm
+  [ "$(head -1 example_stdout.asm)" = "; Assembly code generated by compiler" ]
+  nasm -f elf64 example_stdout.asm -o example_stdout.o
+  gcc -no-pie -o example_stdout example_stdout.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_stdout
+  [ "$status" -eq 0 ]
+  [ "$output" = "2" ]
+}
+
+@test "example_elf" {
+  run bin/compile --elf examples/example_ifs.code example_elf.o
+  [ "$status" -eq 0 ]
+  gcc -no-pie -o example_elf example_elf.o lib/libclosure.a lib/libstandard.a
+  run ./example_elf
+  [ "$status" -eq 0 ]
+  [ "$output" = "10" ]
+}
+
+# Every example, assembled by --elf, behaves as when assembled by NASM. Reports
+# of profiled builds go to stderr, and differ in their cycle counts.
+@test "example_elf_all" {
+  for flags in "" --profile --heap-profile; do
+    errors=/dev/stdout
+    [ -z "$flags" ] || errors=/dev/null
+    for code in examples/*.code; do
+      bin/compile $flags $code example_elf_nasm.asm > /dev/null
+      nasm -f elf64 example_elf_nasm.asm -o example_elf_nasm.o
+      gcc -no-pie -o example_elf_nasm example_elf_nasm.o lib/libclosure.a lib/libstandard.a
+      bin/compile --elf $flags $code example_elf_all.o > /dev/null
+      gcc -no-pie -o example_elf_all example_elf_all.o lib/libclosure.a lib/libstandard.a
+      expected_status=0
+      expected=$(./example_elf_nasm 2> $errors) || expected_status=$?
+      actual_status=0
+      actual=$(./example_elf_all 2> $errors) || actual_status=$?
+      echo "$code $flags: '$actual' ($actual_status)"
+      [ "$actual" = "$expected" ]
+      [ "$actual_status" -eq "$expected_status" ]
+    done
+  done
+}
+
+@test "example_run" {
+  [ "$(bin/compile --run examples/example_ifs.code 2>/dev/null)" = "10" ]
+  run bin/compile --run examples/example_ifs.code
+  [ "$status" -eq 0 ]
+  [[ "$output" == *"Compiled in"*"ran in"* ]]
+}
+
+# Programs run by --run print and exit as when linked, including on errors,
+# with the compiler's messages and timing only on stderr
+@test "example_run_linked" {
+  for name in example_factorial example_gc example_spill error_call_integer error_division_by_zero; do
+    bin/compile examples/$name.code example_run_linked.asm > /dev/null
+    nasm -f elf64 example_run_linked.asm -o example_run_linked.o
+    gcc -no-pie -o example_run_linked example_run_linked.o lib/libclosure.a lib/libstandard.a
+    expected_status=0
+    expected=$(env LFL_HEAP_LIMIT=1m ./example_run_linked 2> example_run_linked.err) || expected_status=$?
+    actual_status=0
+    actual=$(env LFL_HEAP_LIMIT=1m bin/compile --run examples/$name.code 2> example_run.err) || actual_status=$?
+    echo "$name: '$actual' ($actual_status)"
+    [ "$actual" = "$expected" ]
+    [ "$actual_status" -eq "$expected_status" ]
+    [ "$(grep 'ERROR!' example_run.err)" = "$(cat example_run_linked.err)" ]
+    [[ "$actual" != *"Compiled in"* ]]
+    if [ "$expected_status" -eq 0 ]; then
+      grep -q 'Compiled in .* ran in' example_run.err
+    fi
+  done
+}
+
+@test "example_factorial_peephole" {
+  run bin/compile examples/example_factorial.code example_factorial_peephole.asm
+  [ "$status" -eq 0 ]
+  [[ "$output" == *"after peephole optimisation"* ]]
+  [ "$(grep -c 'sete' example_factorial_peephole.asm)" -eq 0 ]
+  nasm -f elf64 example_factorial_peephole.asm -o example_factorial_peephole.o
+  gcc -no-pie -o example_factorial_peephole example_factorial_peephole.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_factorial_peephole
+  [ "$status" -eq 0 ]
+  [ "$output" = "120" ]
+}
+
+@test "example_factorial_profile" {
+  bin/compile --profile examples/example_factorial.code example_factorial_profile.asm > /dev/null
+  nasm -f elf64 example_factorial_profile.asm -o example_factorial_profile.o
+  gcc -no-pie -o example_factorial_profile example_factorial_profile.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_factorial_profile
+  [ "$status" -eq 0 ]
+  [[ "$output" == *"profile: functions by inclusive cycles"* ]]
+  [[ "$output" == *" fac "*"18:1"* ]]
+}
+
+@test "example_profile_tail" {
+  bin/compile --profile examples/example_profile_tail.code example_profile_tail.asm > /dev/null
+  nasm -f elf64 example_profile_tail.asm -o example_profile_tail.o
+  gcc -no-pie -o example_profile_tail example_profile_tail.o lib/libclosure.a lib/libstandard.a; 
+  run ./example_profile_tail
+  [ "$status" -eq 0 ]
+  [ "$(echo "$output" | awk '$5 == "8:5" { print $1 }')" = "4" ]
+  [ "$(echo "$output" | awk '$4 == "add-all" { print $1 }')" = "1" ]
+  [ "$(echo "$output" | tail -1)" = "28" ]
+}
+
+@test "example_gc_heap_profile" {
+  bin/compile --heap-profile examples/example_gc.code example_gc_heap_profile.asm > /dev/null
+  nasm -f elf64 example_gc_heap_profile.asm -o example_gc_heap_profile.o
+  gcc -no-pie -o example_gc_heap_profile example_gc_heap_profile.o lib/libclosure.a lib/libstandard.a; 
+  run env LFL_HEAP_LIMIT=1m LFL_HEAP_PROFILE=example_gc_heap_profile.tsv ./example_gc_heap_profile
+  [ "$status" -eq 0 ]
+  [ "$output" = "30000" ]
+  run awk -F '\t' '$2 == "_f1" { print $3 ":" $4, $5 }' example_gc_heap_profile.tsv
+  [ "$output" = "12:20 30000" ]
+}
+
+@test "error_call_integer" {
+  bin/compile examples/error_call_integer.code error_call_integer.asm > /dev/null
+  nasm -f elf64 error_call_integer.asm -o error_call_integer.o
+  gcc -no-pie -o error_call_integer error_call_integer.o lib/libclosure.a lib/libstandard.a; 
+  run ./error_call_integer
+  [ "$status" -gt 0 ]
+}
+
+@test "error_division_by_zero" {
+  bin/compile examples/error_division_by_zero.code error_division_by_zero.asm > /dev/null
+  nasm -f elf64 error_division_by_zero.asm -o error_division_by_zero.o
+  gcc -no-pie -o error_division_by_zero error_division_by_zero.o lib/libclosure.a lib/libstandard.a; 
+  run ./error_division_by_zero
+  [ "$status" -gt 0 ]
+  [ "$output" = "ERROR! Division by zero." ]
+}
+
 @test "error_unmatched_open" {
   run bin/compile examples/error_unmatched_open.code error_unmatched_open.asm
   [ "$status" -gt 0 ]